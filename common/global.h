@@ -10,6 +10,7 @@ struct mpv_global {
     struct mp_client_api *client_api;
     char *configdir;
     struct stats_base *stats;
+    struct mkv_uid_cache *mkv_uid_cache;
 };
 
 #endif
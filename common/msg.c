@@ -45,6 +45,9 @@
 
 #define TERM_BUF 100
 
+// Size of the per-thread log file buffer. Must be a power of 2.
+#define LOG_RING_SIZE (64 * 1024)
+
 struct mp_log_root {
     struct mpv_global *global;
     pthread_mutex_t lock;
@@ -77,9 +80,60 @@ struct mp_log_root {
     pthread_t log_file_thread;
     // --- owner thread only, but frozen while log_file_thread is running
     FILE *log_file;
-    struct mp_log_buffer *log_file_buffer;
     // --- protected by log_file_lock
     bool log_file_thread_active; // also termination signal for the thread
+    struct log_ring **log_rings; // one per thread that wrote to the log file
+    int num_log_rings;
+    struct log_large_line *large_lines; // lines too large for any ring
+    int num_large_lines;
+    // --- log_file_thread only
+    // (Not allocated under the root, as other threads allocate on it.)
+    struct log_drain *drain_rings;
+    int num_drain_rings;
+    struct log_large_line *drain_large;
+    int num_drain_large;
+    char *drain_buf;
+    // --- must be accessed atomically
+    atomic_bool log_file_enabled;
+    atomic_bool log_file_wakeup_pending;
+    mp_atomic_uint64 log_file_seq;
+    // Incremented when a log file is closed. Lines queued for an older log
+    // file (by threads that were just writing when it was closed) are skipped.
+    atomic_uint log_file_epoch;
+    // --- immutable
+    pthread_key_t log_ring_key;  // current thread's struct log_ring
+    bool log_ring_key_valid;
+};
+
+// Single-producer single-consumer ring buffer of formatted log file lines.
+// Each thread writes to its own ring, so logging doesn't need to take any
+// locks, and can't be blocked by the log file thread. If the ring is full,
+// the message is dropped and counted instead.
+struct log_ring {
+    mp_atomic_uint64 write_pos;     // only advanced by the owning thread
+    mp_atomic_uint64 read_pos;      // only advanced by log_file_thread
+    mp_atomic_uint64 dropped;       // messages that didn't fit
+    atomic_bool dead;               // owning thread has exited
+    char data[LOG_RING_SIZE];
+};
+
+struct log_drain {
+    struct log_ring *ring;
+    uint64_t end;                   // write_pos when the drain started
+};
+
+// Followed by size bytes of text in the ring.
+struct log_ring_entry {
+    uint64_t seq;                   // from log_file_seq, for ordering
+    uint32_t size;
+    uint32_t epoch;                 // log_file_epoch when queued
+};
+
+// A line that doesn't fit into a ring even if it's empty. These are rare, and
+// are queued on a list protected by log_file_lock instead.
+struct log_large_line {
+    struct log_ring_entry entry;
+    char *text;                     // entry.size bytes
 };
 
 struct mp_log {
@@ -89,7 +143,9 @@ struct mp_log {
     int max_level;              // minimum log level for this instance
     int level;                  // minimum log level for any outputs
     int terminal_level;         // minimum log level for terminal output
+    int locked_level;           // minimum log level for outputs except log file
     atomic_ulong reload_counter;
+    atomic_bool has_partial;    // partial[0] != '\0'
     char *partial;
 };
 
@@ -133,18 +189,17 @@ static void update_loglevel(struct mp_log *log)
     log->terminal_level = log->level;
     for (int n = 0; n < log->root->num_buffers; n++) {
         int buffer_level = log->root->buffers[n]->level;
-        if (buffer_level == MP_LOG_BUFFER_MSGL_LOGFILE)
-            buffer_level = MSGL_DEBUG;
         if (buffer_level != MP_LOG_BUFFER_MSGL_TERM)
             log->level = MPMAX(log->level, buffer_level);
     }
-    if (log->root->log_file)
-        log->level = MPMAX(log->level, MSGL_DEBUG);
     if (log->root->stats_file)
         log->level = MPMAX(log->level, MSGL_STATS);
+    log->locked_level = MPMIN(log->level, log->max_level);
+    if (log->root->log_file)
+        log->level = MPMAX(log->level, MSGL_DEBUG);
     log->level = MPMIN(log->level, log->max_level);
     if (root->really_quiet)
-        log->level = -1;
+        log->level = log->locked_level = -1;
     atomic_store(&log->reload_counter, atomic_load(&log->root->reload_counter));
     pthread_mutex_unlock(&root->lock);
 }
@@ -346,27 +401,7 @@ static void write_msg_to_buffers(struct mp_log *log, int lev, char *text)
         int buffer_level = buffer->level;
         if (buffer_level == MP_LOG_BUFFER_MSGL_TERM)
             buffer_level = log->terminal_level;
-        if (buffer_level == MP_LOG_BUFFER_MSGL_LOGFILE)
-            buffer_level = MPMAX(log->terminal_level, MSGL_DEBUG);
         if (lev <= buffer_level && lev != MSGL_STATUS) {
-            if (buffer->level == MP_LOG_BUFFER_MSGL_LOGFILE) {
-                // If the buffer is full, block until we can write again.
-                bool dead = false;
-                while (buffer->num_entries == buffer->capacity && !dead) {
-                    // Temporary unlock is OK; buffer->level is immutable, and
-                    // buffer can't go away because the global log lock is held.
-                    pthread_mutex_unlock(&buffer->lock);
-                    pthread_mutex_lock(&root->log_file_lock);
-                    if (root->log_file_thread_active) {
-                        pthread_cond_wait(&root->log_file_wakeup,
-                                          &root->log_file_lock);
-                    } else {
-                        dead = true;
-                    }
-                    pthread_mutex_unlock(&root->log_file_lock);
-                    pthread_mutex_lock(&buffer->lock);
-                }
-            }
             if (buffer->num_entries == buffer->capacity) {
                 struct mp_log_buffer_entry *skip = log_buffer_read(buffer);
                 talloc_free(skip);
@@ -390,6 +425,157 @@ static void write_msg_to_buffers(struct mp_log *log, int lev, char *text)
     }
 }
 
+static void log_ring_thread_exit(void *p)
+{
+    struct log_ring *ring = p;
+    atomic_store(&ring->dead, true);
+}
+
+// Return the calling thread's log file ring, creating it if needed.
+static struct log_ring *get_log_ring(struct mp_log_root *root)
+{
+    if (!root->log_ring_key_valid)
+        return NULL;
+
+    struct log_ring *ring = pthread_getspecific(root->log_ring_key);
+    if (!ring) {
+        ring = talloc_zero(NULL, struct log_ring);
+        if (pthread_setspecific(root->log_ring_key, ring)) {
+            talloc_free(ring);
+            return NULL;
+        }
+        pthread_mutex_lock(&root->log_file_lock);
+        MP_TARRAY_APPEND(NULL, root->log_rings, root->num_log_rings, ring);
+        pthread_mutex_unlock(&root->log_file_lock);
+    }
+    return ring;
+}
+
+static void log_ring_write(struct log_ring *ring, uint64_t pos,
+                           const void *data, size_t size)
+{
+    size_t offset = pos & (LOG_RING_SIZE - 1);
+    size_t part = MPMIN(size, LOG_RING_SIZE - offset);
+    memcpy(ring->data + offset, data, part);
+    memcpy(ring->data, (const char *)data + part, size - part);
+}
+
+static void log_ring_read(struct log_ring *ring, uint64_t pos, void *data,
+                          size_t size)
+{
+    size_t offset = pos & (LOG_RING_SIZE - 1);
+    size_t part = MPMIN(size, LOG_RING_SIZE - offset);
+    memcpy(data, ring->data + offset, part);
+    memcpy((char *)data + part, ring->data, size - part);
+}
+
+// Queue a single line (including its "\n") for the log file. This doesn't
+// take any locks in the normal case, and never waits for the log file thread.
+static void write_log_file(struct mp_log *log, int lev, const char *text,
+                           size_t len)
+{
+    struct mp_log_root *root = log->root;
+
+    if (lev == MSGL_STATUS || lev == MSGL_STATS ||
+        lev > MPMAX(log->terminal_level, MSGL_DEBUG))
+        return;
+
+    // (Must be read before checking whether the log file is enabled.)
+    unsigned int epoch = atomic_load(&root->log_file_epoch);
+    if (!atomic_load(&root->log_file_enabled))
+        return;
+
+    struct log_ring *ring = get_log_ring(root);
+    if (!ring)
+        return;
+
+    char head[40];
+    int head_len = snprintf(head, sizeof(head), "[%8.3f][%c][",
+                            (mp_time_us() - MP_START_TIME) / 1e6,
+                            mp_log_levels[lev][0]);
+    head_len = MPCLAMP(head_len, 0, sizeof(head) - 1);
+    size_t prefix_len = strlen(log->verbose_prefix);
+
+    struct log_ring_entry entry = {
+        .size = head_len + prefix_len + 2 + len,
+        .epoch = epoch,
+    };
+
+    if (sizeof(entry) + entry.size > LOG_RING_SIZE) {
+        struct log_large_line line = {
+            .entry = entry,
+            .text = talloc_asprintf(NULL, "%s%s] %.*s", head,
+                                    log->verbose_prefix, (int)len, text),
+        };
+        pthread_mutex_lock(&root->log_file_lock);
+        line.entry.seq = atomic_fetch_add(&root->log_file_seq, 1);
+        MP_TARRAY_APPEND(NULL, root->large_lines, root->num_large_lines, line);
+        atomic_store(&root->log_file_wakeup_pending, true);
+        pthread_cond_broadcast(&root->log_file_wakeup);
+        pthread_mutex_unlock(&root->log_file_lock);
+        return;
+    }
+
+    uint64_t pos = atomic_load(&ring->write_pos);
+    uint64_t used = pos - atomic_load(&ring->read_pos);
+    if (sizeof(entry) + entry.size > LOG_RING_SIZE - used) {
+        atomic_fetch_add(&ring->dropped, 1);
+        return;
+    }
+
+    entry.seq = atomic_fetch_add(&root->log_file_seq, 1);
+    uint64_t p = pos;
+    log_ring_write(ring, p, &entry, sizeof(entry));
+    p += sizeof(entry);
+    log_ring_write(ring, p, head, head_len);
+    p += head_len;
+    log_ring_write(ring, p, log->verbose_prefix, prefix_len);
+    p += prefix_len;
+    log_ring_write(ring, p, "] ", 2);
+    p += 2;
+    log_ring_write(ring, p, text, len);
+    p += len;
+    atomic_store(&ring->write_pos, p);
+
+    // Only the first writer after the log file thread went to sleep needs to
+    // wake it up.
+    if (!atomic_exchange(&root->log_file_wakeup_pending, true)) {
+        pthread_mutex_lock(&root->log_file_lock);
+        pthread_cond_broadcast(&root->log_file_wakeup);
+        pthread_mutex_unlock(&root->log_file_lock);
+    }
+}
+
+// Messages which go to the log file only are formatted and queued without
+// taking root->lock. Returns false if the message needs the normal path
+// (because it doesn't end with a newline).
+static bool write_log_file_only(struct mp_log *log, int lev,
+                                const char *format, va_list va)
+{
+    char buf[4096];
+    va_list copy;
+    va_copy(copy, va);
+    int len = vsnprintf(buf, sizeof(buf), format, va);
+    char *text = buf;
+    if (len >= (int)sizeof(buf))
+        text = talloc_vasprintf(NULL, format, copy);
+    va_end(copy);
+
+    bool ok = len > 0 && text && text[len - 1] == '\n';
+    if (ok) {
+        char *line = text;
+        while (line[0]) {
+            char *end = strchr(line, '\n');
+            write_log_file(log, lev, line, end - line + 1);
+            line = end + 1;
+        }
+    }
+
+    if (text != buf)
+        talloc_free(text);
+    return ok;
+}
+
 static void dump_stats(struct mp_log *log, int lev, char *text)
 {
     struct mp_log_root *root = log->root;
@@ -404,6 +590,15 @@ void mp_msg_va(struct mp_log *log, int lev, const char *format, va_list va)
 
     struct mp_log_root *root = log->root;
 
+    if (lev > log->locked_level && !atomic_load(&log->has_partial)) {
+        va_list copy;
+        va_copy(copy, va);
+        bool done = write_log_file_only(log, lev, format, copy);
+        va_end(copy);
+        if (done)
+            return;
+    }
+
     pthread_mutex_lock(&root->lock);
 
     root->buffer.len = 0;
@@ -435,6 +630,7 @@ void mp_msg_va(struct mp_log *log, int lev, const char *format, va_list va)
             next[0] = '\0';
             print_terminal_line(log, lev, text, "");
             write_msg_to_buffers(log, lev, text);
+            write_log_file(log, lev, text, next - text);
             next[0] = saved;
             text = next;
         }
@@ -448,6 +644,7 @@ void mp_msg_va(struct mp_log *log, int lev, const char *format, va_list va)
                 log->partial = talloc_realloc(NULL, log->partial, char, size);
             memcpy(log->partial, text, size);
         }
+        atomic_store(&log->has_partial, !!log->partial[0]);
     }
 
     pthread_mutex_unlock(&root->lock);
@@ -519,6 +716,8 @@ void mp_msg_init(struct mpv_global *global)
     pthread_mutex_init(&root->lock, NULL);
     pthread_mutex_init(&root->log_file_lock, NULL);
     pthread_cond_init(&root->log_file_wakeup, NULL);
+    root->log_ring_key_valid =
+        !pthread_key_create(&root->log_ring_key, log_ring_thread_exit);
 
     struct mp_log dummy = { .root = root };
     struct mp_log *log = mp_log_new(root, &dummy, "");
@@ -526,44 +725,140 @@ void mp_msg_init(struct mpv_global *global)
     global->log = log;
 }
 
-static void *log_file_thread(void *p)
+// Write all log file lines that were queued when this was called, ordered by
+// their sequence numbers. Lines queued meanwhile are left for the next call, so
+// that a busy thread can't starve rings that were added later.
+// The order between threads is best-effort only: a line gets its sequence
+// number before it is visible in its ring, so if it becomes visible only after
+// the drain started, it is written after lines with higher sequence numbers
+// from other threads. (Lines of a single thread are always in order.)
+static void drain_log_rings(struct mp_log_root *root)
 {
-    struct mp_log_root *root = p;
-
-    mpthread_set_name("log-file");
+    unsigned int epoch = atomic_load(&root->log_file_epoch);
 
     pthread_mutex_lock(&root->log_file_lock);
+    MPSWAP(struct log_large_line *, root->large_lines, root->drain_large);
+    root->num_drain_large = root->num_large_lines;
+    root->num_large_lines = 0;
+    root->num_drain_rings = 0;
+    for (int n = root->num_log_rings - 1; n >= 0; n--) {
+        struct log_ring *ring = root->log_rings[n];
+        // The read position is owned by this thread. The write position can't
+        // change anymore if the owner exited.
+        if (atomic_load(&ring->dead) &&
+            atomic_load(&ring->read_pos) == atomic_load(&ring->write_pos) &&
+            !atomic_load(&ring->dropped))
+        {
+            MP_TARRAY_REMOVE_AT(root->log_rings, root->num_log_rings, n);
+            talloc_free(ring);
+            continue;
+        }
+        struct log_drain drain = {ring, atomic_load(&ring->write_pos)};
+        MP_TARRAY_APPEND(NULL, root->drain_rings, root->num_drain_rings, drain);
+    }
+    pthread_mutex_unlock(&root->log_file_lock);
 
-    while (root->log_file_thread_active) {
-        struct mp_log_buffer_entry *e =
-            mp_msg_log_buffer_read(root->log_file_buffer);
-        if (e) {
-            pthread_mutex_unlock(&root->log_file_lock);
-            fprintf(root->log_file, "[%8.3f][%c][%s] %s",
+    for (int n = 0; n < root->num_drain_rings; n++) {
+        struct log_ring *ring = root->drain_rings[n].ring;
+        uint64_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped) {
+            fprintf(root->log_file, "[%8.3f][%c][overflow] log file buffer "
+                    "overflow: %"PRIu64" messages skipped\n",
                     (mp_time_us() - MP_START_TIME) / 1e6,
-                    mp_log_levels[e->level][0], e->prefix, e->text);
-            fflush(root->log_file);
-            pthread_mutex_lock(&root->log_file_lock);
-            talloc_free(e);
-            // Multiple threads might be blocked if the log buffer was full.
-            pthread_cond_broadcast(&root->log_file_wakeup);
-        } else {
-            pthread_cond_wait(&root->log_file_wakeup, &root->log_file_lock);
+                    mp_log_levels[MSGL_WARN][0], dropped);
         }
     }
 
-    pthread_mutex_unlock(&root->log_file_lock);
+    while (1) {
+        struct log_ring *next = NULL;
+        struct log_ring_entry next_entry = {0};
+        for (int n = 0; n < root->num_drain_rings; n++) {
+            struct log_ring *ring = root->drain_rings[n].ring;
+            uint64_t pos = atomic_load(&ring->read_pos);
+            struct log_ring_entry entry;
+            while (pos != root->drain_rings[n].end) {
+                log_ring_read(ring, pos, &entry, sizeof(entry));
+                if (entry.epoch == epoch)
+                    break;
+                pos += sizeof(entry) + entry.size;
+                atomic_store(&ring->read_pos, pos);
+            }
+            if (pos == root->drain_rings[n].end)
+                continue;
+            if (!next || entry.seq < next_entry.seq) {
+                next = ring;
+                next_entry = entry;
+            }
+        }
 
-    return NULL;
+        struct log_large_line *large = NULL;
+        for (int n = 0; n < root->num_drain_large; n++) {
+            struct log_large_line *line = &root->drain_large[n];
+            if (line->text && (!large || line->entry.seq < large->entry.seq))
+                large = line;
+        }
+
+        if (large && (!next || large->entry.seq < next_entry.seq)) {
+            if (large->entry.epoch == epoch)
+                fwrite(large->text, large->entry.size, 1, root->log_file);
+            TA_FREEP(&large->text);
+            continue;
+        }
+
+        if (!next)
+            break;
+
+        uint64_t pos = atomic_load(&next->read_pos) + sizeof(next_entry);
+        MP_TARRAY_GROW(NULL, root->drain_buf, next_entry.size);
+        log_ring_read(next, pos, root->drain_buf, next_entry.size);
+        atomic_store(&next->read_pos, pos + next_entry.size);
+        fwrite(root->drain_buf, next_entry.size, 1, root->log_file);
+    }
+    root->num_drain_large = 0;
+
+    fflush(root->log_file);
+}
+
+// Discard everything queued for the log file. Only while log_file_thread is
+// not running, as it owns the read positions otherwise.
+static void reset_log_rings(struct mp_log_root *root)
+{
+    pthread_mutex_lock(&root->log_file_lock);
+    for (int n = 0; n < root->num_log_rings; n++) {
+        struct log_ring *ring = root->log_rings[n];
+        atomic_store(&ring->read_pos, atomic_load(&ring->write_pos));
+        atomic_store(&ring->dropped, 0);
+    }
+    for (int n = 0; n < root->num_large_lines; n++)
+        talloc_free(root->large_lines[n].text);
+    root->num_large_lines = 0;
+    pthread_mutex_unlock(&root->log_file_lock);
 }
 
-static void wakeup_log_file(void *p)
+static void *log_file_thread(void *p)
 {
     struct mp_log_root *root = p;
 
+    mpthread_set_name("log-file");
+
     pthread_mutex_lock(&root->log_file_lock);
-    pthread_cond_broadcast(&root->log_file_wakeup);
+
+    while (root->log_file_thread_active) {
+        atomic_store(&root->log_file_wakeup_pending, false);
+        pthread_mutex_unlock(&root->log_file_lock);
+        drain_log_rings(root);
+        pthread_mutex_lock(&root->log_file_lock);
+        if (root->log_file_thread_active &&
+            !atomic_load(&root->log_file_wakeup_pending))
+            pthread_cond_wait(&root->log_file_wakeup, &root->log_file_lock);
+    }
+
     pthread_mutex_unlock(&root->log_file_lock);
+
+    // Write what was queued before termination.
+    drain_log_rings(root);
+
+    return NULL;
 }
 
 // Only to be called from the main thread.
@@ -571,6 +866,8 @@ static void terminate_log_file_thread(struct mp_log_root *root)
 {
     bool wait_terminate = false;
 
+    atomic_store(&root->log_file_enabled, false);
+
     pthread_mutex_lock(&root->log_file_lock);
     if (root->log_file_thread_active) {
         root->log_file_thread_active = false;
@@ -582,12 +879,17 @@ static void terminate_log_file_thread(struct mp_log_root *root)
     if (wait_terminate)
         pthread_join(root->log_file_thread, NULL);
 
-    mp_msg_log_buffer_destroy(root->log_file_buffer);
-    root->log_file_buffer = NULL;
-
     if (root->log_file)
         fclose(root->log_file);
     root->log_file = NULL;
+
+    // Threads which were writing a line while the log file was disabled may
+    // still queue it. Make sure it doesn't end up in the next log file.
+    atomic_fetch_add(&root->log_file_epoch, 1);
+    reset_log_rings(root);
+
+    // Log levels depend on whether a log file is open.
+    atomic_fetch_add(&root->reload_counter, 1);
 }
 
 // If opt is different from *current_path, update *current_path and return true.
@@ -641,15 +943,15 @@ void mp_msg_update_msglevels(struct mpv_global *global, struct MPOpts *opts)
         if (root->log_path) {
             root->log_file = fopen(root->log_path, "wb");
             if (root->log_file) {
-                root->log_file_buffer =
-                    mp_msg_log_buffer_new(global, 100, MP_LOG_BUFFER_MSGL_LOGFILE,
-                                          wakeup_log_file, root);
                 root->log_file_thread_active = true;
                 if (pthread_create(&root->log_file_thread, NULL, log_file_thread,
                                    root))
                 {
                     root->log_file_thread_active = false;
                     terminate_log_file_thread(root);
+                } else {
+                    atomic_store(&root->log_file_enabled, true);
+                    atomic_fetch_add(&root->reload_counter, 1);
                 }
             } else {
                 mp_err(global->log, "Failed to open log file '%s'\n",
@@ -699,6 +1001,17 @@ void mp_msg_uninit(struct mpv_global *global)
 {
     struct mp_log_root *root = global->log->root;
     terminate_log_file_thread(root);
+    if (root->log_ring_key_valid)
+        pthread_key_delete(root->log_ring_key);
+    for (int n = 0; n < root->num_log_rings; n++)
+        talloc_free(root->log_rings[n]);
+    talloc_free(root->log_rings);
+    for (int n = 0; n < root->num_large_lines; n++)
+        talloc_free(root->large_lines[n].text);
+    talloc_free(root->large_lines);
+    talloc_free(root->drain_large);
+    talloc_free(root->drain_rings);
+    talloc_free(root->drain_buf);
     mp_msg_log_buffer_destroy(root->early_buffer);
     assert(root->num_buffers == 0);
     if (root->stats_file)
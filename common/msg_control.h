@@ -24,8 +24,6 @@ struct mp_log_buffer_entry {
 
 // Use --msg-level option for log level of this log buffer
 #define MP_LOG_BUFFER_MSGL_TERM (MSGL_MAX + 1)
-// For --log-file; --msg-level, but at least MSGL_DEBUG
-#define MP_LOG_BUFFER_MSGL_LOGFILE (MSGL_MAX + 2)
 
 struct mp_log_buffer;
 struct mp_log_buffer *mp_msg_log_buffer_new(struct mpv_global *global,
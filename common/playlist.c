@@ -58,6 +58,8 @@ static void playlist_update_indexes(struct playlist *pl, int start, int end)
 
     for (int n = start; n < end; n++)
         pl->entries[n]->pl_index = n;
+
+    pl->change_counter++;
 }
 
 void playlist_add(struct playlist *pl, struct playlist_entry *add)
@@ -68,6 +70,7 @@ void playlist_add(struct playlist *pl, struct playlist_entry *add)
     add->pl_index = pl->num_entries - 1;
     add->id = ++pl->id_alloc;
     talloc_steal(pl, add);
+    pl->change_counter++;
 }
 
 void playlist_entry_unref(struct playlist_entry *e)
@@ -218,6 +221,7 @@ void playlist_add_base_path(struct playlist *pl, bstr base_path)
             e->filename = new_file;
         }
     }
+    pl->change_counter++;
 }
 
 // Add redirected_from as new redirect entry to each item in pl.
@@ -75,6 +75,9 @@ struct playlist {
     bool current_was_replaced;
 
     uint64_t id_alloc;
+
+    // Incremented on every change to the entry list or the entries.
+    uint64_t change_counter;
 };
 
 void playlist_entry_add_param(struct playlist_entry *e, bstr name, bstr value);
@@ -17,23 +17,41 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <libavutil/md5.h>
+
+#include "config.h"
+
+#if HAVE_POSIX
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
 #include "cache.h"
 #include "common/msg.h"
 #include "common/av_common.h"
+#include "common/stats.h"
 #include "demux.h"
 #include "options/path.h"
 #include "options/m_config.h"
 #include "options/m_option.h"
+#include "osdep/atomic.h"
 #include "osdep/io.h"
+#include "osdep/threads.h"
+#include "osdep/timer.h"
 
 struct demux_cache_opts {
     char *cache_dir;
     int unlink_files;
+    int persistent;
+    int mmap;
 };
 
 #define OPT_BASE_STRUCT struct demux_cache_opts
@@ -44,6 +62,8 @@ const struct m_sub_options demux_cache_conf = {
         {"cache-unlink-files", OPT_CHOICE(unlink_files,
             {"immediate", 2}, {"whendone", 1}, {"no", 0}),
         },
+        {"cache-persistent", OPT_FLAG(persistent)},
+        {"cache-mmap", OPT_FLAG(mmap)},
         {0}
     },
     .size = sizeof(struct demux_cache_opts),
@@ -58,9 +78,62 @@ struct demux_cache {
 
     char *filename;
     bool need_unlink;
+    bool persistent;        // filename is derived from the media URL
+    char *index_filename;   // if persistent
+    void *index;            // index loaded on creation, if any
+    size_t index_size;
     int fd;
-    int64_t file_pos;
-    uint64_t file_size;
+    uint64_t file_size;     // including data still queued for writing
+    struct stats_ctx *stats;
+
+    pthread_t writer;
+    bool writer_running;
+
+    // Serializes seek+read/write if pread()/pwritev() are not available.
+    pthread_mutex_t io_lock;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    // --- Protected by lock.
+    bool terminate;
+    bool write_failed;      // disk error; queue discarded, writes rejected
+    struct write_block **queue; // serialized packets, ascending/adjacent pos
+    int num_queue;
+    size_t queued_bytes;
+    uint64_t written_size;  // file contents up to this are on disk
+
+    // For --cache-mmap. segments[n] maps the file range starting at
+    // n * MAP_SEGMENT_SIZE, or is NULL if not mapped yet.
+    struct map_segment **segments;
+    int num_segments;
+};
+
+// File range mapped at once for --cache-mmap. Packets crossing a segment
+// boundary are read normally.
+#define MAP_SEGMENT_SIZE (64 * 1024 * 1024)
+
+// A mapped part of the cache file. Referenced by demux_cache, and by each
+// packet buffer pointing into it; those may outlive the cache.
+struct map_segment {
+    uint8_t *ptr;
+    atomic_int refs;
+};
+
+// Limit for serialized packets not written to disk yet. If this is exceeded,
+// demux_cache_write() blocks until the writer thread catches up.
+#define MAX_QUEUED_BYTES (16 * 1024 * 1024)
+
+// Limits for a single write call.
+#define MAX_BATCH_BLOCKS 64
+#define MAX_BATCH_BYTES (4 * 1024 * 1024)
+
+// One serialized packet (pkt_header, data, padding, side data). The data is
+// followed by AV_INPUT_BUFFER_PADDING_SIZE zero bytes, so mapped packet data
+// can be passed to libavcodec as is.
+struct write_block {
+    uint64_t pos;
+    size_t size;
+    uint8_t data[];
 };
 
 struct pkt_header {
@@ -74,30 +147,148 @@ struct sd_header {
     uint32_t len;
 };
 
+static void *writer_thread(void *p);
+static bool flush_queue(struct demux_cache *cache);
+static void unmap_segments(struct demux_cache *cache);
+
 static void cache_destroy(void *p)
 {
     struct demux_cache *cache = p;
 
+    if (cache->writer_running) {
+        pthread_mutex_lock(&cache->lock);
+        cache->terminate = true;
+        pthread_cond_broadcast(&cache->wakeup);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->writer, NULL);
+    }
+
+    for (int n = 0; n < cache->num_queue; n++)
+        talloc_free(cache->queue[n]);
+
+    unmap_segments(cache);
+
     if (cache->fd >= 0)
         close(cache->fd);
 
+    pthread_cond_destroy(&cache->wakeup);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->io_lock);
+
     if (cache->need_unlink && cache->opts->unlink_files >= 1) {
         if (unlink(cache->filename))
             MP_ERR(cache, "Failed to delete cache temporary file.\n");
     }
 }
 
+static bool read_file(struct demux_cache *cache, const char *filename,
+                      void **out_data, size_t *out_size)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC | O_BINARY);
+    if (fd < 0)
+        return false;
+
+    bool ok = false;
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0 || st.st_size > INT32_MAX)
+        goto out;
+
+    void *data = talloc_size(cache, st.st_size);
+    size_t done = 0;
+    while (done < st.st_size) {
+        ssize_t res = read(fd, (char *)data + done, st.st_size - done);
+        if (res <= 0) {
+            talloc_free(data);
+            goto out;
+        }
+        done += res;
+    }
+
+    *out_data = data;
+    *out_size = done;
+    ok = true;
+out:
+    close(fd);
+    return ok;
+}
+
+// Try to open the cache file belonging to the given key. Returns false if
+// this isn't possible (caller falls back to a temporary file).
+static bool open_persistent(struct demux_cache *cache, const char *cache_dir,
+                            const char *key)
+{
+    uint8_t md5[16];
+    av_md5_sum(md5, key, strlen(key));
+    char *name = talloc_strdup(cache, "mpv-cache-");
+    for (int i = 0; i < 16; i++)
+        name = talloc_asprintf_append(name, "%02X", md5[i]);
+
+    cache->filename = mp_path_join(cache, cache_dir,
+                                   talloc_asprintf(cache, "%s.dat", name));
+    cache->index_filename = mp_path_join(cache, cache_dir,
+                                    talloc_asprintf(cache, "%s.idx", name));
+
+    cache->fd = open(cache->filename, O_RDWR | O_CREAT | O_CLOEXEC | O_BINARY,
+                     0600);
+    if (cache->fd < 0) {
+        MP_ERR(cache, "Failed to open persistent cache file.\n");
+        return false;
+    }
+
+#if HAVE_POSIX
+    // Another instance playing the same media would append to the same file.
+    if (flock(cache->fd, LOCK_EX | LOCK_NB)) {
+        MP_WARN(cache, "Persistent cache file is in use, not using it.\n");
+        close(cache->fd);
+        cache->fd = -1;
+        return false;
+    }
+#endif
+
+    // The index is consumed on load. If the player crashes, there is no index,
+    // and the (now unreferenced) cache file contents are discarded next time.
+    if (read_file(cache, cache->index_filename, &cache->index,
+                  &cache->index_size))
+    {
+        unlink(cache->index_filename);
+        MP_VERBOSE(cache, "Loaded cache index from %s.\n",
+                   cache->index_filename);
+    }
+
+    if (!cache->index) {
+        demux_cache_discard(cache);
+    } else {
+        off_t size = lseek(cache->fd, 0, SEEK_END);
+        if (size == (off_t)-1) {
+            MP_ERR(cache, "Failed to seek in cache file.\n");
+            TA_FREEP(&cache->index);
+            demux_cache_discard(cache);
+        } else {
+            cache->file_size = cache->written_size = size;
+        }
+    }
+
+    cache->persistent = true;
+    return true;
+}
+
 // Create a cache. This also initializes the cache file from the options. The
-// log parameter must stay valid until demux_cache is destroyed.
+// log parameter must stay valid until demux_cache is destroyed. If key is not
+// NULL and --cache-persistent is enabled, the cache file is derived from key
+// (normally the media URL), and is kept after the cache is destroyed.
 // Free with talloc_free().
 struct demux_cache *demux_cache_create(struct mpv_global *global,
-                                       struct mp_log *log)
+                                       struct mp_log *log, const char *key)
 {
     struct demux_cache *cache = talloc_zero(NULL, struct demux_cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->io_lock, NULL);
+    pthread_cond_init(&cache->wakeup, NULL);
     talloc_set_destructor(cache, cache_destroy);
     cache->opts = mp_get_config_group(cache, global, &demux_cache_conf);
     cache->log = log;
     cache->fd = -1;
+    cache->stats = stats_ctx_create(cache, global, "demux-cache");
 
     char *cache_dir = cache->opts->cache_dir;
     if (!(cache_dir && cache_dir[0])) {
@@ -105,6 +296,9 @@ struct demux_cache *demux_cache_create(struct mpv_global *global,
         goto fail;
     }
 
+    if (key && cache->opts->persistent && open_persistent(cache, cache_dir, key))
+        goto done;
+
     cache->filename = mp_path_join(cache, cache_dir, "mpv-cache-XXXXXX.dat");
     cache->fd = mp_mkostemps(cache->filename, 4, O_CLOEXEC);
     if (cache->fd < 0) {
@@ -120,79 +314,243 @@ struct demux_cache *demux_cache_create(struct mpv_global *global,
         }
     }
 
+done:
+    if (pthread_create(&cache->writer, NULL, writer_thread, cache)) {
+        MP_ERR(cache, "Failed to create cache writer thread.\n");
+        goto fail;
+    }
+    cache->writer_running = true;
+
     return cache;
 fail:
     talloc_free(cache);
     return NULL;
 }
 
-uint64_t demux_cache_get_size(struct demux_cache *cache)
+bool demux_cache_is_persistent(struct demux_cache *cache)
 {
-    return cache->file_size;
+    return cache->persistent;
 }
 
-static bool do_seek(struct demux_cache *cache, uint64_t pos)
+// Return the index that was saved with demux_cache_save_index() when the
+// cache file was last used. The caller takes ownership of the returned memory
+// (talloc child of ta_parent). Returns NULL if there is none.
+void *demux_cache_take_index(struct demux_cache *cache, void *ta_parent,
+                             size_t *size)
 {
-    if (cache->file_pos == pos)
-        return true;
-
-    off_t res = lseek(cache->fd, pos, SEEK_SET);
-
-    if (res == (off_t)-1) {
-        MP_ERR(cache, "Failed to seek in cache file.\n");
-        cache->file_pos = -1;
-    } else {
-        cache->file_pos = res;
-    }
-
-    return cache->file_pos >= 0;
+    void *index = cache->index;
+    *size = cache->index_size;
+    cache->index = NULL;
+    cache->index_size = 0;
+    return talloc_steal(ta_parent, index);
 }
 
-static bool write_raw(struct demux_cache *cache, void *ptr, size_t len)
+// Persist an opaque index describing the cache file contents. The next
+// demux_cache_create() call with the same key returns it again. Returns
+// success. (Writes a temporary file first, so the index on disk is never
+// partially written.)
+bool demux_cache_save_index(struct demux_cache *cache, void *data, size_t size)
 {
-    ssize_t res = write(cache->fd, ptr, len);
+    if (!cache->persistent)
+        return false;
 
-    if (res < 0) {
-        MP_ERR(cache, "Failed to write to cache file: %s\n", mp_strerror(errno));
+    // The index must not refer to data that is not on disk yet.
+    if (!flush_queue(cache))
         return false;
-    }
 
-    cache->file_pos += res;
-    cache->file_size = MPMAX(cache->file_size, cache->file_pos);
+    char *tmp = talloc_asprintf(NULL, "%s.tmp", cache->index_filename);
+    bool ok = false;
 
-    // Should never happen, unless the disk is full, or someone succeeded to
-    // trick us to write into a pipe or a socket.
-    if (res != len) {
-        MP_ERR(cache, "Could not write all data.\n");
-        return false;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_BINARY,
+                  0600);
+    if (fd < 0)
+        goto out;
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t res = write(fd, (char *)data + done, size - done);
+        if (res <= 0)
+            break;
+        done += res;
     }
 
-    return true;
+    ok = done == size;
+    if (close(fd))
+        ok = false;
+
+    if (ok && rename(tmp, cache->index_filename))
+        ok = false;
+    if (!ok)
+        unlink(tmp);
+
+out:
+    if (!ok)
+        MP_ERR(cache, "Failed to write cache index.\n");
+    talloc_free(tmp);
+    return ok;
 }
 
-static bool read_raw(struct demux_cache *cache, void *ptr, size_t len)
+// Throw away all data in the cache file. Must only be called if no packet
+// refers to it (this includes packets returned by demux_cache_read()).
+void demux_cache_discard(struct demux_cache *cache)
 {
-    ssize_t res = read(cache->fd, ptr, len);
+    flush_queue(cache);
+    unmap_segments(cache);
+
+    pthread_mutex_lock(&cache->lock);
+    if (ftruncate(cache->fd, 0))
+        MP_ERR(cache, "Failed to truncate cache file.\n");
+    cache->file_size = cache->written_size = 0;
+    cache->write_failed = false;
+    pthread_mutex_unlock(&cache->lock);
+}
 
-    if (res < 0) {
-        MP_ERR(cache, "Failed to read cache file: %s\n", mp_strerror(errno));
-        return false;
+uint64_t demux_cache_get_size(struct demux_cache *cache)
+{
+    return cache->file_size;
+}
+
+// Write the given blocks, which must be adjacent in the file.
+static bool write_blocks(struct demux_cache *cache, struct write_block **blocks,
+                         int num)
+{
+    uint64_t pos = blocks[0]->pos;
+
+#if HAVE_POSIX
+    struct iovec iov[MAX_BATCH_BLOCKS];
+    assert(num <= MAX_BATCH_BLOCKS);
+    for (int n = 0; n < num; n++)
+        iov[n] = (struct iovec){blocks[n]->data, blocks[n]->size};
+
+    struct iovec *cur = iov;
+    while (num > 0) {
+        ssize_t res = pwritev(cache->fd, cur, num, pos);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0) {
+            MP_ERR(cache, "Failed to write to cache file: %s\n",
+                   res < 0 ? mp_strerror(errno) : "short write");
+            return false;
+        }
+        pos += res;
+        // Skip fully written buffers, and adjust a partially written one.
+        while (num > 0 && res >= cur->iov_len) {
+            res -= cur->iov_len;
+            cur++;
+            num--;
+        }
+        if (num > 0) {
+            cur->iov_base = (char *)cur->iov_base + res;
+            cur->iov_len -= res;
+        }
+    }
+    return true;
+#else
+    bool ok = false;
+    pthread_mutex_lock(&cache->io_lock);
+    if (lseek(cache->fd, pos, SEEK_SET) == (off_t)-1) {
+        MP_ERR(cache, "Failed to seek in cache file.\n");
+        goto done;
+    }
+    for (int n = 0; n < num; n++) {
+        size_t done = 0;
+        while (done < blocks[n]->size) {
+            ssize_t res = write(cache->fd, blocks[n]->data + done,
+                                blocks[n]->size - done);
+            if (res <= 0) {
+                MP_ERR(cache, "Failed to write to cache file: %s\n",
+                       res < 0 ? mp_strerror(errno) : "short write");
+                goto done;
+            }
+            done += res;
+        }
     }
+    ok = true;
+done:
+    pthread_mutex_unlock(&cache->io_lock);
+    return ok;
+#endif
+}
 
-    cache->file_pos += res;
+static void *writer_thread(void *p)
+{
+    struct demux_cache *cache = p;
+    mpthread_set_name("demux-cache");
+    stats_register_thread_cputime(cache->stats, "cpu");
+
+    pthread_mutex_lock(&cache->lock);
+    while (1) {
+        if (!cache->num_queue) {
+            if (cache->terminate)
+                break;
+            pthread_cond_wait(&cache->wakeup, &cache->lock);
+            continue;
+        }
 
-    // Should never happen, unless the file was cut short, or someone succeeded
-    // to rick us to write into a pipe or a socket.
-    if (res != len) {
-        MP_ERR(cache, "Could not read all data.\n");
-        return false;
+        // Coalesce as many queued packets as possible into a single write.
+        // The blocks stay in the queue while being written, so that readers
+        // can still find them.
+        struct write_block *blocks[MAX_BATCH_BLOCKS];
+        int num = 0;
+        size_t bytes = 0;
+        while (num < cache->num_queue && num < MAX_BATCH_BLOCKS &&
+               (!num || bytes + cache->queue[num]->size <= MAX_BATCH_BYTES))
+        {
+            blocks[num] = cache->queue[num];
+            bytes += blocks[num]->size;
+            num++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        int64_t start = mp_time_us();
+        bool ok = write_blocks(cache, blocks, num);
+        int64_t end = mp_time_us();
+
+        pthread_mutex_lock(&cache->lock);
+        if (ok) {
+            cache->written_size = blocks[0]->pos + bytes;
+            for (int n = 0; n < num; n++)
+                talloc_free(blocks[n]);
+            cache->num_queue -= num;
+            memmove(cache->queue, cache->queue + num,
+                    cache->num_queue * sizeof(cache->queue[0]));
+            cache->queued_bytes -= bytes;
+            stats_event(cache->stats, "write-batch");
+            if (end > start)
+                stats_size_value(cache->stats, "write-rate",
+                                 bytes / ((end - start) / 1e6));
+        } else {
+            // Give up writing; reads of the lost packets will fail.
+            for (int n = 0; n < cache->num_queue; n++)
+                talloc_free(cache->queue[n]);
+            cache->num_queue = 0;
+            cache->queued_bytes = 0;
+            cache->write_failed = true;
+        }
+        stats_size_value(cache->stats, "queued-bytes", cache->queued_bytes);
+        pthread_cond_broadcast(&cache->wakeup);
     }
+    pthread_mutex_unlock(&cache->lock);
 
-    return true;
+    stats_unregister_thread(cache->stats, "cpu");
+    return NULL;
+}
+
+// Wait until all queued data is on disk. Returns false on write errors.
+static bool flush_queue(struct demux_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    while (cache->num_queue)
+        pthread_cond_wait(&cache->wakeup, &cache->lock);
+    bool ok = !cache->write_failed;
+    pthread_mutex_unlock(&cache->lock);
+    return ok;
 }
 
 // Serialize a packet to the cache file. Returns the packet position, which can
 // be passed to demux_cache_read() to read the packet again.
+// The data is written asynchronously, but demux_cache_read() can read it back
+// immediately.
 // Returns a negative value on errors, i.e. writing the file failed.
 int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *dp)
 {
@@ -212,22 +570,28 @@ int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *dp)
     assert(dp->avpacket->side_data_elems >= 0 &&
            dp->avpacket->side_data_elems <= INT32_MAX);
 
-    if (!do_seek(cache, cache->file_size))
-        return -1;
-
-    uint64_t pos = cache->file_pos;
-
     struct pkt_header hd = {
         .data_len  = dp->len,
         .av_flags = dp->avpacket->flags,
         .num_sd = dp->avpacket->side_data_elems,
     };
 
-    if (!write_raw(cache, &hd, sizeof(hd)))
-        goto fail;
+    size_t size = sizeof(hd) + dp->len + AV_INPUT_BUFFER_PADDING_SIZE;
+    for (int n = 0; n < dp->avpacket->side_data_elems; n++)
+        size += sizeof(struct sd_header) + dp->avpacket->side_data[n].size;
 
-    if (!write_raw(cache, dp->buffer, dp->len))
-        goto fail;
+    struct write_block *block =
+        talloc_size(NULL, sizeof(struct write_block) + size);
+    block->size = size;
+
+    uint8_t *ptr = block->data;
+    memcpy(ptr, &hd, sizeof(hd));
+    ptr += sizeof(hd);
+    if (dp->len)
+        memcpy(ptr, dp->buffer, dp->len);
+    ptr += dp->len;
+    memset(ptr, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    ptr += AV_INPUT_BUFFER_PADDING_SIZE;
 
     // The handling of FFmpeg side data requires an extra long comment to
     // explain why this code is fragile and insane.
@@ -261,47 +625,227 @@ int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *dp)
             .len = sd->size,
         };
 
-        if (!write_raw(cache, &sd_hd, sizeof(sd_hd)))
-            goto fail;
-        if (!write_raw(cache, sd->data, sd->size))
-            goto fail;
+        memcpy(ptr, &sd_hd, sizeof(sd_hd));
+        ptr += sizeof(sd_hd);
+        memcpy(ptr, sd->data, sd->size);
+        ptr += sd->size;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    // Backpressure if the disk can't keep up.
+    while (cache->queued_bytes > MAX_QUEUED_BYTES && !cache->write_failed)
+        pthread_cond_wait(&cache->wakeup, &cache->lock);
+
+    int64_t pos = -1;
+    if (!cache->write_failed) {
+        pos = block->pos = cache->file_size;
+        cache->file_size += size;
+        MP_TARRAY_APPEND(cache, cache->queue, cache->num_queue, block);
+        cache->queued_bytes += size;
+        block = NULL;
+        stats_size_value(cache->stats, "queued-bytes", cache->queued_bytes);
+        pthread_cond_broadcast(&cache->wakeup);
     }
 
+    pthread_mutex_unlock(&cache->lock);
+
+    talloc_free(block);
     return pos;
+}
 
-fail:
-    // Reset file_size (try not to append crap forever).
-    do_seek(cache, pos);
-    cache->file_size = cache->file_pos;
-    return -1;
+// Source for packet deserialization: either a write_block still in memory, or
+// the cache file.
+struct read_ctx {
+    struct demux_cache *cache;
+    uint64_t pos;
+    struct write_block *block;
+};
+
+static bool read_raw(struct read_ctx *r, void *ptr, size_t len)
+{
+    struct demux_cache *cache = r->cache;
+
+    if (r->block) {
+        uint64_t offset = r->pos - r->block->pos;
+        if (offset > r->block->size || len > r->block->size - offset) {
+            MP_ERR(cache, "Could not read all data.\n");
+            return false;
+        }
+        memcpy(ptr, r->block->data + offset, len);
+        r->pos += len;
+        return true;
+    }
+
+#if HAVE_POSIX
+    size_t done = 0;
+    while (done < len) {
+        ssize_t res = pread(cache->fd, (char *)ptr + done, len - done,
+                            r->pos + done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res < 0) {
+            MP_ERR(cache, "Failed to read cache file: %s\n", mp_strerror(errno));
+            return false;
+        }
+        // Should never happen, unless the file was cut short.
+        if (res == 0) {
+            MP_ERR(cache, "Could not read all data.\n");
+            return false;
+        }
+        done += res;
+    }
+#else
+    pthread_mutex_lock(&cache->io_lock);
+    bool ok = lseek(cache->fd, r->pos, SEEK_SET) != (off_t)-1;
+    ssize_t res = ok ? read(cache->fd, ptr, len) : -1;
+    pthread_mutex_unlock(&cache->io_lock);
+    if (res < 0) {
+        MP_ERR(cache, "Failed to read cache file: %s\n", mp_strerror(errno));
+        return false;
+    }
+    if (res != len) {
+        MP_ERR(cache, "Could not read all data.\n");
+        return false;
+    }
+#endif
+
+    r->pos += len;
+    return true;
 }
 
-struct demux_packet *demux_cache_read(struct demux_cache *cache, uint64_t pos)
+static struct write_block *find_queued_block(struct demux_cache *cache,
+                                             uint64_t pos)
 {
-    if (!do_seek(cache, pos))
+    int lo = 0, hi = cache->num_queue;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cache->queue[mid]->pos < pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < cache->num_queue && cache->queue[lo]->pos == pos)
+        return cache->queue[lo];
+    return NULL;
+}
+
+static void unref_segment(struct map_segment *seg)
+{
+    if (atomic_fetch_add(&seg->refs, -1) == 1) {
+#if HAVE_POSIX
+        munmap(seg->ptr, MAP_SEGMENT_SIZE);
+#endif
+        talloc_free(seg);
+    }
+}
+
+static void unmap_segments(struct demux_cache *cache)
+{
+    for (int n = 0; n < cache->num_segments; n++) {
+        if (cache->segments[n])
+            unref_segment(cache->segments[n]);
+    }
+    TA_FREEP(&cache->segments);
+    cache->num_segments = 0;
+}
+
+static void free_mapped_buffer(void *opaque, uint8_t *data)
+{
+    unref_segment(opaque);
+}
+
+// Return a packet referencing data_len bytes at pos in the mapped file, or
+// NULL if this is not possible (caller falls back to reading).
+static struct demux_packet *map_packet_data(struct demux_cache *cache,
+                                            uint64_t pos, size_t data_len)
+{
+#if HAVE_POSIX
+    uint64_t index = pos / MAP_SEGMENT_SIZE;
+    uint64_t offset = pos % MAP_SEGMENT_SIZE;
+    if (!data_len || data_len > INT_MAX ||
+        offset + data_len + AV_INPUT_BUFFER_PADDING_SIZE > MAP_SEGMENT_SIZE ||
+        index >= INT_MAX)
         return NULL;
 
+    if (index >= cache->num_segments) {
+        int old = cache->num_segments;
+        MP_TARRAY_GROW(cache, cache->segments, index);
+        cache->num_segments = index + 1;
+        for (int n = old; n < cache->num_segments; n++)
+            cache->segments[n] = NULL;
+    }
+
+    struct map_segment *seg = cache->segments[index];
+    if (!seg) {
+        // Mapping beyond the end of the file is allowed; only written data
+        // is ever accessed.
+        void *ptr = mmap(NULL, MAP_SEGMENT_SIZE, PROT_READ, MAP_SHARED,
+                         cache->fd, index * MAP_SEGMENT_SIZE);
+        if (ptr == MAP_FAILED) {
+            MP_WARN(cache, "Failed to map cache file: %s\n", mp_strerror(errno));
+            return NULL;
+        }
+        seg = talloc_zero(NULL, struct map_segment);
+        seg->ptr = ptr;
+        atomic_store(&seg->refs, 1);
+        cache->segments[index] = seg;
+    }
+
+    atomic_fetch_add(&seg->refs, 1);
+    AVBufferRef *buf = av_buffer_create(seg->ptr + offset, data_len,
+                                        free_mapped_buffer, seg,
+                                        AV_BUFFER_FLAG_READONLY);
+    if (!buf) {
+        unref_segment(seg);
+        return NULL;
+    }
+
+    struct demux_packet *dp = new_demux_packet_from_buf(buf);
+    av_buffer_unref(&buf);
+    return dp;
+#else
+    return NULL;
+#endif
+}
+
+static struct demux_packet *read_packet(struct read_ctx *r)
+{
+    struct demux_cache *cache = r->cache;
     struct pkt_header hd;
 
-    if (!read_raw(cache, &hd, sizeof(hd)))
+    if (!read_raw(r, &hd, sizeof(hd)))
         return NULL;
 
     if (hd.data_len >= (size_t)-1)
         return NULL;
 
-    struct demux_packet *dp = new_demux_packet(hd.data_len);
-    if (!dp)
-        goto fail;
+    struct demux_packet *dp = NULL;
 
-    if (!read_raw(cache, dp->buffer, dp->len))
-        goto fail;
+    // Reference the data directly from the file mapping. The padding is part
+    // of the file and zeroed too.
+    if (cache->opts->mmap && !r->block)
+        dp = map_packet_data(cache, r->pos, hd.data_len);
+
+    if (dp) {
+        r->pos += dp->len;
+    } else {
+        dp = new_demux_packet(hd.data_len);
+        if (!dp)
+            goto fail;
+
+        if (!read_raw(r, dp->buffer, dp->len))
+            goto fail;
+    }
+    r->pos += AV_INPUT_BUFFER_PADDING_SIZE;
 
     dp->avpacket->flags = hd.av_flags;
 
     for (uint32_t n = 0; n < hd.num_sd; n++) {
         struct sd_header sd_hd;
 
-        if (!read_raw(cache, &sd_hd, sizeof(sd_hd)))
+        if (!read_raw(r, &sd_hd, sizeof(sd_hd)))
             goto fail;
 
         if (sd_hd.len > INT_MAX)
@@ -312,7 +856,7 @@ struct demux_packet *demux_cache_read(struct demux_cache *cache, uint64_t pos)
         if (!sd)
             goto fail;
 
-        if (!read_raw(cache, sd, sd_hd.len))
+        if (!read_raw(r, sd, sd_hd.len))
             goto fail;
     }
 
@@ -322,3 +866,23 @@ fail:
     talloc_free(dp);
     return NULL;
 }
+
+struct demux_packet *demux_cache_read(struct demux_cache *cache, uint64_t pos)
+{
+    struct read_ctx r = { .cache = cache, .pos = pos };
+
+    pthread_mutex_lock(&cache->lock);
+    bool on_disk = pos < cache->written_size;
+    if (!on_disk) {
+        // Not written yet (or lost due to a write error). The writer thread
+        // never modifies or frees blocks while they're queued, but they're
+        // freed after writing, so read them under the lock.
+        r.block = find_queued_block(cache, pos);
+        struct demux_packet *dp = r.block ? read_packet(&r) : NULL;
+        pthread_mutex_unlock(&cache->lock);
+        return dp;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return read_packet(&r);
+}
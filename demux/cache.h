@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 struct demux_packet;
@@ -9,8 +11,14 @@ struct mpv_global;
 struct demux_cache;
 
 struct demux_cache *demux_cache_create(struct mpv_global *global,
-                                       struct mp_log *log);
+                                       struct mp_log *log, const char *key);
 
 int64_t demux_cache_write(struct demux_cache *cache, struct demux_packet *pkt);
 struct demux_packet *demux_cache_read(struct demux_cache *cache, uint64_t pos);
 uint64_t demux_cache_get_size(struct demux_cache *cache);
+
+bool demux_cache_is_persistent(struct demux_cache *cache);
+void *demux_cache_take_index(struct demux_cache *cache, void *ta_parent,
+                             size_t *size);
+bool demux_cache_save_index(struct demux_cache *cache, void *data, size_t size);
+void demux_cache_discard(struct demux_cache *cache);
@@ -87,6 +87,7 @@ static const demuxer_desc_t *const demuxer_list[] = {
 struct demux_opts {
     int enable_cache;
     int disk_cache;
+    int compress_cache;
     int64_t max_bytes;
     int64_t max_bytes_bw;
     int donate_fw;
@@ -120,6 +121,7 @@ const struct m_sub_options demux_conf = {
         {"demuxer-max-back-bytes", OPT_BYTE_SIZE(max_bytes_bw),
             M_RANGE(0, M_MAX_MEM_BYTES)},
         {"demuxer-donate-buffer", OPT_FLAG(donate_fw)},
+        {"demuxer-cache-compress", OPT_FLAG(compress_cache)},
         {"force-seekable", OPT_FLAG(force_seekable)},
         {"cache-secs", OPT_DOUBLE(min_secs_cache), M_RANGE(0, DBL_MAX),
             .deprecation_message = "will use unlimited time"},
@@ -207,10 +209,19 @@ struct demux_internal {
     int events;
 
     struct demux_cache *cache;
+    // Index loaded from a persistent cache file, not restored yet.
+    void *cache_index;
+    size_t cache_index_size;
+    // Identity of the media for the persistent cache (see init_cache_identity).
+    bool cache_identity_valid;
+    int64_t cache_stream_size;
+    int64_t cache_mtime;
 
     bool warned_queue_overflow;
     bool eof;                   // whether we're in EOF state
     double min_secs;
+    double min_secs_opts;       // min_secs as set by options
+    double min_secs_override;   // demux_set_min_readahead()
     size_t max_bytes;
     size_t max_bytes_bw;
     bool seekable_cache;
@@ -328,10 +339,6 @@ struct demux_cached_range {
 #define QUEUE_INDEX_ENTRY(queue, idx) \
     ((queue)->index[((queue)->index0 + (idx)) & QUEUE_INDEX_SIZE_MASK(queue)])
 
-// Don't index packets whose timestamps that are within the last index entry by
-// this amount of time (it's better to seek them manually).
-#define INDEX_STEP_SIZE 1.0
-
 struct index_entry {
     double pts;
     struct demux_packet *pkt;
@@ -360,6 +367,9 @@ struct demux_queue {
     struct demux_packet *keyframe_latest;
     struct demux_packet *keyframe_first; // cached value of first KF packet
 
+    // last packet examined for compression (--demuxer-cache-compress)
+    struct demux_packet *compress_last;
+
     // incrementally maintained seek range, possibly invalid
     double seek_start, seek_end;
     double last_pruned;     // timestamp of last pruned keyframe
@@ -372,6 +382,9 @@ struct demux_queue {
     size_t index_size;          // size of index[] (0 or a power of 2)
     size_t index0;              // first index entry
     size_t num_index;           // number of index entries (wraps on index_size)
+    // Keyframes were not in PTS order; the index is empty and stays unused
+    // until the queue is cleared, and seeks scan the packet list instead.
+    bool index_unsorted;
 };
 
 struct demux_stream {
@@ -465,6 +478,10 @@ static void find_backward_restart_pos(struct demux_stream *ds);
 static struct demux_packet *find_seek_target(struct demux_queue *queue,
                                              double pts, int flags);
 static void prune_old_packets(struct demux_internal *in);
+static void update_opts(struct demux_internal *in);
+static void update_min_secs(struct demux_internal *in);
+static void save_cache_index(struct demux_internal *in);
+static void restore_cache_index(struct demux_internal *in);
 static void dumper_close(struct demux_internal *in);
 static void demux_convert_tags_charset(struct demuxer *demuxer);
 
@@ -706,6 +723,8 @@ static void remove_head_packet(struct demux_queue *queue)
         queue->keyframe_first = NULL;
     if (queue->keyframe_latest == dp)
         queue->keyframe_latest = NULL;
+    if (queue->compress_last == dp)
+        queue->compress_last = NULL;
     queue->is_bof = false;
 
     uint64_t end_pos = dp->next ? dp->next->cum_pos : queue->tail_cum_pos;
@@ -755,6 +774,7 @@ static void clear_queue(struct demux_queue *queue)
     queue->head = queue->tail = NULL;
     queue->keyframe_first = NULL;
     queue->keyframe_latest = NULL;
+    queue->compress_last = NULL;
     queue->seek_start = queue->seek_end = queue->last_pruned = MP_NOPTS_VALUE;
 
     queue->correct_dts = queue->correct_pos = true;
@@ -764,6 +784,7 @@ static void clear_queue(struct demux_queue *queue)
 
     queue->is_eof = false;
     queue->is_bof = false;
+    queue->index_unsorted = false;
 }
 
 static void clear_cached_range(struct demux_internal *in,
@@ -920,6 +941,11 @@ static void update_stream_selection_state(struct demux_internal *in,
 
     ds_clear_reader_state(ds, true);
 
+    // Cached ranges can be restored only once something is selected, or they
+    // would be immediately pruned as empty.
+    if (ds->selected && in->cache_index)
+        restore_cache_index(in);
+
     // Make sure any stream reselection or addition is reflected in the seek
     // ranges, and also get rid of data that is not needed anymore (or
     // rather, which can't be kept consistent). This has to happen after we've
@@ -1102,9 +1128,14 @@ static void demux_shutdown(struct demux_internal *in)
     demuxer->priv = NULL;
     in->d_thread->priv = NULL;
 
+    if (in->cache && demux_cache_is_persistent(in->cache))
+        save_cache_index(in);
+
     demux_flush(demuxer);
     assert(in->total_bytes == 0);
 
+    TA_FREEP(&in->cache_index);
+
     in->current_range = NULL;
     free_empty_cached_ranges(in);
 
@@ -1114,6 +1145,8 @@ static void demux_shutdown(struct demux_internal *in)
     if (in->owns_stream)
         free_stream(demuxer->stream);
     demuxer->stream = NULL;
+
+    demux_packet_release_arena();
 }
 
 static void demux_dealloc(struct demux_internal *in)
@@ -1253,6 +1286,21 @@ void demux_start_prefetch(struct demuxer *demuxer)
     pthread_mutex_unlock(&in->lock);
 }
 
+// Read ahead at least the given amount of seconds, even if the options
+// specify less. Used to prefetch playlist entries. 0 restores the default.
+// (This is still bounded by the cache size limits.)
+void demux_set_min_readahead(struct demuxer *demuxer, double secs)
+{
+    struct demux_internal *in = demuxer->in;
+    assert(demuxer == in->d_user);
+
+    pthread_mutex_lock(&in->lock);
+    in->min_secs_override = secs;
+    update_min_secs(in);
+    pthread_cond_signal(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
+}
+
 const char *stream_type_name(enum stream_type type)
 {
     switch (type) {
@@ -1611,7 +1659,22 @@ static void back_demux_see_packets(struct demux_stream *ds)
         find_backward_restart_pos(ds);
 }
 
-// Add the keyframe to the end of the index. Not all packets are actually added.
+// Stop using the index for this queue (see index_unsorted).
+static void set_index_unsorted(struct demux_queue *queue)
+{
+    if (queue->index_unsorted)
+        return;
+    MP_DBG(queue->ds->in, "stream %d: keyframes not in PTS order, not "
+           "indexing them\n", queue->ds->index);
+    free_index(queue);
+    queue->index_unsorted = true;
+}
+
+// Add the keyframe to the end of the index. pts is the keyframe range's
+// minimum PTS, as returned by compute_keyframe_times(). The index contains
+// every keyframe, except the last one of the queue (its range is incomplete).
+// It is both in packet order and sorted by PTS; if keyframes turn out to be
+// out of PTS order, the queue is marked unsorted instead.
 static void add_index_entry(struct demux_queue *queue, struct demux_packet *dp,
                             double pts)
 {
@@ -1619,10 +1682,15 @@ static void add_index_entry(struct demux_queue *queue, struct demux_packet *dp,
 
     assert(dp->keyframe && pts != MP_NOPTS_VALUE);
 
+    if (queue->index_unsorted)
+        return;
+
     if (queue->num_index > 0) {
         struct index_entry *last = &QUEUE_INDEX_ENTRY(queue, queue->num_index - 1);
-        if (pts - last->pts < INDEX_STEP_SIZE)
+        if (pts < last->pts) {
+            set_index_unsorted(queue);
             return;
+        }
     }
 
     if (queue->num_index == queue->index_size) {
@@ -1765,6 +1833,7 @@ static void attempt_range_joining(struct demux_internal *in)
 
         // First new packet that is appended to the current range.
         struct demux_packet *join_point = q2->head;
+        struct demux_packet *q1_kf_latest = q1->keyframe_latest;
 
         if (q2->head) {
             if (q1->head) {
@@ -1794,6 +1863,14 @@ static void attempt_range_joining(struct demux_internal *in)
             ds->reader_head = join_point;
         ds->skip_to_keyframe = false;
 
+        // The keyframe range of q1's last keyframe is complete now.
+        if (q1_kf_latest) {
+            double kf_min;
+            compute_keyframe_times(q1_kf_latest, &kf_min, NULL);
+            if (kf_min != MP_NOPTS_VALUE)
+                add_index_entry(q1, q1_kf_latest, kf_min);
+        }
+
         // Make the cum_pos values in all q2 packets continuous.
         for (struct demux_packet *dp = join_point; dp; dp = dp->next) {
             uint64_t next_pos = dp->next ? dp->next->cum_pos : q2->tail_cum_pos;
@@ -1803,6 +1880,8 @@ static void attempt_range_joining(struct demux_internal *in)
         }
 
         // And update the index with packets from q2.
+        if (q2->index_unsorted)
+            set_index_unsorted(q1);
         for (size_t i = 0; i < q2->num_index; i++) {
             struct index_entry *e = &QUEUE_INDEX_ENTRY(q2, i);
             add_index_entry(q1, e->pkt, e->pts);
@@ -2453,11 +2532,18 @@ static void execute_seek(struct demux_internal *in)
     in->seeking_in_progress = MP_NOPTS_VALUE;
 }
 
+static void update_min_secs(struct demux_internal *in)
+{
+    in->min_secs = MPMAX(in->min_secs_opts, in->min_secs_override);
+    if (!in->can_cache)
+        in->min_secs = 0;
+}
+
 static void update_opts(struct demux_internal *in)
 {
     struct demux_opts *opts = in->opts;
 
-    in->min_secs = opts->min_secs;
+    in->min_secs_opts = opts->min_secs;
     in->max_bytes = opts->max_bytes;
     in->max_bytes_bw = opts->max_bytes_bw;
 
@@ -2468,7 +2554,7 @@ static void update_opts(struct demux_internal *in)
         use_cache = opts->enable_cache == 1;
 
     if (use_cache) {
-        in->min_secs = MPMAX(in->min_secs, opts->min_secs_cache);
+        in->min_secs_opts = MPMAX(in->min_secs_opts, opts->min_secs_cache);
         if (seekable < 0)
             seekable = 1;
     }
@@ -2480,16 +2566,24 @@ static void update_opts(struct demux_internal *in)
 
     if (!in->can_cache) {
         in->seekable_cache = false;
-        in->min_secs = 0;
         in->max_bytes = 1;
         in->max_bytes_bw = 0;
         in->using_network_cache_opts = false;
     }
 
+    update_min_secs(in);
+
     if (in->seekable_cache && opts->disk_cache && !in->cache) {
-        in->cache = demux_cache_create(in->global, in->log);
-        if (!in->cache)
+        // Only media that can be recognized again is cached persistently.
+        const char *key =
+            in->cache_identity_valid ? in->d_thread->filename : NULL;
+        in->cache = demux_cache_create(in->global, in->log, key);
+        if (!in->cache) {
             MP_ERR(in, "Failed to create file cache.\n");
+        } else {
+            in->cache_index = demux_cache_take_index(in->cache, in,
+                                                     &in->cache_index_size);
+        }
     }
 
     // The filename option really decides whether recording should be active.
@@ -2517,6 +2611,402 @@ static void update_opts(struct demux_internal *in)
     free_empty_cached_ranges(in);
 }
 
+// Format of the index written to persistent cache files. Host endian, as the
+// cache file itself is a memory dump too. The header is followed by
+// num_streams cache_index_stream, and num_ranges ranges. Each range consists of
+// one cache_index_queue per stream, each followed by its packets.
+#define CACHE_INDEX_MAGIC "mpvcidx"
+#define CACHE_INDEX_VERSION 3
+
+struct cache_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_streams;
+    uint32_t num_ranges;
+    uint32_t reserved;
+    char demuxer[16];
+    // Identity of the media the cache file was written for.
+    int64_t stream_size;
+    int64_t mtime;          // 0 if not a local file
+};
+
+struct cache_index_stream {
+    int32_t type;
+    int32_t reserved;
+    char codec[32];
+};
+
+struct cache_index_queue {
+    uint64_t num_packets;
+    double seek_start, seek_end;
+    double last_pruned, last_ts, last_dts;
+    int64_t last_pos;
+    uint8_t is_bof, is_eof;
+    uint8_t correct_dts, correct_pos;
+    uint32_t reserved;
+};
+
+#define CACHE_INDEX_PKT_KEYFRAME        (1 << 0)
+#define CACHE_INDEX_PKT_KEYFRAME_LATEST (1 << 1)
+
+struct cache_index_packet {
+    double pts, dts, duration;
+    double index_pts;       // NOPTS if no queue index entry
+    int64_t pos;
+    uint64_t cached_pos;
+    uint32_t flags;         // CACHE_INDEX_PKT_*
+    uint32_t reserved;
+};
+
+// The persistent cache is looked up by URL only, so record enough about the
+// media to notice when the URL refers to different contents now. Media without
+// a known size (live streams, pipes) or without byte seeking is never cached
+// persistently. Called once on opening, while the stream is still accessible
+// from this thread.
+static void init_cache_identity(struct demux_internal *in)
+{
+    struct demuxer *demuxer = in->d_thread;
+    struct stream *s = demuxer->stream;
+
+    in->cache_identity_valid = false;
+    if (!s || !s->seekable || !demuxer->seekable || demuxer->duration <= 0)
+        return;
+
+    int64_t size = stream_get_size(s);
+    if (size <= 0)
+        return;
+
+    int64_t mtime = 0;
+    if (s->is_local_file) {
+        struct stat st;
+        if (stat(s->path, &st))
+            return;
+        mtime = st.st_mtime;
+    }
+
+    in->cache_stream_size = size;
+    in->cache_mtime = mtime;
+    in->cache_identity_valid = true;
+}
+
+static void copy_name(char *dst, size_t size, const char *src)
+{
+    memset(dst, 0, size);
+    if (src)
+        snprintf(dst, size, "%s", src);
+}
+
+static bool range_is_persistable(struct demux_cached_range *range)
+{
+    if (range->seek_start == MP_NOPTS_VALUE)
+        return false;
+    for (int n = 0; n < range->num_streams; n++) {
+        for (struct demux_packet *dp = range->streams[n]->head; dp; dp = dp->next)
+        {
+            if (!dp->is_cached || dp->segmented)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Write the cached ranges to the persistent cache index, so the next instance
+// opening the same media can reuse the cache file contents.
+static void save_cache_index(struct demux_internal *in)
+{
+    struct demuxer *demuxer = in->d_thread;
+    bstr buf = {0};
+
+    struct cache_index_header hdr = {
+        .magic = CACHE_INDEX_MAGIC,
+        .version = CACHE_INDEX_VERSION,
+        .num_streams = in->num_streams,
+        .stream_size = in->cache_stream_size,
+        .mtime = in->cache_mtime,
+    };
+    copy_name(hdr.demuxer, sizeof(hdr.demuxer), demuxer->desc->name);
+    for (int n = 0; n < in->num_ranges; n++)
+        hdr.num_ranges += range_is_persistable(in->ranges[n]);
+
+    if (!hdr.num_ranges) {
+        demux_cache_discard(in->cache);
+        return;
+    }
+
+    bstr_xappend(NULL, &buf, (bstr){(void *)&hdr, sizeof(hdr)});
+
+    for (int n = 0; n < in->num_streams; n++) {
+        struct sh_stream *sh = in->streams[n];
+        struct cache_index_stream st = { .type = sh->type };
+        copy_name(st.codec, sizeof(st.codec), sh->codec->codec);
+        bstr_xappend(NULL, &buf, (bstr){(void *)&st, sizeof(st)});
+    }
+
+    for (int n = 0; n < in->num_ranges; n++) {
+        struct demux_cached_range *range = in->ranges[n];
+        if (!range_is_persistable(range))
+            continue;
+
+        for (int i = 0; i < range->num_streams; i++) {
+            struct demux_queue *queue = range->streams[i];
+
+            struct cache_index_queue q = {
+                .seek_start = queue->seek_start,
+                .seek_end = queue->seek_end,
+                .last_pruned = queue->last_pruned,
+                .last_ts = queue->last_ts,
+                .last_dts = queue->last_dts,
+                .last_pos = queue->last_pos,
+                .is_bof = queue->is_bof,
+                .is_eof = queue->is_eof,
+                .correct_dts = queue->correct_dts,
+                .correct_pos = queue->correct_pos,
+            };
+            for (struct demux_packet *dp = queue->head; dp; dp = dp->next)
+                q.num_packets++;
+            bstr_xappend(NULL, &buf, (bstr){(void *)&q, sizeof(q)});
+
+            size_t next_index = 0;
+            for (struct demux_packet *dp = queue->head; dp; dp = dp->next) {
+                struct cache_index_packet p = {
+                    .pts = dp->pts,
+                    .dts = dp->dts,
+                    .duration = dp->duration,
+                    .index_pts = MP_NOPTS_VALUE,
+                    .pos = dp->pos,
+                    .cached_pos = dp->cached_data.pos,
+                };
+                if (dp->keyframe)
+                    p.flags |= CACHE_INDEX_PKT_KEYFRAME;
+                if (dp == queue->keyframe_latest)
+                    p.flags |= CACHE_INDEX_PKT_KEYFRAME_LATEST;
+                if (next_index < queue->num_index &&
+                    QUEUE_INDEX_ENTRY(queue, next_index).pkt == dp)
+                {
+                    p.index_pts = QUEUE_INDEX_ENTRY(queue, next_index).pts;
+                    next_index += 1;
+                }
+                bstr_xappend(NULL, &buf, (bstr){(void *)&p, sizeof(p)});
+            }
+        }
+    }
+
+    if (demux_cache_save_index(in->cache, buf.start, buf.len))
+        MP_VERBOSE(in, "Saved %d cached ranges.\n", (int)hdr.num_ranges);
+
+    talloc_free(buf.start);
+}
+
+static bool read_index_data(bstr *data, void *dst, size_t size)
+{
+    if (data->len < size)
+        return false;
+    memcpy(dst, data->start, size);
+    *data = bstr_cut(*data, size);
+    return true;
+}
+
+// Add the ranges from the persistent cache index as (non-current) cached
+// ranges. Called once, when the first stream gets selected.
+static void restore_cache_index(struct demux_internal *in)
+{
+    struct demuxer *demuxer = in->d_thread;
+    bstr data = {in->cache_index, in->cache_index_size};
+    int num_restored = 0;
+
+    struct cache_index_header hdr;
+    if (!read_index_data(&data, &hdr, sizeof(hdr)) ||
+        memcmp(hdr.magic, CACHE_INDEX_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != CACHE_INDEX_VERSION ||
+        hdr.num_streams != in->num_streams ||
+        !in->cache_identity_valid ||
+        hdr.stream_size != in->cache_stream_size ||
+        hdr.mtime != in->cache_mtime)
+        goto invalid;
+
+    char name[sizeof(hdr.demuxer)];
+    copy_name(name, sizeof(name), demuxer->desc->name);
+    if (memcmp(name, hdr.demuxer, sizeof(name)) != 0)
+        goto invalid;
+
+    for (int n = 0; n < in->num_streams; n++) {
+        struct sh_stream *sh = in->streams[n];
+        struct cache_index_stream st;
+        char codec[sizeof(st.codec)];
+        copy_name(codec, sizeof(codec), sh->codec->codec);
+        if (!read_index_data(&data, &st, sizeof(st)) || st.type != sh->type ||
+            memcmp(codec, st.codec, sizeof(codec)) != 0)
+            goto invalid;
+    }
+
+    uint64_t cache_size = demux_cache_get_size(in->cache);
+
+    for (uint32_t r = 0; r < hdr.num_ranges; r++) {
+        struct demux_cached_range *range = talloc_ptrtype(NULL, range);
+        *range = (struct demux_cached_range){
+            .seek_start = MP_NOPTS_VALUE,
+            .seek_end = MP_NOPTS_VALUE,
+        };
+        add_missing_streams(in, range);
+
+        // Insert before the current range to keep it at the end (LRU order).
+        MP_TARRAY_INSERT_AT(in, in->ranges, in->num_ranges, in->num_ranges - 1,
+                            range);
+
+        for (int n = 0; n < range->num_streams; n++) {
+            struct demux_queue *queue = range->streams[n];
+            struct demux_stream *ds = queue->ds;
+
+            struct cache_index_queue q;
+            if (!read_index_data(&data, &q, sizeof(q)) ||
+                q.num_packets > data.len / sizeof(struct cache_index_packet))
+                goto invalid;
+
+            for (uint64_t i = 0; i < q.num_packets; i++) {
+                struct cache_index_packet p;
+                read_index_data(&data, &p, sizeof(p));
+                if (p.cached_pos >= cache_size)
+                    goto invalid;
+
+                struct demux_packet *dp = new_demux_packet(0);
+                if (!dp)
+                    goto invalid;
+                demux_packet_unref_contents(dp);
+                dp->pts = p.pts;
+                dp->dts = p.dts;
+                dp->duration = p.duration;
+                dp->pos = p.pos;
+                dp->stream = n;
+                dp->keyframe = p.flags & CACHE_INDEX_PKT_KEYFRAME;
+                dp->is_cached = true;
+                dp->cached_data.pos = p.cached_pos;
+
+                size_t bytes = demux_packet_estimate_total_size(dp);
+                in->total_bytes += bytes;
+                dp->cum_pos = queue->tail_cum_pos;
+                queue->tail_cum_pos += bytes;
+
+                if (queue->tail) {
+                    queue->tail->next = dp;
+                    queue->tail = dp;
+                } else {
+                    queue->head = queue->tail = dp;
+                }
+
+                if (dp->keyframe && !queue->keyframe_first)
+                    queue->keyframe_first = dp;
+                if (p.flags & CACHE_INDEX_PKT_KEYFRAME_LATEST)
+                    queue->keyframe_latest = dp;
+                if (dp->keyframe && p.index_pts != MP_NOPTS_VALUE)
+                    add_index_entry(queue, dp, p.index_pts);
+            }
+
+            queue->seek_start = q.seek_start;
+            queue->seek_end = q.seek_end;
+            queue->last_pruned = q.last_pruned;
+            queue->last_ts = q.last_ts;
+            queue->last_dts = q.last_dts;
+            queue->last_pos = q.last_pos;
+            queue->is_bof = q.is_bof;
+            queue->is_eof = q.is_eof;
+            queue->correct_dts = q.correct_dts;
+            queue->correct_pos = q.correct_pos;
+
+            ds->global_correct_dts &= queue->correct_dts;
+            ds->global_correct_pos &= queue->correct_pos;
+        }
+
+        num_restored++;
+    }
+
+    MP_VERBOSE(in, "Restored %d cached ranges from disk.\n", num_restored);
+    goto done;
+
+invalid:
+    MP_WARN(in, "Persistent cache index is invalid or does not match the "
+            "media, discarding it.\n");
+    // Drop everything referencing the old cache file contents.
+    for (int n = 0; n < in->num_ranges; n++) {
+        if (in->ranges[n] != in->current_range)
+            clear_cached_range(in, in->ranges[n]);
+    }
+    free_empty_cached_ranges(in);
+    // (Packets demuxed before this point may already be in the cache file.)
+    if (!in->total_bytes)
+        demux_cache_discard(in->cache);
+done:
+    TA_FREEP(&in->cache_index);
+    in->cache_index_size = 0;
+}
+
+// Maximum packet data and number of packets handled per queue in one
+// compress_cold_packets() call. Compression happens with the lock held, so
+// this must stay small.
+#define COMPRESS_BATCH_BYTES (256 * 1024)
+#define COMPRESS_BATCH_PACKETS 256
+
+// Compress some packet data in cached ranges that are not being read, if
+// enabled. Runs only when the demuxer thread is idle. Returns whether any
+// packet was compressed.
+static bool compress_cold_packets(struct demux_internal *in)
+{
+    if (!in->opts->compress_cache || !in->seekable_cache)
+        return false;
+
+    for (int n = 0; n < in->num_ranges; n++) {
+        struct demux_cached_range *range = in->ranges[n];
+        if (range == in->current_range)
+            continue;
+
+        for (int i = 0; i < range->num_streams; i++) {
+            struct demux_queue *queue = range->streams[i];
+            if (!queue->tail || queue->compress_last == queue->tail)
+                continue;
+
+            // The packet sizes are implied by cum_pos. Renumbering the rest of
+            // the queue after each batch would be quadratic, so the memory
+            // saved by a batch is left as a gap after its last packet (the
+            // new compress_last), and taken over by the next batch. It is
+            // removed from the accounting once the end of the queue is reached.
+            struct demux_packet *first = queue->head;
+            uint64_t pos = queue->head->cum_pos;
+            if (queue->compress_last) {
+                first = queue->compress_last->next;
+                pos = queue->compress_last->cum_pos +
+                      demux_packet_estimate_total_size(queue->compress_last);
+            }
+
+            size_t done = 0;
+            int num = 0;
+            bool changed = false;
+            struct demux_packet *dp = first;
+            for (; dp; dp = dp->next) {
+                if (done >= COMPRESS_BATCH_BYTES ||
+                    num >= COMPRESS_BATCH_PACKETS)
+                    break;
+                size_t len = dp->is_cached || dp->is_compressed ? 0 : dp->len;
+                changed |= demux_packet_compress(dp);
+                done += len;
+                num += 1;
+                dp->cum_pos = pos;
+                pos += demux_packet_estimate_total_size(dp);
+                queue->compress_last = dp;
+            }
+
+            if (!dp) {
+                assert(pos <= queue->tail_cum_pos);
+                in->total_bytes -= queue->tail_cum_pos - pos;
+                queue->tail_cum_pos = pos;
+            }
+
+            if (changed)
+                return true;
+        }
+    }
+
+    return false;
+}
+
 // Make demuxing progress. Return whether progress was made.
 static bool thread_work(struct demux_internal *in)
 {
@@ -2544,6 +3034,8 @@ static bool thread_work(struct demux_internal *in)
         update_cache(in);
         return true;
     }
+    if (compress_cold_packets(in))
+        return true;
     return false;
 }
 
@@ -2594,8 +3086,9 @@ static struct demux_packet *advance_reader_head(struct demux_stream *ds)
 }
 
 // Return a newly allocated new packet. The pkt parameter may be either a
-// in-memory packet (then a new reference is made), or a reference to
-// packet in the disk cache (then the packet is read from disk).
+// in-memory packet (then a new reference is made), a compressed packet (then
+// it's decompressed), or a reference to packet in the disk cache (then the
+// packet is read from disk).
 static struct demux_packet *read_packet_from_cache(struct demux_internal *in,
                                                    struct demux_packet *pkt)
 {
@@ -2611,6 +3104,10 @@ static struct demux_packet *read_packet_from_cache(struct demux_internal *in,
         } else {
             MP_ERR(in, "Failed to retrieve packet from cache.\n");
         }
+    } else if (pkt->is_compressed) {
+        pkt = demux_packet_decompress(pkt);
+        if (!pkt)
+            MP_ERR(in, "Failed to decompress cached packet.\n");
     } else {
         // The returned packet is mutated etc. and will be owned by the user.
         pkt = demux_copy_packet(pkt);
@@ -3341,6 +3838,9 @@ static struct demuxer *open_given_type(struct mpv_global *global,
 
         switch_to_fresh_cache_range(in);
 
+        if (in->can_cache)
+            init_cache_identity(in);
+
         update_opts(in);
 
         demux_update(demuxer, MP_NOPTS_VALUE);
@@ -3552,28 +4052,26 @@ static void switch_current_range(struct demux_internal *in,
 }
 
 // Search for the entry with the highest index with entry.pts <= pts true.
-static struct demux_packet *search_index(struct demux_queue *queue, double pts)
+// Return the number of index entries with entry.pts <= pts (if !forward), or
+// entry.pts < pts (if forward). In other words, the index of the first entry
+// that is > pts (or >= pts).
+static size_t search_index(struct demux_queue *queue, double pts, bool forward)
 {
     size_t a = 0;
     size_t b = queue->num_index;
 
     while (a < b) {
         size_t m = a + (b - a) / 2;
-        struct index_entry *e = &QUEUE_INDEX_ENTRY(queue, m);
-
-        bool m_ok = e->pts <= pts;
-
-        if (a + 1 == b)
-            return m_ok ? e->pkt : NULL;
+        double e_pts = QUEUE_INDEX_ENTRY(queue, m).pts;
 
-        if (m_ok) {
-            a = m;
+        if (forward ? e_pts < pts : e_pts <= pts) {
+            a = m + 1;
         } else {
             b = m;
         }
     }
 
-    return NULL;
+    return a;
 }
 
 static struct demux_packet *find_seek_target(struct demux_queue *queue,
@@ -3581,9 +4079,25 @@ static struct demux_packet *find_seek_target(struct demux_queue *queue,
 {
     pts -= queue->ds->sh->seek_preroll;
 
-    struct demux_packet *start = search_index(queue, pts);
-    if (!start)
-        start = queue->head;
+    bool forward = flags & SEEK_FORWARD;
+    size_t idx = search_index(queue, pts, forward);
+
+    // The index contains all keyframes except the last one, so if the result
+    // is surrounded by index entries, it's exact. (If the queue is unsorted,
+    // the index is empty, and the whole queue is scanned.)
+    if (forward) {
+        if (idx < queue->num_index)
+            return QUEUE_INDEX_ENTRY(queue, idx).pkt;
+    } else {
+        if (idx > 0 && idx < queue->num_index)
+            return QUEUE_INDEX_ENTRY(queue, idx - 1).pkt;
+    }
+
+    // Otherwise, the target is before the first or after the last indexed
+    // keyframe, which needs scanning a few packets.
+    struct demux_packet *start = queue->head;
+    if (queue->num_index && idx > 0)
+        start = QUEUE_INDEX_ENTRY(queue, queue->num_index - 1).pkt;
 
     struct demux_packet *target = NULL;
     struct demux_packet *next = NULL;
@@ -3598,7 +4112,7 @@ static struct demux_packet *find_seek_target(struct demux_queue *queue,
         if (range_pts == MP_NOPTS_VALUE)
             continue;
 
-        if (flags & SEEK_FORWARD) {
+        if (forward) {
             // Stop on the first packet that is >= pts.
             if (target)
                 break;
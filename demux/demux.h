@@ -172,6 +172,8 @@ struct demuxer_params {
     struct matroska_segment_uid *matroska_wanted_uids;
     int matroska_wanted_segment;
     bool *matroska_was_valid;
+    // If set, the segment UID is written to it (even if not a wanted UID).
+    struct matroska_segment_uid *matroska_probed_uid;
     struct timeline *timeline;
     bool disable_timeline;
     bstr init_fragment;
@@ -276,6 +278,7 @@ void demux_start_thread(struct demuxer *demuxer);
 void demux_stop_thread(struct demuxer *demuxer);
 void demux_set_wakeup_cb(struct demuxer *demuxer, void (*cb)(void *ctx), void *ctx);
 void demux_start_prefetch(struct demuxer *demuxer);
+void demux_set_min_readahead(struct demuxer *demuxer, double secs);
 
 bool demux_cancel_test(struct demuxer *demuxer);
 
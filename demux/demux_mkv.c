@@ -27,11 +27,14 @@
 #include <stdbool.h>
 #include <math.h>
 #include <assert.h>
+#include <sys/stat.h>
 
 #include <libavutil/common.h>
 #include <libavutil/lzo.h>
 #include <libavutil/intreadwrite.h>
 #include <libavutil/avstring.h>
+#include <libavutil/mem.h>
+#include <libavutil/sha.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavcodec/version.h>
@@ -46,6 +49,8 @@
 #include "common/av_common.h"
 #include "options/m_config.h"
 #include "options/m_option.h"
+#include "options/path.h"
+#include "osdep/io.h"
 #include "misc/bstr.h"
 #include "stream/stream.h"
 #include "video/csputils.h"
@@ -204,6 +209,10 @@ typedef struct mkv_demuxer {
 
     bool index_has_durations;
 
+    // For --demuxer-mkv-index-cache-dir (NULL if disabled).
+    char *index_cache_file;
+    bool duration_probed;
+
     bool eof_warning, keyframe_warning;
 
     // Small queue of read but not yet returned packets. This is mostly
@@ -225,6 +234,7 @@ struct demux_mkv_opts {
     double subtitle_preroll_secs_index;
     int probe_duration;
     int probe_start_time;
+    char *index_cache_dir;
 };
 
 const struct m_sub_options demux_mkv_conf = {
@@ -238,6 +248,7 @@ const struct m_sub_options demux_mkv_conf = {
         {"probe-video-duration", OPT_CHOICE(probe_duration,
             {"no", 0}, {"yes", 1}, {"full", 2})},
         {"probe-start-time", OPT_FLAG(probe_start_time)},
+        {"index-cache-dir", OPT_STRING(index_cache_dir), .flags = M_OPT_FILE},
         {0}
     },
     .size = sizeof(struct demux_mkv_opts),
@@ -259,6 +270,7 @@ const struct m_sub_options demux_mkv_conf = {
 #define NUM_SUB_PREROLL_PACKETS 500
 
 static void probe_last_timestamp(struct demuxer *demuxer, int64_t start_pos);
+static void load_index_cache(struct demuxer *demuxer);
 static void probe_first_timestamp(struct demuxer *demuxer);
 static int read_next_block_into_queue(demuxer_t *demuxer);
 static void free_block(struct block_info *block);
@@ -443,6 +455,10 @@ static int demux_mkv_read_info(demuxer_t *demuxer)
         } else {
             memcpy(demuxer->matroska_data.uid.segment, info.segment_uid.start,
                    len);
+            if (demuxer->params && demuxer->params->matroska_probed_uid) {
+                memcpy(demuxer->params->matroska_probed_uid->segment,
+                       info.segment_uid.start, len);
+            }
             MP_DBG(demuxer, "| + segment uid");
             for (size_t i = 0; i < len; i++)
                 MP_DBG(demuxer, " %02x",
@@ -2111,8 +2127,9 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
     add_coverart(demuxer);
     process_tags(demuxer);
 
+    load_index_cache(demuxer);
     probe_first_timestamp(demuxer);
-    if (mkv_d->opts->probe_duration)
+    if (mkv_d->opts->probe_duration && !mkv_d->duration_probed)
         probe_last_timestamp(demuxer, start_pos);
     probe_x264_garbage(demuxer);
 
@@ -2122,7 +2139,8 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
 // Read the laced block data at the current stream position (until endpos as
 // indicated by the block length field) into individual buffers.
 static int demux_mkv_read_block_lacing(struct block_info *block, int type,
-                                       struct stream *s, uint64_t endpos)
+                                       struct stream *s, uint64_t endpos,
+                                       bool allow_ref)
 {
     int laces;
     uint32_t lace_size[MAX_NUM_LACES];
@@ -2190,16 +2208,20 @@ static int demux_mkv_read_block_lacing(struct block_info *block, int type,
         uint32_t size = lace_size[i];
         if (stream_tell(s) + size > endpos || size > (1 << 30))
             goto error;
-        int pad = MPMAX(AV_INPUT_BUFFER_PADDING_SIZE, AV_LZO_INPUT_PADDING);
-        AVBufferRef *buf = av_buffer_alloc(size + pad);
-        if (!buf)
-            goto error;
-        buf->size = size;
-        if (stream_read(s, buf->data, buf->size) != buf->size) {
-            av_buffer_unref(&buf);
-            goto error;
+        // Reference the file data directly if possible (--file-mmap).
+        AVBufferRef *buf = allow_ref ? stream_read_ref(s, size) : NULL;
+        if (!buf) {
+            int pad = MPMAX(AV_INPUT_BUFFER_PADDING_SIZE, AV_LZO_INPUT_PADDING);
+            buf = av_buffer_alloc(size + pad);
+            if (!buf)
+                goto error;
+            buf->size = size;
+            if (stream_read(s, buf->data, buf->size) != buf->size) {
+                av_buffer_unref(&buf);
+                goto error;
+            }
+            memset(buf->data + buf->size, 0, pad);
         }
-        memset(buf->data + buf->size, 0, pad);
         block->laces[block->num_laces++] = buf;
     }
 
@@ -2563,19 +2585,26 @@ static int read_block(demuxer_t *demuxer, int64_t end, struct block_info *block)
 
     block->filepos = stream_tell(s);
 
-    int lace_type = (header_flags >> 1) & 0x03;
-    if (demux_mkv_read_block_lacing(block, lace_type, s, endpos))
-        goto exit;
-
-    if (block->simple)
-        block->keyframe = header_flags & 0x80;
-    block->timecode = time * mkv_d->tc_scale + mkv_d->cluster_tc;
     for (int i = 0; i < mkv_d->num_tracks; i++) {
         if (mkv_d->tracks[i]->tnum == num) {
             block->track = mkv_d->tracks[i];
             break;
         }
     }
+
+    // Referenced file data is not followed by zeroed padding (see
+    // stream_read_ref()), which only the rawvideo decoder doesn't care about.
+    struct sh_stream *sh = block->track ? block->track->stream : NULL;
+    bool allow_ref = sh && !block->track->parse && sh->codec->codec &&
+                     strcmp(sh->codec->codec, "rawvideo") == 0;
+
+    int lace_type = (header_flags >> 1) & 0x03;
+    if (demux_mkv_read_block_lacing(block, lace_type, s, endpos, allow_ref))
+        goto exit;
+
+    if (block->simple)
+        block->keyframe = header_flags & 0x80;
+    block->timecode = time * mkv_d->tc_scale + mkv_d->cluster_tc;
     if (!block->track) {
         res = 0;
         goto exit;
@@ -3204,6 +3233,7 @@ static void probe_last_timestamp(struct demuxer *demuxer, int64_t start_pos)
     if (last_ts[STREAM_VIDEO]) {
         mkv_d->duration = last_ts[STREAM_VIDEO] / 1e9 - demuxer->start_time;
         demuxer->duration = mkv_d->duration;
+        mkv_d->duration_probed = true;
     }
 
     stream_seek(demuxer->stream, start_pos);
@@ -3225,11 +3255,194 @@ static void probe_first_timestamp(struct demuxer *demuxer)
         MP_VERBOSE(demuxer, "Start PTS: %f\n", demuxer->start_time);
 }
 
+// Sidecar file for --demuxer-mkv-index-cache-dir. It stores the index built
+// from reading clusters (for files without cues), and the probed duration.
+// All fields are in native byte order.
+#define INDEX_CACHE_MAGIC "mpvmkvix"
+#define INDEX_CACHE_VERSION 1
+
+struct index_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    int64_t tc_scale;
+    double duration;        // 0 if not probed
+    uint64_t num_entries;
+};
+
+struct index_cache_entry {
+    int64_t tnum;
+    int64_t timecode, duration;
+    uint64_t filepos;
+};
+
+// Set mkv_d->index_cache_file to a name derived from the file identity: the
+// URL, size, modification time (if local), and segment UID and position.
+static void init_index_cache_file(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    struct stream *s = demuxer->stream;
+    char *dir = mkv_d->opts->index_cache_dir;
+
+    if (!dir || !dir[0] || !demuxer->seekable || mkv_d->index_mode != 1)
+        return;
+
+    int64_t size = stream_get_size(s);
+    if (size <= 0)
+        return;
+
+    int64_t mtime = 0;
+    struct stat st;
+    if (s->is_local_file && s->path && stat(s->path, &st) == 0)
+        mtime = st.st_mtime;
+
+    struct AVSHA *sha = av_sha_alloc();
+    if (!sha)
+        return;
+    uint8_t hash[32];
+    av_sha_init(sha, 256);
+    av_sha_update(sha, s->url, strlen(s->url) + 1);
+    av_sha_update(sha, (uint8_t *)&size, sizeof(size));
+    av_sha_update(sha, (uint8_t *)&mtime, sizeof(mtime));
+    av_sha_update(sha, demuxer->matroska_data.uid.segment,
+                  sizeof(demuxer->matroska_data.uid.segment));
+    av_sha_update(sha, (uint8_t *)&mkv_d->segment_start,
+                  sizeof(mkv_d->segment_start));
+    av_sha_final(sha, hash);
+    av_free(sha);
+
+    char *name = talloc_strdup(NULL, "");
+    for (int i = 0; i < sizeof(hash); i++)
+        name = talloc_asprintf_append(name, "%02X", hash[i]);
+    name = talloc_asprintf_append(name, ".mkvidx");
+
+    char *cache_dir = mp_get_user_path(name, demuxer->global, dir);
+    mkv_d->index_cache_file = mp_path_join(mkv_d, cache_dir, name);
+    talloc_free(name);
+}
+
+static void load_index_cache(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+
+    init_index_cache_file(demuxer);
+
+    // Files with cues don't need this. If the cues are not at the start of
+    // the file, they replace the loaded index when they are read.
+    for (int n = 0; n < mkv_d->num_headers; n++) {
+        if (mkv_d->headers[n].id == MATROSKA_ID_CUES)
+            TA_FREEP(&mkv_d->index_cache_file);
+    }
+
+    char *fname = mkv_d->index_cache_file;
+    if (!fname || mkv_d->index_complete || stat(fname, &(struct stat){0}) != 0)
+        return;
+
+    void *tmp = talloc_new(NULL);
+    bstr data = stream_read_file(fname, tmp, demuxer->global, 256 * 1024 * 1024);
+    struct index_cache_header hd;
+    if (data.len < sizeof(hd))
+        goto invalid;
+    memcpy(&hd, data.start, sizeof(hd));
+    if (memcmp(hd.magic, INDEX_CACHE_MAGIC, sizeof(hd.magic)) ||
+        hd.version != INDEX_CACHE_VERSION ||
+        hd.entry_size != sizeof(struct index_cache_entry) ||
+        hd.tc_scale != mkv_d->tc_scale ||
+        hd.num_entries > (data.len - sizeof(hd)) / hd.entry_size)
+        goto invalid;
+
+    mkv_d->num_indexes = 0;
+    for (int n = 0; n < mkv_d->num_tracks; n++)
+        mkv_d->tracks[n]->last_index_entry = (size_t)-1;
+
+    for (uint64_t i = 0; i < hd.num_entries; i++) {
+        struct index_cache_entry e;
+        memcpy(&e, data.start + sizeof(hd) + i * sizeof(e), sizeof(e));
+        cue_index_add(demuxer, e.tnum, e.filepos, e.timecode, e.duration);
+        for (int n = 0; n < mkv_d->num_tracks; n++) {
+            if (mkv_d->tracks[n]->tnum == e.tnum)
+                mkv_d->tracks[n]->last_index_entry = mkv_d->num_indexes - 1;
+        }
+    }
+    mkv_d->index_has_durations = hd.num_entries > 0;
+
+    if (hd.duration > 0) {
+        mkv_d->duration = demuxer->duration = hd.duration;
+        mkv_d->duration_probed = true;
+    }
+
+    MP_VERBOSE(demuxer, "Loaded %"PRIu64" index entries from '%s'.\n",
+               hd.num_entries, fname);
+    talloc_free(tmp);
+    return;
+
+invalid:
+    MP_WARN(demuxer, "Index cache file '%s' is invalid, ignoring.\n", fname);
+    talloc_free(tmp);
+}
+
+static void save_index_cache(struct demuxer *demuxer)
+{
+    struct mkv_demuxer *mkv_d = demuxer->priv;
+    char *fname = mkv_d->index_cache_file;
+
+    // index_complete means the index is from cues.
+    if (!fname || mkv_d->index_complete ||
+        (!mkv_d->num_indexes && !mkv_d->duration_probed))
+        return;
+
+    void *tmp = talloc_new(NULL);
+    char *dir = bstrto0(tmp, mp_dirname(fname));
+    mp_mkdirp(dir);
+
+    // Write a temporary file first, so that concurrent readers never see a
+    // partially written file.
+    char *tmp_fname = talloc_asprintf(tmp, "%s.tmp", fname);
+    FILE *out = fopen(tmp_fname, "wb");
+    if (!out)
+        goto error;
+
+    struct index_cache_header hd = {
+        .magic = INDEX_CACHE_MAGIC,
+        .version = INDEX_CACHE_VERSION,
+        .entry_size = sizeof(struct index_cache_entry),
+        .tc_scale = mkv_d->tc_scale,
+        .duration = mkv_d->duration_probed ? mkv_d->duration : 0,
+        .num_entries = mkv_d->num_indexes,
+    };
+    bool ok = fwrite(&hd, sizeof(hd), 1, out) == 1;
+    for (size_t i = 0; ok && i < mkv_d->num_indexes; i++) {
+        struct mkv_index *index = &mkv_d->indexes[i];
+        struct index_cache_entry e = {
+            .tnum = index->tnum,
+            .timecode = index->timecode,
+            .duration = index->duration,
+            .filepos = index->filepos,
+        };
+        ok = fwrite(&e, sizeof(e), 1, out) == 1;
+    }
+    ok &= fclose(out) == 0;
+
+    if (!ok || rename(tmp_fname, fname)) {
+        unlink(tmp_fname);
+        goto error;
+    }
+
+    MP_VERBOSE(demuxer, "Saved index to '%s'.\n", fname);
+    talloc_free(tmp);
+    return;
+
+error:
+    MP_WARN(demuxer, "Could not write index cache file '%s'.\n", fname);
+    talloc_free(tmp);
+}
+
 static void mkv_free(struct demuxer *demuxer)
 {
     struct mkv_demuxer *mkv_d = demuxer->priv;
     if (!mkv_d)
         return;
+    save_index_cache(demuxer);
     mkv_seek_reset(demuxer);
     for (int i = 0; i < mkv_d->num_tracks; i++)
         demux_mkv_free_trackentry(mkv_d->tracks[i]);
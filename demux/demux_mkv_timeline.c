@@ -25,12 +25,14 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <libavutil/common.h>
 
 #include "osdep/io.h"
 
 #include "mpv_talloc.h"
 
+#include "common/global.h"
 #include "common/msg.h"
 #include "demux/demux.h"
 #include "demux/timeline.h"
@@ -39,6 +41,7 @@
 #include "options/options.h"
 #include "options/path.h"
 #include "misc/bstr.h"
+#include "misc/thread_pool.h"
 #include "misc/thread_tools.h"
 #include "common/common.h"
 #include "common/playlist.h"
@@ -65,6 +68,60 @@ struct tl_ctx {
     int num_chapters; // Total number of expected chapters.
 };
 
+// Maximum number of files probed concurrently when searching sources.
+#define MAX_PROBE_THREADS 8
+
+// Segment UIDs of files probed earlier, so that loading the next file from the
+// same directory doesn't need to open all of them again. Entries are
+// invalidated by file size or modification time changes. There is one cache
+// per mpv_global (global->mkv_uid_cache, may be NULL).
+struct uid_cache_entry {
+    char *filename;
+    int64_t size, mtime;
+    struct matroska_segment_uid *uids; // one per segment
+    int num_uids;
+};
+
+// Once this is reached, the cache is cleared.
+#define UID_CACHE_MAX_ENTRIES 4096
+
+struct mkv_uid_cache {
+    pthread_mutex_t lock;
+    // --- Protected by lock.
+    void *ta_ctx;   // talloc parent of entries; freed when clearing the cache
+    struct uid_cache_entry *entries;
+    int num_entries;
+};
+
+// State of a single file while probing for sources.
+struct probe_file {
+    char *filename;
+    bool probed;
+    // Segment UIDs, in segment order. Only complete if uids_complete is set.
+    struct matroska_segment_uid *uids;
+    int num_uids;
+    bool uids_complete;
+    // Segments which matched one of the wanted UIDs, in segment order.
+    struct demuxer **demuxers;
+    int num_demuxers;
+};
+
+struct probe_ctx {
+    struct tl_ctx *ctx;
+    struct matroska_segment_uid *wanted; // copy of ctx->uids
+    int num_wanted;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    // --- Protected by lock.
+    struct probe_file *files;
+    int num_files;
+    int next_file;
+    int active;         // number of running probe_worker() calls
+    bool *found;        // found[n] if wanted[n] is known to be available
+    int num_missing;    // number of wanted UIDs with found[n]==false
+};
+
 struct find_entry {
     char *name;
     int matchlen;
@@ -161,27 +218,258 @@ static bool has_source_request(struct tl_ctx *ctx,
     return false;
 }
 
-// segment = get Nth segment of a multi-segment file
-static bool check_file_seg(struct tl_ctx *ctx, char *filename, int segment)
+static bool uid_list_contains(struct matroska_segment_uid *uids, int num_uids,
+                              struct matroska_segment_uid *uid)
 {
-    bool was_valid = false;
-    struct demuxer_params params = {
-        .force_format = "mkv",
-        .matroska_num_wanted_uids = ctx->num_sources,
-        .matroska_wanted_uids = ctx->uids,
-        .matroska_wanted_segment = segment,
-        .matroska_was_valid = &was_valid,
-        .disable_timeline = true,
-        .stream_flags = ctx->tl->stream_origin,
-    };
-    struct mp_cancel *cancel = ctx->tl->cancel;
-    if (mp_cancel_test(cancel))
-        return false;
+    for (int n = 0; n < num_uids; n++) {
+        if (!memcmp(uids[n].segment, uid->segment, 16))
+            return true;
+    }
+    return false;
+}
 
-    struct demuxer *d = demux_open_url(filename, &params, cancel, ctx->global);
-    if (!d)
+static bool get_file_identity(const char *filename, int64_t *size,
+                              int64_t *mtime)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
         return false;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+void mkv_uid_cache_init(struct mpv_global *global)
+{
+    struct mkv_uid_cache *cache = talloc_zero(NULL, struct mkv_uid_cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    global->mkv_uid_cache = cache;
+}
+
+void mkv_uid_cache_uninit(struct mpv_global *global)
+{
+    struct mkv_uid_cache *cache = global->mkv_uid_cache;
+    if (!cache)
+        return;
+    pthread_mutex_destroy(&cache->lock);
+    talloc_free(cache);
+    global->mkv_uid_cache = NULL;
+}
+
+// Set f->uids from the cache, if there is an up to date entry.
+static bool uid_cache_lookup(struct mkv_uid_cache *cache, struct probe_file *f,
+                             void *ta_parent, int64_t size, int64_t mtime)
+{
+    bool found = false;
+    pthread_mutex_lock(&cache->lock);
+    for (int n = 0; n < cache->num_entries; n++) {
+        struct uid_cache_entry *e = &cache->entries[n];
+        if (strcmp(e->filename, f->filename) == 0) {
+            if (e->size == size && e->mtime == mtime) {
+                f->uids = talloc_memdup(ta_parent, e->uids,
+                                        e->num_uids * sizeof(e->uids[0]));
+                f->num_uids = e->num_uids;
+                f->uids_complete = found = true;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
 
+static void uid_cache_store(struct mkv_uid_cache *cache, struct probe_file *f,
+                            int64_t size, int64_t mtime)
+{
+    pthread_mutex_lock(&cache->lock);
+    struct uid_cache_entry *e = NULL;
+    for (int n = 0; n < cache->num_entries; n++) {
+        if (strcmp(cache->entries[n].filename, f->filename) == 0) {
+            e = &cache->entries[n];
+            talloc_free(e->uids);
+            break;
+        }
+    }
+    if (!e) {
+        if (cache->num_entries >= UID_CACHE_MAX_ENTRIES) {
+            TA_FREEP(&cache->ta_ctx);
+            cache->entries = NULL;
+            cache->num_entries = 0;
+        }
+        if (!cache->ta_ctx)
+            cache->ta_ctx = talloc_new(cache);
+        MP_TARRAY_GROW(cache->ta_ctx, cache->entries, cache->num_entries);
+        e = &cache->entries[cache->num_entries++];
+        *e = (struct uid_cache_entry){
+            .filename = talloc_strdup(cache->ta_ctx, f->filename),
+        };
+    }
+    e->size = size;
+    e->mtime = mtime;
+    e->uids = talloc_memdup(cache->ta_ctx, f->uids,
+                            f->num_uids * sizeof(f->uids[0]));
+    e->num_uids = f->num_uids;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Open all segments of the file which match one of the wanted UIDs, and
+// collect the UIDs of all segments. Must not access ctx->sources/ctx->uids.
+static void probe_file(struct probe_ctx *p, struct probe_file *f, void *ta_parent)
+{
+    struct tl_ctx *ctx = p->ctx;
+    struct mkv_uid_cache *cache = ctx->global->mkv_uid_cache;
+
+    int64_t size = 0, mtime = 0;
+    bool have_identity = cache &&
+                         get_file_identity(f->filename, &size, &mtime);
+    if (have_identity && uid_cache_lookup(cache, f, ta_parent, size, mtime)) {
+        bool needed = false;
+        for (int n = 1; n < p->num_wanted; n++)
+            needed |= uid_list_contains(f->uids, f->num_uids, &p->wanted[n]);
+        if (!needed)
+            return;
+        f->num_uids = 0;
+        f->uids_complete = false;
+    }
+
+    for (int segment = 0; ; segment++) {
+        bool was_valid = false;
+        struct matroska_segment_uid uid = {0};
+        struct demuxer_params params = {
+            .force_format = "mkv",
+            .matroska_num_wanted_uids = p->num_wanted,
+            .matroska_wanted_uids = p->wanted,
+            .matroska_wanted_segment = segment,
+            .matroska_was_valid = &was_valid,
+            .matroska_probed_uid = &uid,
+            .disable_timeline = true,
+            .stream_flags = ctx->tl->stream_origin,
+        };
+        struct mp_cancel *cancel = ctx->tl->cancel;
+        if (mp_cancel_test(cancel))
+            return;
+
+        struct demuxer *d = demux_open_url(f->filename, &params, cancel,
+                                           ctx->global);
+        if (d)
+            MP_TARRAY_APPEND(ta_parent, f->demuxers, f->num_demuxers, d);
+        if (!d && !was_valid)
+            break;
+        MP_TARRAY_APPEND(ta_parent, f->uids, f->num_uids, uid);
+    }
+
+    f->uids_complete = true;
+    if (have_identity)
+        uid_cache_store(cache, f, size, mtime);
+}
+
+static void probe_worker(void *arg)
+{
+    struct probe_ctx *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while (p->next_file < p->num_files && p->num_missing &&
+           !mp_cancel_test(p->ctx->tl->cancel))
+    {
+        struct probe_file *f = &p->files[p->next_file++];
+        pthread_mutex_unlock(&p->lock);
+
+        // Allocations are not thread-safe w.r.t. a shared parent.
+        void *ta_parent = talloc_new(NULL);
+        probe_file(p, f, ta_parent);
+
+        pthread_mutex_lock(&p->lock);
+        talloc_steal(p, ta_parent);
+        f->probed = true;
+        for (int i = 0; i < f->num_demuxers; i++) {
+            struct matroska_segment_uid *uid = &f->demuxers[i]->matroska_data.uid;
+            for (int n = 1; n < p->num_wanted; n++) {
+                if (!p->found[n] && !memcmp(p->wanted[n].segment, uid->segment, 16)) {
+                    p->found[n] = true;
+                    p->num_missing--;
+                }
+            }
+        }
+    }
+    p->active--;
+    pthread_cond_broadcast(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// Probe the given files concurrently. Stops early once every wanted UID was
+// found in some file. The result is returned in p->files (same order as
+// filenames); the caller must free p.
+static struct probe_ctx *probe_files(struct tl_ctx *ctx, char **filenames,
+                                     int num_filenames)
+{
+    struct probe_ctx *p = talloc_zero(NULL, struct probe_ctx);
+    p->ctx = ctx;
+    p->wanted = talloc_memdup(p, ctx->uids, ctx->num_sources * sizeof(ctx->uids[0]));
+    p->num_wanted = ctx->num_sources;
+    p->found = talloc_zero_array(p, bool, p->num_wanted);
+    for (int n = 1; n < p->num_wanted; n++) {
+        p->found[n] = !!ctx->sources[n];
+        p->num_missing += !p->found[n];
+    }
+    p->files = talloc_zero_array(p, struct probe_file, num_filenames);
+    p->num_files = num_filenames;
+    for (int n = 0; n < num_filenames; n++)
+        p->files[n].filename = filenames[n];
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wakeup, NULL);
+
+    int num_jobs = MPMIN(num_filenames, MAX_PROBE_THREADS) - 1;
+    struct mp_thread_pool *pool = NULL;
+    if (num_jobs > 0)
+        pool = mp_thread_pool_create(NULL, 0, 1, num_jobs);
+
+    for (int n = 0; pool && n < num_jobs; n++) {
+        pthread_mutex_lock(&p->lock);
+        p->active++;
+        pthread_mutex_unlock(&p->lock);
+        if (!mp_thread_pool_queue(pool, probe_worker, p)) {
+            pthread_mutex_lock(&p->lock);
+            p->active--;
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+    }
+
+    // Also probe on the calling thread, which ensures progress even if no
+    // worker threads could be created.
+    pthread_mutex_lock(&p->lock);
+    p->active++;
+    pthread_mutex_unlock(&p->lock);
+    probe_worker(p);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->active)
+        pthread_cond_wait(&p->wakeup, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    talloc_free(pool);
+    pthread_cond_destroy(&p->wakeup);
+    pthread_mutex_destroy(&p->lock);
+    return p;
+}
+
+// Whether the file could contain any of the missing sources.
+static bool may_have_missing(struct tl_ctx *ctx, struct probe_file *f)
+{
+    if (!f->uids_complete)
+        return true;
+    for (int i = 1; i < ctx->num_sources; i++) {
+        if (!ctx->sources[i] &&
+            uid_list_contains(f->uids, f->num_uids, &ctx->uids[i]))
+            return true;
+    }
+    return false;
+}
+
+// Use d as source if it matches a missing one. Returns false if it was not
+// used (the caller must free it then).
+static bool add_source(struct tl_ctx *ctx, struct demuxer *d)
+{
     struct matroska_data *m = &d->matroska_data;
 
     for (int i = 1; i < ctx->num_sources; i++) {
@@ -221,6 +509,33 @@ static bool check_file_seg(struct tl_ctx *ctx, char *filename, int segment)
         }
     }
 
+    return false;
+}
+
+// segment = get Nth segment of a multi-segment file
+static bool check_file_seg(struct tl_ctx *ctx, char *filename, int segment)
+{
+    bool was_valid = false;
+    struct demuxer_params params = {
+        .force_format = "mkv",
+        .matroska_num_wanted_uids = ctx->num_sources,
+        .matroska_wanted_uids = ctx->uids,
+        .matroska_wanted_segment = segment,
+        .matroska_was_valid = &was_valid,
+        .disable_timeline = true,
+        .stream_flags = ctx->tl->stream_origin,
+    };
+    struct mp_cancel *cancel = ctx->tl->cancel;
+    if (mp_cancel_test(cancel))
+        return false;
+
+    struct demuxer *d = demux_open_url(filename, &params, cancel, ctx->global);
+    if (!d)
+        return false;
+
+    if (add_source(ctx, d))
+        return true;
+
     demux_free(d);
     return was_valid;
 }
@@ -276,12 +591,32 @@ static void find_ordered_chapter_sources(struct tl_ctx *ctx)
         check_file(ctx, main_filename, 1);
     }
 
+    // Open the candidates concurrently, then pick sources from the result in
+    // the same order as a sequential scan would.
+    struct probe_ctx *probe = NULL;
+    if (missing(ctx) && num_filenames) {
+        MP_VERBOSE(ctx, "Probing %d files.\n", num_filenames);
+        probe = probe_files(ctx, filenames, num_filenames);
+        talloc_steal(tmp, probe);
+        for (int i = 0; i < num_filenames; i++) {
+            struct probe_file *f = &probe->files[i];
+            for (int n = 0; n < f->num_demuxers; n++) {
+                if (!add_source(ctx, f->demuxers[n]))
+                    demux_free(f->demuxers[n]);
+            }
+        }
+    }
+
+    // Sequential scan for remaining sources, e.g. added by editions of the
+    // sources found above. Skip files which are known to be useless.
     int old_source_count;
     do {
         old_source_count = ctx->num_sources;
         for (int i = 0; i < num_filenames; i++) {
             if (!missing(ctx))
                 break;
+            if (probe && !may_have_missing(ctx, &probe->files[i]))
+                continue;
             MP_VERBOSE(ctx, "Checking file %s\n", filenames[i]);
             check_file(ctx, filenames[i], 0);
         }
@@ -276,19 +276,31 @@ static bool raw_read_packet(struct demuxer *demuxer, struct demux_packet **pkt)
     if (demuxer->stream->eof)
         return false;
 
-    struct demux_packet *dp = new_demux_packet(p->frame_size * p->read_frames);
+    int64_t pos = stream_tell(demuxer->stream);
+    int size = p->frame_size * p->read_frames;
+
+    // Reference the file data directly if possible (--file-mmap).
+    struct demux_packet *dp = NULL;
+    AVBufferRef *buf = stream_read_ref(demuxer->stream, size);
+    if (buf) {
+        dp = new_demux_packet_from_buf(buf);
+        av_buffer_unref(&buf);
+    } else {
+        dp = new_demux_packet(size);
+        if (dp) {
+            int len = stream_read(demuxer->stream, dp->buffer, dp->len);
+            demux_packet_shorten(dp, len);
+        }
+    }
     if (!dp) {
         MP_ERR(demuxer, "Can't read packet.\n");
         return true;
     }
 
     dp->keyframe = true;
-    dp->pos = stream_tell(demuxer->stream);
+    dp->pos = pos;
     dp->pts = (dp->pos  / p->frame_size) / p->frame_rate;
 
-    int len = stream_read(demuxer->stream, dp->buffer, dp->len);
-    demux_packet_shorten(dp, len);
-
     dp->stream = p->sh->index;
     *pkt = dp;
 
@@ -26,10 +26,12 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 
 #include <libavutil/intfloat.h>
 #include <libavutil/common.h>
+#include <libavutil/intreadwrite.h>
 #include "mpv_talloc.h"
 #include "ebml.h"
 #include "stream/stream.h"
@@ -64,6 +66,22 @@ uint32_t ebml_read_id(stream_t *s)
     int i, len_mask = 0x80;
     uint32_t id;
 
+    // Fast path: parse directly from the stream buffer.
+    bstr data = stream_peek_buffered(s);
+    if (data.len >= 4) {
+        id = data.start[0];
+        for (i = 0; i < 4 && !(id & len_mask); i++)
+            len_mask >>= 1;
+        if (i >= 4) {
+            stream_skip_buffered(s, 1);
+            return EBML_ID_INVALID;
+        }
+        for (int n = 1; n <= i; n++)
+            id = (id << 8) | data.start[n];
+        stream_skip_buffered(s, i + 1);
+        return id;
+    }
+
     for (i = 0, id = stream_read_char(s); i < 4 && !(id & len_mask); i++)
         len_mask >>= 1;
     if (i >= 4)
@@ -81,6 +99,26 @@ uint64_t ebml_read_length(stream_t *s)
     int i, j, num_ffs = 0, len_mask = 0x80;
     uint64_t len;
 
+    // Fast path: parse directly from the stream buffer.
+    bstr data = stream_peek_buffered(s);
+    if (data.len >= 8) {
+        len = data.start[0];
+        for (i = 0; i < 8 && !(len & len_mask); i++)
+            len_mask >>= 1;
+        if (i >= 8) {
+            stream_skip_buffered(s, 1);
+            return EBML_UINT_INVALID;
+        }
+        len &= len_mask - 1;
+        bool all_ones = len == len_mask - 1;
+        for (int n = 1; n <= i; n++) {
+            len = (len << 8) | data.start[n];
+            all_ones &= data.start[n] == 0xFF;
+        }
+        stream_skip_buffered(s, i + 1);
+        return all_ones ? EBML_UINT_INVALID : len;
+    }
+
     for (i = 0, len = stream_read_char(s); i < 8 && !(len & len_mask); i++)
         len_mask >>= 1;
     if (i >= 8)
@@ -194,26 +232,52 @@ invalid:
 /*
  * Skip to (probable) next cluster (MATROSKA_ID_CLUSTER) element start position.
  */
+// Amount of data searched at once by ebml_resync_cluster().
+#define RESYNC_WINDOW (64 * 1024)
+
 int ebml_resync_cluster(struct mp_log *log, stream_t *s)
 {
-    int64_t pos = stream_tell(s);
-    uint32_t last_4_bytes = 0;
-    stream_read_peek(s, &(char){0}, 1);
-    if (!s->eof) {
-        mp_err(log, "Corrupt file detected. "
-               "Trying to resync starting from position %"PRId64"...\n", pos);
+    if (stream_peek(s, 1)) {
+        mp_err(log, "Corrupt file detected. Trying to resync starting from "
+               "position %"PRId64"...\n", stream_tell(s));
     }
-    while (!s->eof) {
-        // Assumes MATROSKA_ID_CLUSTER is 4 bytes, with no 0 bytes.
-        if (last_4_bytes == MATROSKA_ID_CLUSTER) {
-            mp_err(log, "Cluster found at %"PRId64".\n", pos - 4);
-            stream_seek(s, pos - 4);
-            return 0;
+    while (1) {
+        int avail = stream_peek(s, RESYNC_WINDOW);
+        if (avail < 4) {
+            // Consume the rest, so that the caller sees EOF.
+            stream_seek_skip(s, stream_tell(s) + avail);
+            stream_peek(s, 1);
+            return -1;
         }
-        last_4_bytes = (last_4_bytes << 8) | stream_read_char(s);
-        pos++;
+        bstr data = stream_peek_buffered(s);
+        if (data.len < 4) {
+            // Wrap-around in the ring buffer; check this position slowly.
+            uint8_t id[4];
+            stream_read_peek(s, id, 4);
+            if (AV_RB32(id) == MATROSKA_ID_CLUSTER)
+                break;
+            stream_skip_buffered(s, 1);
+            continue;
+        }
+        // Search for the first ID byte with memchr(), which is typically
+        // vectorized by libc, and verify the rest of the ID.
+        int end = data.len - 3;
+        uint8_t *cur = data.start;
+        while ((cur = memchr(cur, MATROSKA_ID_CLUSTER >> 24,
+                             data.start + end - cur)))
+        {
+            if (AV_RB32(cur) == MATROSKA_ID_CLUSTER)
+                break;
+            cur++;
+        }
+        if (cur) {
+            stream_skip_buffered(s, cur - data.start);
+            break;
+        }
+        stream_skip_buffered(s, end);
     }
-    return -1;
+    mp_err(log, "Cluster found at %"PRId64".\n", stream_tell(s));
+    return 0;
 }
 
 
@@ -18,7 +18,11 @@
 #ifndef MPLAYER_MATROSKA_H
 #define MPLAYER_MATROSKA_H
 
+struct mpv_global;
 struct timeline;
 void build_ordered_chapter_timeline(struct timeline *tl);
 
+void mkv_uid_cache_init(struct mpv_global *global);
+void mkv_uid_cache_uninit(struct mpv_global *global);
+
 #endif /* MPLAYER_MATROSKA_H */
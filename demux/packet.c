@@ -19,15 +19,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/intreadwrite.h>
 
 #include "config.h"
 
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "common/av_common.h"
 #include "common/common.h"
 #include "demux.h"
+#include "osdep/atomic.h"
 
 #include "packet.h"
 
@@ -40,7 +46,6 @@ void demux_packet_unref_contents(struct demux_packet *dp)
     if (dp->avpacket) {
         assert(!dp->is_cached);
         av_packet_unref(dp->avpacket);
-        talloc_free(dp->avpacket);
         dp->avpacket = NULL;
         dp->buffer = NULL;
         dp->len = 0;
@@ -53,14 +58,18 @@ static void packet_destroy(void *ptr)
     demux_packet_unref_contents(dp);
 }
 
-// This actually preserves only data and side data, not PTS/DTS/pos/etc.
-// It also allows avpkt->data==NULL with avpkt->size!=0 - the libavcodec API
-// does not allow it, but we do it to simplify new_demux_packet().
-struct demux_packet *new_demux_packet_from_avpacket(struct AVPacket *avpkt)
+// The demux_packet and its AVPacket are a single allocation. (dp must be the
+// first member, so that talloc_free(dp) frees it.)
+struct packet_alloc {
+    struct demux_packet dp;
+    AVPacket avpacket;
+};
+
+// Allocate a packet without data.
+static struct demux_packet *alloc_packet(void)
 {
-    if (avpkt->size > 1000000000)
-        return NULL;
-    struct demux_packet *dp = talloc(NULL, struct demux_packet);
+    struct packet_alloc *pa = talloc(NULL, struct packet_alloc);
+    struct demux_packet *dp = &pa->dp;
     talloc_set_destructor(dp, packet_destroy);
     *dp = (struct demux_packet) {
         .pts = MP_NOPTS_VALUE,
@@ -70,9 +79,152 @@ struct demux_packet *new_demux_packet_from_avpacket(struct AVPacket *avpkt)
         .start = MP_NOPTS_VALUE,
         .end = MP_NOPTS_VALUE,
         .stream = -1,
-        .avpacket = talloc_zero(dp, AVPacket),
+        .avpacket = &pa->avpacket,
     };
     av_init_packet(dp->avpacket);
+    dp->avpacket->data = NULL;
+    dp->avpacket->size = 0;
+    return dp;
+}
+
+// Small packet payloads (typical for audio and subtitles) are carved from
+// shared, refcounted chunks, instead of getting a separate allocation each.
+// A chunk is freed once all packets using it are freed (or copied out by
+// demux_packet_compress()).
+// Each thread carves from its own chunk, so a chunk mostly holds packets that
+// were read one after another, and which are pruned from the cache in roughly
+// that order. Packets of different demuxers still end up in the same chunk if
+// they are read on the same thread (non-threaded demuxers, timeline
+// sub-demuxers, or opening a file). Then a chunk lives as long as the longest
+// lived of its packets; this is a heuristic, not a guarantee.
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_MAX_SIZE 2048 // including padding
+#define ARENA_ALIGN 64
+
+struct arena_chunk {
+    uint8_t *data;
+    atomic_int refs;
+};
+
+// Per-thread allocation state.
+struct arena {
+    struct arena_chunk *cur; // referenced
+    size_t used;
+};
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t arena_key;
+static bool arena_key_ok;
+
+static void arena_unref(struct arena_chunk *chunk)
+{
+    if (atomic_fetch_add(&chunk->refs, -1) == 1) {
+        av_free(chunk->data);
+        free(chunk);
+    }
+}
+
+static void arena_thread_exit(void *p)
+{
+    struct arena *arena = p;
+    if (arena->cur)
+        arena_unref(arena->cur);
+    free(arena);
+}
+
+static void arena_init(void)
+{
+    arena_key_ok = !pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+static void arena_buffer_free(void *opaque, uint8_t *data)
+{
+    arena_unref(opaque);
+}
+
+// Size a payload of len bytes occupies in an arena chunk, or 0 if it is not
+// allocated from the arena.
+static size_t arena_slot_size(size_t len)
+{
+    size_t size = MP_ALIGN_UP(len + AV_INPUT_BUFFER_PADDING_SIZE, ARENA_ALIGN);
+    return size > ARENA_MAX_SIZE ? 0 : size;
+}
+
+// Return a buffer with len bytes of data and zeroed padding, or NULL.
+static AVBufferRef *arena_alloc(size_t len)
+{
+    size_t size = arena_slot_size(len);
+    if (!size)
+        return NULL;
+
+    pthread_once(&arena_once, arena_init);
+    if (!arena_key_ok)
+        return NULL;
+
+    struct arena *arena = pthread_getspecific(arena_key);
+    if (!arena) {
+        arena = calloc(1, sizeof(*arena));
+        if (!arena)
+            return NULL;
+        if (pthread_setspecific(arena_key, arena)) {
+            free(arena);
+            return NULL;
+        }
+    }
+
+    if (!arena->cur || arena->used + size > ARENA_CHUNK_SIZE) {
+        struct arena_chunk *chunk = malloc(sizeof(*chunk));
+        uint8_t *data = av_malloc(ARENA_CHUNK_SIZE);
+        if (!chunk || !data) {
+            free(chunk);
+            av_free(data);
+            return NULL;
+        }
+        chunk->data = data;
+        atomic_store(&chunk->refs, 1);
+        if (arena->cur)
+            arena_unref(arena->cur);
+        arena->cur = chunk;
+        arena->used = 0;
+    }
+    struct arena_chunk *chunk = arena->cur;
+    uint8_t *ptr = chunk->data + arena->used;
+    arena->used += size;
+    atomic_fetch_add(&chunk->refs, 1);
+
+    AVBufferRef *buf = av_buffer_create(ptr, len, arena_buffer_free, chunk, 0);
+    if (!buf) {
+        arena_unref(chunk);
+        return NULL;
+    }
+    memset(ptr + len, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return buf;
+}
+
+// Drop the calling thread's reference to its current arena chunk, so it is
+// freed as soon as the packets allocated from it are. Used when a demuxer is
+// closed on a thread that continues to run.
+void demux_packet_release_arena(void)
+{
+    pthread_once(&arena_once, arena_init);
+    if (!arena_key_ok)
+        return;
+    struct arena *arena = pthread_getspecific(arena_key);
+    if (arena && arena->cur) {
+        arena_unref(arena->cur);
+        arena->cur = NULL;
+        arena->used = 0;
+    }
+}
+
+// This actually preserves only data and side data, not PTS/DTS/pos/etc.
+// It also allows avpkt->data==NULL with avpkt->size!=0 - the libavcodec API
+// does not allow it, but we do it to simplify new_demux_packet().
+struct demux_packet *new_demux_packet_from_avpacket(struct AVPacket *avpkt)
+{
+    if (avpkt->size > 1000000000)
+        return NULL;
+    struct demux_packet *dp = alloc_packet();
     int r = -1;
     if (avpkt->data) {
         // We hope that this function won't need/access AVPacket input padding,
@@ -117,6 +269,17 @@ struct demux_packet *new_demux_packet(size_t len)
 {
     if (len > INT_MAX)
         return NULL;
+    AVBufferRef *buf = len ? arena_alloc(len) : NULL;
+    if (buf) {
+        struct demux_packet *dp = alloc_packet();
+        dp->from_arena = true;
+        dp->avpacket->buf = buf;
+        dp->avpacket->data = buf->data;
+        dp->avpacket->size = len;
+        dp->buffer = buf->data;
+        dp->len = len;
+        return dp;
+    }
     AVPacket pkt = { .data = NULL, .size = len };
     return new_demux_packet_from_avpacket(&pkt);
 }
@@ -156,6 +319,8 @@ struct demux_packet *demux_copy_packet(struct demux_packet *dp)
     struct demux_packet *new = NULL;
     if (dp->avpacket) {
         new = new_demux_packet_from_avpacket(dp->avpacket);
+        if (new)
+            new->from_arena = dp->from_arena;
     } else {
         // Some packets might be not created by new_demux_packet*().
         new = new_demux_packet_from(dp->buffer, dp->len);
@@ -183,7 +348,9 @@ size_t demux_packet_estimate_total_size(struct demux_packet *dp)
     size += 10 * sizeof(void *); // additional estimate for ta_ext_header
     if (dp->avpacket) {
         assert(!dp->is_cached);
-        size += ROUND_ALLOC(dp->len);
+        // Arena payloads count with their full slot.
+        size_t slot = dp->from_arena ? arena_slot_size(dp->len) : 0;
+        size += slot ? slot : ROUND_ALLOC(dp->len);
         size += ROUND_ALLOC(sizeof(AVPacket));
         size += 8 * sizeof(void *); // ta  overhead
         size += ROUND_ALLOC(sizeof(AVBufferRef));
@@ -226,3 +393,82 @@ int demux_packet_add_blockadditional(struct demux_packet *dp, uint64_t id,
         memcpy(sd + 8, data, size);
     return 0;
 }
+
+// Replace the packet data with a compressed copy, if that saves enough memory.
+// Side data is left alone. The packet can't be used normally anymore; use
+// demux_packet_decompress() to get a new packet with the original data.
+// Returns whether the packet was compressed.
+bool demux_packet_compress(struct demux_packet *dp)
+{
+#if HAVE_ZLIB
+    if (!dp->avpacket || dp->is_cached || dp->is_compressed || dp->len < 64 ||
+        dp->len > INT32_MAX || (dp->avpacket->flags & AV_PKT_FLAG_TRUSTED))
+        return false;
+
+    // The compressed data is prefixed with the original size.
+    uLong bound = compressBound(dp->len);
+    if (bound > INT_MAX - 4)
+        return false;
+    AVBufferRef *buf = av_buffer_alloc(4 + bound);
+    if (!buf)
+        return false;
+
+    uLongf clen = bound;
+    if (compress2(buf->data + 4, &clen, dp->buffer, dp->len, Z_BEST_SPEED)
+            != Z_OK || clen + 4 > dp->len - dp->len / 8)
+    {
+        // Not worth it (typically already compressed audio/video).
+        av_buffer_unref(&buf);
+        return false;
+    }
+
+    if (av_buffer_realloc(&buf, 4 + clen) < 0) {
+        av_buffer_unref(&buf);
+        return false;
+    }
+    AV_WL32(buf->data, dp->len);
+
+    av_buffer_unref(&dp->avpacket->buf);
+    dp->avpacket->buf = buf;
+    dp->avpacket->data = buf->data;
+    dp->avpacket->size = buf->size;
+    dp->buffer = buf->data;
+    dp->len = buf->size;
+    dp->is_compressed = true;
+    // The arena slot was released with the old buffer. (A cold range is
+    // compressed as a whole, so this normally frees entire chunks.)
+    dp->from_arena = false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Return a new packet with the uncompressed data and all properties of the
+// given compressed packet. Returns NULL on failure.
+struct demux_packet *demux_packet_decompress(struct demux_packet *dp)
+{
+    assert(dp->is_compressed);
+#if HAVE_ZLIB
+    if (dp->len < 4)
+        return NULL;
+
+    uLongf len = AV_RL32(dp->buffer);
+    struct demux_packet *new = new_demux_packet(len);
+    if (!new)
+        return NULL;
+
+    if (uncompress(new->buffer, &len, dp->buffer + 4, dp->len - 4) != Z_OK ||
+        len != new->len ||
+        av_packet_copy_props(new->avpacket, dp->avpacket) < 0)
+    {
+        talloc_free(new);
+        return NULL;
+    }
+
+    demux_packet_copy_attribs(new, dp);
+    return new;
+#else
+    return NULL;
+#endif
+}
@@ -53,6 +53,13 @@ typedef struct demux_packet {
     // If true, cached_data is valid, while buffer/len are not.
     bool is_cached : 1;
 
+    // If true, buffer/len contain the zlib compressed packet data (see
+    // demux_packet_compress()).
+    bool is_compressed : 1;
+
+    // If true, the data is in a shared arena chunk (see new_demux_packet()).
+    bool from_arena : 1;
+
     // segmentation (ordered chapters, EDL)
     bool segmented;
     struct mp_codec_params *codec;  // set to non-NULL iff segmented is set
@@ -82,5 +89,9 @@ int demux_packet_add_blockadditional(struct demux_packet *dp, uint64_t id,
                                      void *data, size_t size);
 
 void demux_packet_unref_contents(struct demux_packet *dp);
+void demux_packet_release_arena(void);
+
+bool demux_packet_compress(struct demux_packet *dp);
+struct demux_packet *demux_packet_decompress(struct demux_packet *dp);
 
 #endif /* MPLAYER_DEMUX_PACKET_H */
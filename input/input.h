@@ -236,4 +236,21 @@ char *mp_json_encode_event(struct mpv_event *event);
 struct mpv_handle;
 char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *buf);
 
+enum mp_ipc_protocol {
+    MP_IPC_PROTOCOL_JSON,       // newline-separated JSON or text commands
+    MP_IPC_PROTOCOL_MSGPACK,    // 32 bit big endian length + MessagePack
+};
+
+// Execute the first complete message in buf (raw data received from an IPC
+// client). *protocol is the connection's current protocol (initially
+// MP_IPC_PROTOCOL_JSON), which the message can change. The reply, if any, is
+// appended to *reply (allocated with ta_parent).
+// Returns the number of bytes consumed, 0 if buf contains no complete message,
+// or -1 if the connection should be closed.
+int64_t mp_ipc_run_next_message(struct mpv_handle *client, void *ta_parent,
+                                bstr buf, int *protocol, bstr *reply);
+
+// Serialize the given event for the given protocol.
+bstr mp_ipc_encode_event(void *ta_parent, struct mpv_event *event, int protocol);
+
 #endif /* MPLAYER_INPUT_H */
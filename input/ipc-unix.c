@@ -15,6 +15,7 @@
  * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <assert.h>
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
@@ -24,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "config.h"
@@ -36,6 +38,7 @@
 #include "common/msg.h"
 #include "input/input.h"
 #include "libmpv/client.h"
+#include "misc/thread_pool.h"
 #include "options/m_config.h"
 #include "options/options.h"
 #include "options/path.h"
@@ -45,16 +48,79 @@
 #define MSG_NOSIGNAL 0
 #endif
 
+// Maximum number of bytes read from a client socket per poll loop iteration.
+#define READ_CHUNK (64 * 1024)
+// Maximum number of threads running client commands concurrently.
+#define MAX_WORKERS 8
+// Maximum number of queued messages passed to a single sendmsg() call.
+#define MAX_IOV 64
+
+enum {
+    OVERFLOW_BLOCK,
+    OVERFLOW_DROP,
+    OVERFLOW_DISCONNECT,
+};
+
+struct ipc_opts {
+    int64_t buffer_size;
+    int overflow;
+};
+
+#define OPT_BASE_STRUCT struct ipc_opts
+
+const struct m_sub_options ipc_conf = {
+    .opts = (const struct m_option[]){
+        {"input-ipc-buffer-size", OPT_BYTE_SIZE(buffer_size),
+            M_RANGE(4096, M_MAX_MEM_BYTES)},
+        {"input-ipc-overflow", OPT_CHOICE(overflow,
+            {"block", OVERFLOW_BLOCK}, {"drop", OVERFLOW_DROP},
+            {"disconnect", OVERFLOW_DISCONNECT})},
+        {0}
+    },
+    .size = sizeof(struct ipc_opts),
+    .defaults = &(const struct ipc_opts){
+        .buffer_size = 4 * 1024 * 1024,
+    },
+};
+
+struct client_arg;
+
 struct mp_ipc_ctx {
     struct mp_log *log;
     struct mp_client_api *client_api;
     const char *path;
 
+    // -- owned by the IPC thread (updated from opts_cache)
+    struct m_config_cache *opts_cache;
+    int64_t buffer_size;
+    int overflow;
+
     pthread_t thread;
-    int death_pipe[2];
+    int wakeup_pipe[2];
+
+    // Client commands may block for a long time, so they are run here instead
+    // of on the IPC thread.
+    struct mp_thread_pool *workers;
+
+    pthread_mutex_t lock;
+
+    // -- protected by lock
+    bool thread_running;
+    bool terminate;         // mp_uninit_ipc() was called
+    bool detached;          // the thread frees the ctx when it exits
+    int num_clients;        // clients owned by the thread (incl. new_clients)
+    struct client_arg **new_clients; // not yet picked up by the thread
+    int num_new_clients;
+
+    // -- owned by the IPC thread
+    int listen_fd;
+    int client_num;
+    struct client_arg **clients;
+    int num_active_clients;
 };
 
 struct client_arg {
+    struct mp_ipc_ctx *ctx;
     struct mp_log *log;
     struct mpv_handle *client;
 
@@ -64,156 +130,293 @@ struct client_arg {
     bool quit_on_close;
 
     bool writable;
+
+    // -- owned by the IPC thread
+    int wakeup_fd;          // mpv_get_wakeup_pipe()
+    int protocol;           // enum mp_ipc_protocol
+    bstr in;                // received data, not processed yet
+    bstr *out;              // queued messages, oldest first
+    int num_out;
+    size_t out_pos;         // bytes of out[0] that were already sent
+    int64_t out_bytes;      // total number of unsent bytes
+    bool events_pending;    // stopped reading events due to backpressure
+    uint64_t num_dropped;   // events dropped since the last warning
+    bool dead;
+    // If set, run_commands_job() is running on a worker. It owns "in" and the
+    // job_* fields until job_done is set; the IPC thread must not touch them.
+    bool busy;
+
+    // -- set by run_commands_job()
+    bstr job_reply;         // replies, allocated with NULL parent
+    int64_t job_consumed;   // number of bytes of "in" processed
+    int job_protocol;       // protocol after the processed messages
+    bool job_failed;        // client should be disconnected
+
+    // -- protected by mp_ipc_ctx.lock
+    bool job_done;
 };
 
-static int ipc_write_str(struct client_arg *client, const char *buf)
+static void ipc_wakeup(struct mp_ipc_ctx *ctx)
+{
+    (void)write(ctx->wakeup_pipe[1], &(char){0}, 1);
+}
+
+// Whether the client's output buffer is full, and no further input should be
+// read until the client has received some data.
+static bool client_is_congested(struct mp_ipc_ctx *ctx, struct client_arg *client)
+{
+    return ctx->overflow == OVERFLOW_BLOCK &&
+           client->out_bytes >= ctx->buffer_size;
+}
+
+// Append msg to the output queue. msg.start must be a talloc allocation, and
+// ownership is transferred.
+static void queue_msg(struct mp_ipc_ctx *ctx, struct client_arg *client,
+                      bstr msg, bool is_event)
 {
-    size_t count = strlen(buf);
-    while (count > 0) {
-        ssize_t rc = send(client->client_fd, buf, count, MSG_NOSIGNAL);
-        if (rc <= 0) {
-            if (rc == 0)
-                return -1;
+    size_t len = msg.len;
+    if (!client->writable || !len) {
+        talloc_free(msg.start);
+        return;
+    }
+
+    // Replies are never dropped, as clients might wait for them.
+    if (is_event && ctx->overflow == OVERFLOW_DROP &&
+        client->out_bytes + len > ctx->buffer_size)
+    {
+        if (!client->num_dropped)
+            MP_WARN(client, "Output buffer full, dropping events.\n");
+        client->num_dropped++;
+        talloc_free(msg.start);
+        return;
+    }
+
+    talloc_steal(client, msg.start);
+    MP_TARRAY_APPEND(client, client->out, client->num_out, msg);
+    client->out_bytes += len;
+}
+
+static void clear_output(struct client_arg *client)
+{
+    for (int n = 0; n < client->num_out; n++)
+        talloc_free(client->out[n].start);
+    client->num_out = 0;
+    client->out_pos = 0;
+    client->out_bytes = 0;
+}
+
+// Write as much queued output as possible without blocking. Returns false on
+// fatal errors.
+static bool flush_output(struct client_arg *client)
+{
+    while (client->num_out) {
+        struct iovec iov[MAX_IOV];
+        int num_iov = MPMIN(client->num_out, MAX_IOV);
+        for (int n = 0; n < num_iov; n++) {
+            size_t skip = n ? 0 : client->out_pos;
+            iov[n] = (struct iovec){
+                .iov_base = client->out[n].start + skip,
+                .iov_len = client->out[n].len - skip,
+            };
+        }
+
+        struct msghdr hdr = { .msg_iov = iov, .msg_iovlen = num_iov };
+        ssize_t rc = sendmsg(client->client_fd, &hdr, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
 
             if (errno == EBADF || errno == ENOTSOCK) {
                 client->writable = false;
-                return 0;
+                clear_output(client);
+                return true;
             }
 
-            if (errno == EINTR || errno == EAGAIN)
-                continue;
-
-            return rc;
+            MP_ERR(client, "Write error (%s)\n", mp_strerror(errno));
+            return false;
+        }
+        if (rc == 0)
+            return true;
+
+        client->out_bytes -= rc;
+
+        // Remove all messages that were sent completely.
+        size_t done = rc;
+        int num_sent = 0;
+        while (num_sent < client->num_out &&
+               done >= client->out[num_sent].len - client->out_pos)
+        {
+            done -= client->out[num_sent].len - client->out_pos;
+            client->out_pos = 0;
+            talloc_free(client->out[num_sent].start);
+            num_sent++;
         }
+        client->out_pos += done;
+        client->num_out -= num_sent;
+        memmove(client->out, client->out + num_sent,
+                client->num_out * sizeof(client->out[0]));
+    }
 
-        count -= rc;
-        buf   += rc;
+    if (client->num_dropped) {
+        MP_WARN(client, "%llu events were dropped.\n",
+                (unsigned long long)client->num_dropped);
+        client->num_dropped = 0;
     }
 
-    return 0;
+    return true;
 }
 
-static void *client_thread(void *p)
+// Encode all pending events. Returns false if the client should be
+// disconnected.
+static bool read_events(struct mp_ipc_ctx *ctx, struct client_arg *client)
 {
-    pthread_detach(pthread_self());
+    client->events_pending = false;
 
-    // We don't use MSG_NOSIGNAL because the moldy fruit OS doesn't support it.
-    struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART };
-    sigfillset(&sa.sa_mask);
-    sigaction(SIGPIPE, &sa, NULL);
+    while (1) {
+        if (client_is_congested(ctx, client)) {
+            client->events_pending = true;
+            break;
+        }
 
-    int rc;
+        mpv_event *event = mpv_wait_event(client->client, 0);
 
-    struct client_arg *arg = p;
-    bstr client_msg = { talloc_strdup(NULL, ""), 0 };
+        if (event->event_id == MPV_EVENT_NONE)
+            break;
 
-    mpthread_set_name(arg->client_name);
+        if (event->event_id == MPV_EVENT_SHUTDOWN)
+            return false;
 
-    int pipe_fd = mpv_get_wakeup_pipe(arg->client);
-    if (pipe_fd < 0) {
-        MP_ERR(arg, "Could not get wakeup pipe\n");
-        goto done;
+        if (!client->writable)
+            continue;
+
+        bstr event_msg = mp_ipc_encode_event(NULL, event, client->protocol);
+        if (!event_msg.len) {
+            talloc_free(event_msg.start);
+            MP_ERR(client, "Encoding error\n");
+            return false;
+        }
+
+        queue_msg(ctx, client, event_msg, true);
     }
 
-    MP_VERBOSE(arg, "Client connected\n");
+    return true;
+}
 
-    struct pollfd fds[2] = {
-        {.events = POLLIN, .fd = pipe_fd},
-        {.events = POLLIN, .fd = arg->client_fd},
-    };
+// Run all complete messages in the input buffer. Commands can block (e.g.
+// until a file is loaded), so this runs on a worker thread, and only the
+// job_* fields are written.
+static void run_commands_job(void *p)
+{
+    struct client_arg *client = p;
+    struct mp_ipc_ctx *ctx = client->ctx;
 
-    fcntl(arg->client_fd, F_SETFL, fcntl(arg->client_fd, F_GETFL, 0) | O_NONBLOCK);
+    bstr rest = client->in;
+    int protocol = client->protocol;
+    bstr reply = {0};
+    bool failed = false;
 
     while (1) {
-        rc = poll(fds, 2, 0);
-        if (rc == 0)
-            rc = poll(fds, 2, -1);
-        if (rc < 0) {
-            MP_ERR(arg, "Poll error\n");
-            continue;
+        int64_t r = mp_ipc_run_next_message(client->client, NULL, rest,
+                                            &protocol, &reply);
+        if (r <= 0) {
+            failed = r < 0;
+            break;
         }
+        rest = bstr_cut(rest, r);
+    }
 
-        if (fds[0].revents & POLLIN) {
-            mp_flush_wakeup_pipe(pipe_fd);
-
-            while (1) {
-                mpv_event *event = mpv_wait_event(arg->client, 0);
+    client->job_reply = reply;
+    client->job_consumed = client->in.len - rest.len;
+    client->job_protocol = protocol;
+    client->job_failed = failed;
 
-                if (event->event_id == MPV_EVENT_NONE)
-                    break;
+    pthread_mutex_lock(&ctx->lock);
+    client->job_done = true;
+    ipc_wakeup(ctx);
+    pthread_mutex_unlock(&ctx->lock);
+}
 
-                if (event->event_id == MPV_EVENT_SHUTDOWN)
-                    goto done;
+static void start_commands(struct mp_ipc_ctx *ctx, struct client_arg *client)
+{
+    assert(!client->busy);
+    client->busy = true;
+    client->job_done = false;
+    if (!mp_thread_pool_queue(ctx->workers, run_commands_job, client))
+        run_commands_job(client);
+}
 
-                if (!arg->writable)
-                    continue;
+// Pick up the results of a finished run_commands_job(). Returns false if the
+// client should be disconnected.
+static bool finish_commands(struct mp_ipc_ctx *ctx, struct client_arg *client)
+{
+    if (!client->busy)
+        return true;
 
-                char *event_msg = mp_json_encode_event(event);
-                if (!event_msg) {
-                    MP_ERR(arg, "Encoding error\n");
-                    goto done;
-                }
+    pthread_mutex_lock(&ctx->lock);
+    bool done = client->job_done;
+    pthread_mutex_unlock(&ctx->lock);
+    if (!done)
+        return true;
 
-                rc = ipc_write_str(arg, event_msg);
-                talloc_free(event_msg);
-                if (rc < 0) {
-                    MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
-                    goto done;
-                }
-            }
-        }
+    client->busy = false;
 
-        if (fds[1].revents & (POLLIN | POLLHUP | POLLNVAL)) {
-            while (1) {
-                char buf[128];
-                bstr append = { buf, 0 };
+    if (client->job_reply.start)
+        queue_msg(ctx, client, client->job_reply, false);
+    client->job_reply = (bstr){0};
 
-                ssize_t bytes = read(arg->client_fd, buf, sizeof(buf));
-                if (bytes < 0) {
-                    if (errno == EAGAIN)
-                        break;
+    bstr rest = bstr_cut(client->in, client->job_consumed);
+    memmove(client->in.start, rest.start, rest.len);
+    client->in.len = rest.len;
+    client->protocol = client->job_protocol;
 
-                    MP_ERR(arg, "Read error (%s)\n", mp_strerror(errno));
-                    goto done;
-                }
+    return !client->job_failed;
+}
 
-                if (bytes == 0) {
-                    MP_VERBOSE(arg, "Client disconnected\n");
-                    goto done;
-                }
+// Read some available input, and start running the received commands. To be
+// fair to other clients, at most READ_CHUNK bytes are read per call. Returns
+// false if the client should be disconnected.
+static bool read_input(struct mp_ipc_ctx *ctx, struct client_arg *client)
+{
+    if (client->busy || client_is_congested(ctx, client))
+        return true;
 
-                append.len = bytes;
+    MP_TARRAY_GROW(client, client->in.start, client->in.len + READ_CHUNK);
 
-                bstr_xappend(NULL, &client_msg, append);
+    ssize_t bytes;
+    do {
+        bytes = read(client->client_fd, client->in.start + client->in.len,
+                     READ_CHUNK);
+    } while (bytes < 0 && errno == EINTR);
 
-                while (bstrchr(client_msg, '\n') != -1) {
-                    char *reply_msg = mp_ipc_consume_next_command(arg->client,
-                        NULL, &client_msg);
+    if (bytes < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return true;
 
-                    if (reply_msg && arg->writable) {
-                        rc = ipc_write_str(arg, reply_msg);
-                        if (rc < 0) {
-                            MP_ERR(arg, "Write error (%s)\n", mp_strerror(errno));
-                            talloc_free(reply_msg);
-                            goto done;
-                        }
-                    }
+        MP_ERR(client, "Read error (%s)\n", mp_strerror(errno));
+        return false;
+    }
 
-                    talloc_free(reply_msg);
-                }
-            }
-        }
+    if (bytes == 0) {
+        MP_VERBOSE(client, "Client disconnected\n");
+        return false;
     }
 
-done:
-    if (client_msg.len > 0)
-        MP_WARN(arg, "Ignoring unterminated command on disconnect.\n");
-    talloc_free(client_msg.start);
-    if (arg->close_client_fd)
-        close(arg->client_fd);
-    struct mpv_handle *h = arg->client;
-    bool quit = arg->quit_on_close;
-    talloc_free(arg);
+    client->in.len += bytes;
+    start_commands(ctx, client);
+    return true;
+}
+
+static void *destroy_handle_thread(void *p)
+{
+    pthread_detach(pthread_self());
+
+    struct client_arg *client = p;
+    struct mpv_handle *h = client->client;
+    bool quit = client->quit_on_close;
+    talloc_free(client);
     if (quit) {
         mpv_terminate_destroy(h);
     } else {
@@ -222,6 +425,48 @@ done:
     return NULL;
 }
 
+static void destroy_client(struct mp_ipc_ctx *ctx, struct client_arg *client)
+{
+    if (client->in.len > 0)
+        MP_WARN(client, "Ignoring unterminated command on disconnect.\n");
+    if (client->close_client_fd)
+        close(client->client_fd);
+
+    // Destroying the handle can block for a while (e.g. until the core has
+    // terminated, which in turn waits for the other clients served by the IPC
+    // thread), so do it on a separate thread.
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, destroy_handle_thread, client))
+        destroy_handle_thread(client);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->num_clients--;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void add_client(struct mp_ipc_ctx *ctx, void *ta_parent,
+                       struct client_arg *client)
+{
+    client->wakeup_fd = mpv_get_wakeup_pipe(client->client);
+    if (client->wakeup_fd < 0) {
+        MP_ERR(client, "Could not get wakeup pipe\n");
+        destroy_client(ctx, client);
+        return;
+    }
+
+    MP_VERBOSE(client, "Client connected\n");
+
+    fcntl(client->client_fd, F_SETFL,
+          fcntl(client->client_fd, F_GETFL, 0) | O_NONBLOCK);
+
+    // Events might have been queued before the wakeup pipe was created.
+    client->events_pending = true;
+
+    MP_TARRAY_APPEND(ta_parent, ctx->clients, ctx->num_active_clients, client);
+}
+
+static bool ipc_start_thread_locked(struct mp_ipc_ctx *ctx);
+
 static bool ipc_start_client(struct mp_ipc_ctx *ctx, struct client_arg *client,
                              bool free_on_init_fail)
 {
@@ -230,10 +475,18 @@ static bool ipc_start_client(struct mp_ipc_ctx *ctx, struct client_arg *client,
     if (!client->client)
         goto err;
 
+    client->ctx = ctx;
     client->log = mp_client_get_log(client->client);
 
-    pthread_t client_thr;
-    if (pthread_create(&client_thr, NULL, client_thread, client))
+    pthread_mutex_lock(&ctx->lock);
+    bool ok = !ctx->terminate && ipc_start_thread_locked(ctx);
+    if (ok) {
+        MP_TARRAY_APPEND(NULL, ctx->new_clients, ctx->num_new_clients, client);
+        ctx->num_clients++;
+        ipc_wakeup(ctx);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    if (!ok)
         goto err;
 
     return true;
@@ -269,6 +522,9 @@ static void ipc_start_client_json(struct mp_ipc_ctx *ctx, int id, int fd)
 bool mp_ipc_start_anon_client(struct mp_ipc_ctx *ctx, struct mpv_handle *h,
                               int out_fd[2])
 {
+    if (!ctx)
+        return false;
+
     int pair[2];
     if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair))
         return false;
@@ -295,23 +551,19 @@ bool mp_ipc_start_anon_client(struct mp_ipc_ctx *ctx, struct mpv_handle *h,
     return true;
 }
 
-static void *ipc_thread(void *p)
+static int ipc_listen(struct mp_ipc_ctx *arg)
 {
     int rc;
 
     int ipc_fd;
     struct sockaddr_un ipc_un = {0};
 
-    struct mp_ipc_ctx *arg = p;
-
-    mpthread_set_name("ipc socket listener");
-
     MP_VERBOSE(arg, "Starting IPC master\n");
 
     ipc_fd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (ipc_fd < 0) {
         MP_ERR(arg, "Could not create IPC socket\n");
-        goto done;
+        goto error;
     }
 
     fchmod(ipc_fd, 0600);
@@ -319,7 +571,7 @@ static void *ipc_thread(void *p)
     size_t path_len = strlen(arg->path);
     if (path_len >= sizeof(ipc_un.sun_path) - 1) {
         MP_ERR(arg, "Could not create IPC socket\n");
-        goto done;
+        goto error;
     }
 
     ipc_un.sun_family = AF_UNIX,
@@ -336,50 +588,198 @@ static void *ipc_thread(void *p)
     rc = bind(ipc_fd, (struct sockaddr *) &ipc_un, addr_len);
     if (rc < 0) {
         MP_ERR(arg, "Could not bind IPC socket\n");
-        goto done;
+        goto error;
     }
 
     rc = listen(ipc_fd, 10);
     if (rc < 0) {
         MP_ERR(arg, "Could not listen on IPC socket\n");
-        goto done;
+        goto error;
     }
 
     MP_VERBOSE(arg, "Listening to IPC socket.\n");
 
-    int client_num = 0;
+    return ipc_fd;
 
-    struct pollfd fds[2] = {
-        {.events = POLLIN, .fd = arg->death_pipe[0]},
-        {.events = POLLIN, .fd = ipc_fd},
-    };
+error:
+    if (ipc_fd >= 0)
+        close(ipc_fd);
+    return -1;
+}
+
+static void ipc_free(struct mp_ipc_ctx *arg)
+{
+    // (Before closing the pipe, as this unregisters the wakeup callback.)
+    TA_FREEP(&arg->opts_cache);
+    close(arg->wakeup_pipe[0]);
+    close(arg->wakeup_pipe[1]);
+    pthread_mutex_destroy(&arg->lock);
+    talloc_free(arg);
+}
+
+// Serves the listening socket and all clients.
+static void *ipc_thread(void *p)
+{
+    struct mp_ipc_ctx *arg = p;
+
+    mpthread_set_name("ipc");
+
+    // We don't use MSG_NOSIGNAL because the moldy fruit OS doesn't support it.
+    struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = SA_RESTART };
+    sigfillset(&sa.sa_mask);
+    sigaction(SIGPIPE, &sa, NULL);
+
+    void *tmp = talloc_new(NULL);
+    struct pollfd *fds = NULL;
+    int timeout = -1;
+
+    if (arg->path && arg->path[0])
+        arg->listen_fd = ipc_listen(arg);
 
     while (1) {
-        rc = poll(fds, 2, -1);
+        pthread_mutex_lock(&arg->lock);
+        struct client_arg **new_clients = arg->new_clients;
+        int num_new_clients = arg->num_new_clients;
+        arg->new_clients = NULL;
+        arg->num_new_clients = 0;
+        bool terminate = arg->terminate;
+        bool exit_thread = terminate && arg->num_clients == 0;
+        bool detached = arg->detached;
+        pthread_mutex_unlock(&arg->lock);
+
+        if (m_config_cache_update(arg->opts_cache)) {
+            struct ipc_opts *opts = arg->opts_cache->opts;
+            arg->buffer_size = opts->buffer_size;
+            arg->overflow = opts->overflow;
+        }
+
+        for (int n = 0; n < num_new_clients; n++)
+            add_client(arg, tmp, new_clients[n]);
+        talloc_free(new_clients);
+
+        if (terminate && arg->listen_fd >= 0) {
+            close(arg->listen_fd);
+            arg->listen_fd = -1;
+        }
+
+        if (exit_thread) {
+            talloc_free(tmp);
+            if (detached)
+                ipc_free(arg);
+            return NULL;
+        }
+
+        int num_fds = 2 + arg->num_active_clients * 2;
+        MP_TARRAY_GROW(tmp, fds, num_fds);
+        fds[0] = (struct pollfd){.events = POLLIN, .fd = arg->wakeup_pipe[0]};
+        fds[1] = (struct pollfd){.events = POLLIN, .fd = arg->listen_fd};
+        for (int n = 0; n < arg->num_active_clients; n++) {
+            struct client_arg *client = arg->clients[n];
+            bool congested = client_is_congested(arg, client);
+            // While commands are running, input is not read. Then the socket
+            // is polled only for output (also to avoid spinning on POLLHUP).
+            bool want_input = !congested && !client->busy;
+            bool poll_fd = !client->dead && (want_input || client->num_out);
+            // poll() ignores negative FDs.
+            fds[2 + n * 2] = (struct pollfd){
+                .events = POLLIN,
+                .fd = congested || client->dead ? -1 : client->wakeup_fd,
+            };
+            fds[2 + n * 2 + 1] = (struct pollfd){
+                .events = (want_input ? POLLIN : 0) |
+                          (client->num_out ? POLLOUT : 0),
+                .fd = poll_fd ? client->client_fd : -1,
+            };
+        }
+
+        int rc = poll(fds, num_fds, timeout);
         if (rc < 0) {
-            MP_ERR(arg, "Poll error\n");
+            if (errno != EINTR)
+                MP_ERR(arg, "Poll error\n");
             continue;
         }
 
         if (fds[0].revents & POLLIN)
-            goto done;
+            mp_flush_wakeup_pipe(arg->wakeup_pipe[0]);
 
         if (fds[1].revents & POLLIN) {
-            int client_fd = accept(ipc_fd, NULL, NULL);
+            int client_fd = accept(arg->listen_fd, NULL, NULL);
             if (client_fd < 0) {
                 MP_ERR(arg, "Could not accept IPC client\n");
-                goto done;
+                close(arg->listen_fd);
+                arg->listen_fd = -1;
+            } else {
+                ipc_start_client_json(arg, arg->client_num++, client_fd);
             }
+        }
+
+        timeout = -1;
+        for (int n = 0; n < arg->num_active_clients; n++) {
+            struct client_arg *client = arg->clients[n];
+            short ev_revents = fds[2 + n * 2].revents;
+            short fd_revents = fds[2 + n * 2 + 1].revents;
+
+            if (!finish_commands(arg, client))
+                client->dead = true;
+
+            if (client->dead)
+                continue;
+
+            if (ev_revents & POLLIN) {
+                mp_flush_wakeup_pipe(client->wakeup_fd);
+                client->events_pending = true;
+            }
+
+            if (client->events_pending && !read_events(arg, client))
+                client->dead = true;
+
+            if (!client->dead &&
+                (fd_revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) &&
+                !read_input(arg, client))
+                client->dead = true;
 
-            ipc_start_client_json(arg, client_num++, client_fd);
+            // Coalesce all events and replies produced above into as few
+            // writes as possible.
+            if (!client->dead && !flush_output(client))
+                client->dead = true;
+
+            if (!client->dead && arg->overflow == OVERFLOW_DISCONNECT &&
+                client->out_bytes > arg->buffer_size)
+            {
+                MP_ERR(client, "Output buffer full, disconnecting.\n");
+                client->dead = true;
+            }
+
+            // Backpressure was released, but the wakeup pipe was already
+            // flushed, so don't wait for it.
+            if (client->events_pending && !client_is_congested(arg, client))
+                timeout = 0;
+        }
+
+        for (int n = arg->num_active_clients - 1; n >= 0; n--) {
+            struct client_arg *client = arg->clients[n];
+            // (A running job still references the client.)
+            if (client->dead && !client->busy) {
+                MP_TARRAY_REMOVE_AT(arg->clients, arg->num_active_clients, n);
+                destroy_client(arg, client);
+            }
         }
     }
+}
 
-done:
-    if (ipc_fd >= 0)
-        close(ipc_fd);
+static bool ipc_start_thread_locked(struct mp_ipc_ctx *ctx)
+{
+    if (!ctx->thread_running) {
+        if (pthread_create(&ctx->thread, NULL, ipc_thread, ctx))
+            return false;
+        ctx->thread_running = true;
+    }
+    return true;
+}
 
-    return NULL;
+static void opts_wakeup_cb(void *p)
+{
+    ipc_wakeup(p);
 }
 
 struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
@@ -392,9 +792,31 @@ struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
         .log        = mp_log_new(arg, global->log, "ipc"),
         .client_api = client_api,
         .path       = mp_get_user_path(arg, global, opts->ipc_path),
-        .death_pipe = {-1, -1},
+        .listen_fd  = -1,
     };
 
+    if (mp_make_wakeup_pipe(arg->wakeup_pipe) < 0) {
+        talloc_free(opts);
+        talloc_free(arg);
+        return NULL;
+    }
+    pthread_mutex_init(&arg->lock, NULL);
+
+    arg->workers = mp_thread_pool_create(arg, 0, 0, MAX_WORKERS);
+
+    arg->opts_cache = m_config_cache_alloc(arg, global, &ipc_conf);
+    m_config_cache_set_wakeup_cb(arg->opts_cache, opts_wakeup_cb, arg);
+    struct ipc_opts *ipc_opts = arg->opts_cache->opts;
+    arg->buffer_size = ipc_opts->buffer_size;
+    arg->overflow = ipc_opts->overflow;
+
+    if (arg->path && arg->path[0]) {
+        pthread_mutex_lock(&arg->lock);
+        if (!ipc_start_thread_locked(arg))
+            MP_ERR(arg, "Could not start IPC thread\n");
+        pthread_mutex_unlock(&arg->lock);
+    }
+
     if (opts->ipc_client && opts->ipc_client[0]) {
         int fd = -1;
         if (strncmp(opts->ipc_client, "fd://", 5) == 0) {
@@ -412,24 +834,7 @@ struct mp_ipc_ctx *mp_init_ipc(struct mp_client_api *client_api,
 
     talloc_free(opts);
 
-    if (!arg->path || !arg->path[0])
-        goto out;
-
-    if (mp_make_wakeup_pipe(arg->death_pipe) < 0)
-        goto out;
-
-    if (pthread_create(&arg->thread, NULL, ipc_thread, arg))
-        goto out;
-
     return arg;
-
-out:
-    if (arg->death_pipe[0] >= 0) {
-        close(arg->death_pipe[0]);
-        close(arg->death_pipe[1]);
-    }
-    talloc_free(arg);
-    return NULL;
 }
 
 void mp_uninit_ipc(struct mp_ipc_ctx *arg)
@@ -437,10 +842,23 @@ void mp_uninit_ipc(struct mp_ipc_ctx *arg)
     if (!arg)
         return;
 
-    (void)write(arg->death_pipe[1], &(char){0}, 1);
-    pthread_join(arg->thread, NULL);
+    pthread_mutex_lock(&arg->lock);
+    arg->terminate = true;
+    bool running = arg->thread_running;
+    pthread_t thread = arg->thread;
+    // Clients which are still connected keep the thread running (this happens
+    // if the options are changed at runtime). It frees arg on exit.
+    arg->detached = running && arg->num_clients > 0;
+    bool detached = arg->detached;
+    ipc_wakeup(arg);
+    pthread_mutex_unlock(&arg->lock);
+
+    if (detached) {
+        pthread_detach(thread);
+        return;
+    }
 
-    close(arg->death_pipe[0]);
-    close(arg->death_pipe[1]);
-    talloc_free(arg);
+    if (running)
+        pthread_join(thread, NULL);
+    ipc_free(arg);
 }
@@ -15,17 +15,25 @@
  * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <inttypes.h>
+
+#include <libavutil/intreadwrite.h>
+
 #include "config.h"
 
 #include "common/msg.h"
 #include "input/input.h"
 #include "misc/json.h"
+#include "misc/msgpack.h"
 #include "misc/node.h"
 #include "options/m_option.h"
 #include "options/options.h"
 #include "options/path.h"
 #include "player/client.h"
 
+// Maximum size of a single MessagePack message.
+#define MAX_MSGPACK_FRAME (64 * 1024 * 1024)
+
 static mpv_node *mpv_node_array_get(mpv_node *src, int index)
 {
     if (src->format != MPV_FORMAT_NODE_ARRAY)
@@ -89,19 +97,25 @@ static void mpv_format_command_reply(void *ta_parent, mpv_event *event,
     mpv_node_map_add(ta_parent, dst, "data", &cmd->result);
 }
 
-char *mp_json_encode_event(mpv_event *event)
+// The returned node is allocated under ta_parent.
+static void event_to_node(void *ta_parent, mpv_event *event, mpv_node *dst)
 {
-    void *ta_parent = talloc_new(NULL);
-
-    struct mpv_node event_node;
     if (event->event_id == MPV_EVENT_COMMAND_REPLY) {
-        event_node = (mpv_node){.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
-        mpv_format_command_reply(ta_parent, event, &event_node);
+        *dst = (mpv_node){.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
+        mpv_format_command_reply(ta_parent, event, dst);
     } else {
-        mpv_event_to_node(&event_node, event);
+        mpv_event_to_node(dst, event);
         // Abuse mpv_event_to_node() internals.
-        talloc_steal(ta_parent, node_get_alloc(&event_node));
+        talloc_steal(ta_parent, node_get_alloc(dst));
     }
+}
+
+char *mp_json_encode_event(mpv_event *event)
+{
+    void *ta_parent = talloc_new(NULL);
+
+    struct mpv_node event_node;
+    event_to_node(ta_parent, event, &event_node);
 
     char *output = talloc_strdup(NULL, "");
     json_write(&output, &event_node);
@@ -112,35 +126,182 @@ char *mp_json_encode_event(mpv_event *event)
     return output;
 }
 
-// Function is allowed to modify src[n].
-static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
-                                  char *src)
+// Append a length-prefixed MessagePack message to *dst.
+static int write_msgpack_frame(void *ta_parent, bstr *dst, mpv_node *src)
+{
+    size_t start = dst->len;
+    bstr_xappend(ta_parent, dst, (bstr){(unsigned char *)"\0\0\0\0", 4});
+    if (msgpack_write(ta_parent, dst, src) < 0) {
+        dst->len = start;
+        return -1;
+    }
+    AV_WB32(dst->start + start, dst->len - start - 4);
+    return 0;
+}
+
+bstr mp_ipc_encode_event(void *ta_parent, mpv_event *event, int protocol)
+{
+    if (protocol != MP_IPC_PROTOCOL_MSGPACK) {
+        char *s = talloc_steal(ta_parent, mp_json_encode_event(event));
+        return bstr0(s);
+    }
+
+    void *tmp = talloc_new(NULL);
+
+    struct mpv_node event_node;
+    event_to_node(tmp, event, &event_node);
+
+    bstr output = {0};
+    write_msgpack_frame(ta_parent, &output, &event_node);
+
+    talloc_free(tmp);
+
+    return output;
+}
+
+// Commands handled by execute_message() itself. They are not supported in
+// batches.
+static const char *const ipc_only_commands[] = {
+    "client_name", "get_time_us", "get_version", "get_property_string",
+    "observe_property", "observe_property_string", "unobserve_property",
+    "request_log_messages", "enable_event", "disable_event", "set_protocol",
+    NULL
+};
+
+static bool is_ipc_only_command(const char *cmd)
+{
+    for (int n = 0; ipc_only_commands[n]; n++) {
+        if (!strcmp(ipc_only_commands[n], cmd))
+            return true;
+    }
+    return false;
+}
+
+// Run all commands of a "batch" request, and put their replies into the "data"
+// field of reply_node.
+static int json_execute_batch(struct mpv_handle *client, void *ta_parent,
+                              mpv_node *msg_node, mpv_node *batch_node,
+                              mpv_node *reply_node)
+{
+    if (batch_node->format != MPV_FORMAT_NODE_ARRAY)
+        return MPV_ERROR_INVALID_PARAMETER;
+
+    bool atomic = false;
+    mpv_node *atomic_node = node_map_get(msg_node, "atomic");
+    if (atomic_node) {
+        if (atomic_node->format != MPV_FORMAT_FLAG)
+            return MPV_ERROR_INVALID_PARAMETER;
+        atomic = atomic_node->u.flag;
+    }
+
+    int num_reqs = batch_node->u.list->num;
+    struct mp_batch_request *reqs =
+        talloc_zero_array(ta_parent, struct mp_batch_request, num_reqs);
+
+    for (int n = 0; n < num_reqs; n++) {
+        struct mp_batch_request *req = &reqs[n];
+        mpv_node *item = &batch_node->u.list->values[n];
+        if (item->format != MPV_FORMAT_NODE_MAP)
+            return MPV_ERROR_INVALID_PARAMETER;
+
+        mpv_node *cmd_node = node_map_get(item, "command");
+        if (!cmd_node)
+            return MPV_ERROR_INVALID_PARAMETER;
+
+        *req = (struct mp_batch_request){
+            .type = MP_BATCH_COMMAND,
+            .arg = cmd_node,
+        };
+
+        if (cmd_node->format != MPV_FORMAT_NODE_ARRAY)
+            continue;
+
+        mpv_node *cmd_str_node = mpv_node_array_get(cmd_node, 0);
+        if (!cmd_str_node || cmd_str_node->format != MPV_FORMAT_STRING)
+            return MPV_ERROR_INVALID_PARAMETER;
+
+        const char *cmd = cmd_str_node->u.string;
+        mpv_node *name_node = mpv_node_array_get(cmd_node, 1);
+
+        if (!strcmp("get_property", cmd)) {
+            if (cmd_node->u.list->num != 2 ||
+                name_node->format != MPV_FORMAT_STRING)
+                return MPV_ERROR_INVALID_PARAMETER;
+
+            req->type = MP_BATCH_GET_PROPERTY;
+            req->name = name_node->u.string;
+        } else if (!strcmp("set_property", cmd) ||
+                   !strcmp("set_property_string", cmd))
+        {
+            if (cmd_node->u.list->num != 3 ||
+                name_node->format != MPV_FORMAT_STRING)
+                return MPV_ERROR_INVALID_PARAMETER;
+
+            req->type = MP_BATCH_SET_PROPERTY;
+            req->name = name_node->u.string;
+            req->arg = &cmd_node->u.list->values[2];
+        } else if (is_ipc_only_command(cmd)) {
+            return MPV_ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    int rc = mp_client_run_batch(client, reqs, num_reqs, atomic);
+
+    mpv_node results = {
+        .format = MPV_FORMAT_NODE_ARRAY,
+        .u.list = talloc_zero(ta_parent, mpv_node_list),
+    };
+    for (int n = 0; n < num_reqs; n++) {
+        struct mp_batch_request *req = &reqs[n];
+
+        MP_TARRAY_GROW(results.u.list, results.u.list->values,
+                       results.u.list->num);
+        mpv_node *entry = &results.u.list->values[results.u.list->num++];
+
+        // Requests that were not run get null, unless they were rejected.
+        *entry = (mpv_node){.format = MPV_FORMAT_NONE};
+        if (req->executed || req->status < 0) {
+            entry->format = MPV_FORMAT_NODE_MAP;
+            entry->u.list = NULL;
+            mpv_node_map_add_string(ta_parent, entry, "error",
+                                    mpv_error_string(req->status));
+            if (req->executed)
+                mpv_node_map_add(ta_parent, entry, "data", &req->result);
+        }
+
+        mpv_free_node_contents(&req->result);
+    }
+
+    mpv_node_map_add(ta_parent, reply_node, "data", &results);
+
+    return rc;
+}
+
+// Execute the message in msg_node (NULL if it could not be parsed), and write
+// the reply to *reply_node. protocol is NULL if the connection can't switch
+// protocols. Otherwise the new protocol is set in *protocol, which must be
+// applied after the reply has been sent. Returns false if no reply is sent.
+static bool execute_message(struct mpv_handle *client, void *ta_parent,
+                            mpv_node *msg_node, mpv_node *reply_node,
+                            int *protocol)
 {
     int rc;
     const char *cmd = NULL;
     struct mp_log *log = mp_client_get_log(client);
 
-    mpv_node msg_node;
-    mpv_node reply_node = {.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
+    *reply_node = (mpv_node){.format = MPV_FORMAT_NODE_MAP, .u.list = NULL};
     mpv_node *reqid_node = NULL;
     int64_t reqid = 0;
     mpv_node *async_node = NULL;
     bool async = false;
     bool send_reply = true;
 
-    rc = json_parse(ta_parent, &msg_node, &src, 50);
-    if (rc < 0) {
-        mp_err(log, "malformed JSON received: '%s'\n", src);
+    if (!msg_node || msg_node->format != MPV_FORMAT_NODE_MAP) {
         rc = MPV_ERROR_INVALID_PARAMETER;
         goto error;
     }
 
-    if (msg_node.format != MPV_FORMAT_NODE_MAP) {
-        rc = MPV_ERROR_INVALID_PARAMETER;
-        goto error;
-    }
-
-    async_node = node_map_get(&msg_node, "async");
+    async_node = node_map_get(msg_node, "async");
     if (async_node) {
         if (async_node->format != MPV_FORMAT_FLAG) {
             rc = MPV_ERROR_INVALID_PARAMETER;
@@ -149,7 +310,7 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         async = async_node->u.flag;
     }
 
-    reqid_node = node_map_get(&msg_node, "request_id");
+    reqid_node = node_map_get(msg_node, "request_id");
     if (reqid_node) {
         if (reqid_node->format == MPV_FORMAT_INT64) {
             reqid = reqid_node->u.int64;
@@ -163,7 +324,18 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         }
     }
 
-    mpv_node *cmd_node = node_map_get(&msg_node, "command");
+    mpv_node *batch_node = node_map_get(msg_node, "batch");
+    if (batch_node) {
+        if (async) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+        rc = json_execute_batch(client, ta_parent, msg_node, batch_node,
+                                reply_node);
+        goto error;
+    }
+
+    mpv_node *cmd_node = node_map_get(msg_node, "command");
     if (!cmd_node) {
         rc = MPV_ERROR_INVALID_PARAMETER;
         goto error;
@@ -181,15 +353,15 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
 
     if (cmd && !strcmp("client_name", cmd)) {
         const char *client_name = mpv_client_name(client);
-        mpv_node_map_add_string(ta_parent, &reply_node, "data", client_name);
+        mpv_node_map_add_string(ta_parent, reply_node, "data", client_name);
         rc = MPV_ERROR_SUCCESS;
     } else if (cmd && !strcmp("get_time_us", cmd)) {
         int64_t time_us = mpv_get_time_us(client);
-        mpv_node_map_add_int64(ta_parent, &reply_node, "data", time_us);
+        mpv_node_map_add_int64(ta_parent, reply_node, "data", time_us);
         rc = MPV_ERROR_SUCCESS;
     } else if (cmd && !strcmp("get_version", cmd)) {
         int64_t ver = mpv_client_api_version();
-        mpv_node_map_add_int64(ta_parent, &reply_node, "data", ver);
+        mpv_node_map_add_int64(ta_parent, reply_node, "data", ver);
         rc = MPV_ERROR_SUCCESS;
     } else if (cmd && !strcmp("get_property", cmd)) {
         mpv_node result_node;
@@ -207,7 +379,7 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         rc = mpv_get_property(client, cmd_node->u.list->values[1].u.string,
                               MPV_FORMAT_NODE, &result_node);
         if (rc >= 0) {
-            mpv_node_map_add(ta_parent, &reply_node, "data", &result_node);
+            mpv_node_map_add(ta_parent, reply_node, "data", &result_node);
             mpv_free_node_contents(&result_node);
         }
     } else if (cmd && !strcmp("get_property_string", cmd)) {
@@ -224,10 +396,10 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         char *result = mpv_get_property_string(client,
                                         cmd_node->u.list->values[1].u.string);
         if (result) {
-            mpv_node_map_add_string(ta_parent, &reply_node, "data", result);
+            mpv_node_map_add_string(ta_parent, reply_node, "data", result);
             mpv_free(result);
         } else {
-            mpv_node_map_add_null(ta_parent, &reply_node, "data");
+            mpv_node_map_add_null(ta_parent, reply_node, "data");
         }
     } else if (cmd && (!strcmp("set_property", cmd) ||
                        !strcmp("set_property_string", cmd)))
@@ -343,6 +515,32 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
             }
             rc = mpv_request_event(client, event, enable);
         }
+    } else if (cmd && !strcmp("set_protocol", cmd)) {
+        if (cmd_node->u.list->num != 2) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        if (cmd_node->u.list->values[1].format != MPV_FORMAT_STRING) {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+
+        if (!protocol) {
+            rc = MPV_ERROR_NOT_IMPLEMENTED;
+            goto error;
+        }
+
+        char *name = cmd_node->u.list->values[1].u.string;
+        if (strcmp(name, "json") == 0) {
+            *protocol = MP_IPC_PROTOCOL_JSON;
+        } else if (strcmp(name, "msgpack") == 0) {
+            *protocol = MP_IPC_PROTOCOL_MSGPACK;
+        } else {
+            rc = MPV_ERROR_INVALID_PARAMETER;
+            goto error;
+        }
+        rc = MPV_ERROR_SUCCESS;
     } else {
         mpv_node result_node = {0};
 
@@ -353,7 +551,7 @@ static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
         } else {
             rc = mpv_command_node(client, cmd_node, &result_node);
             if (rc >= 0)
-                mpv_node_map_add(ta_parent, &reply_node, "data", &result_node);
+                mpv_node_map_add(ta_parent, reply_node, "data", &result_node);
         }
 
         mpv_free_node_contents(&result_node);
@@ -365,16 +563,33 @@ error:
      * the original requests.
      */
     if (reqid_node) {
-        mpv_node_map_add(ta_parent, &reply_node, "request_id", reqid_node);
+        mpv_node_map_add(ta_parent, reply_node, "request_id", reqid_node);
     } else {
-        mpv_node_map_add_int64(ta_parent, &reply_node, "request_id", 0);
+        mpv_node_map_add_int64(ta_parent, reply_node, "request_id", 0);
     }
 
-    mpv_node_map_add_string(ta_parent, &reply_node, "error", mpv_error_string(rc));
+    mpv_node_map_add_string(ta_parent, reply_node, "error", mpv_error_string(rc));
 
+    return send_reply;
+}
+
+// Function is allowed to modify src[n].
+static char *json_execute_command(struct mpv_handle *client, void *ta_parent,
+                                  char *src, int *protocol)
+{
+    struct mp_log *log = mp_client_get_log(client);
+
+    mpv_node msg_node;
+    bool ok = json_parse(ta_parent, &msg_node, &src, 50) >= 0;
+    if (!ok)
+        mp_err(log, "malformed JSON received: '%s'\n", src);
+
+    mpv_node reply_node;
     char *output = talloc_strdup(ta_parent, "");
 
-    if (send_reply) {
+    if (execute_message(client, ta_parent, ok ? &msg_node : NULL, &reply_node,
+                        protocol))
+    {
         json_write(&output, &reply_node);
         output = ta_talloc_strdup_append(output, "\n");
     }
@@ -405,7 +620,7 @@ char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *bu
     if (line0[0] == '\0' || line0[0] == '#') {
         // skip
     } else if (line0[0] == '{') {
-        reply_msg = json_execute_command(client, tmp, line0);
+        reply_msg = json_execute_command(client, tmp, line0, NULL);
     } else {
         reply_msg = text_execute_command(client, tmp, line0);
     }
@@ -414,3 +629,79 @@ char *mp_ipc_consume_next_command(struct mpv_handle *client, void *ctx, bstr *bu
     talloc_free(tmp);
     return reply_msg;
 }
+
+static int64_t run_json_message(struct mpv_handle *client, void *ta_parent,
+                                bstr buf, int *protocol, bstr *reply)
+{
+    int end = bstrchr(buf, '\n');
+    if (end < 0)
+        return 0;
+
+    void *tmp = talloc_new(NULL);
+
+    char *line0 = bstrto0(tmp, bstr_splice(buf, 0, end));
+    json_skip_whitespace(&line0);
+
+    char *reply_msg = NULL;
+    if (line0[0] == '\0' || line0[0] == '#') {
+        // skip
+    } else if (line0[0] == '{') {
+        reply_msg = json_execute_command(client, tmp, line0, protocol);
+    } else {
+        reply_msg = text_execute_command(client, tmp, line0);
+    }
+
+    if (reply_msg && reply_msg[0])
+        bstr_xappend(ta_parent, reply, bstr0(reply_msg));
+
+    talloc_free(tmp);
+    return end + 1;
+}
+
+static int64_t run_msgpack_message(struct mpv_handle *client, void *ta_parent,
+                                   bstr buf, int *protocol, bstr *reply)
+{
+    struct mp_log *log = mp_client_get_log(client);
+
+    if (buf.len < 4)
+        return 0;
+    uint32_t size = AV_RB32(buf.start);
+    if (size > MAX_MSGPACK_FRAME) {
+        mp_err(log, "IPC message too large (%"PRIu32" bytes).\n", size);
+        return -1;
+    }
+    if (buf.len - 4 < size)
+        return 0;
+
+    void *tmp = talloc_new(NULL);
+
+    bstr frame = bstr_splice(buf, 4, 4 + size);
+    mpv_node msg_node;
+    bool ok = msgpack_parse(tmp, &msg_node, &frame, 50) >= 0 && !frame.len;
+    if (!ok)
+        mp_err(log, "malformed MessagePack message received\n");
+
+    mpv_node reply_node;
+    if (execute_message(client, tmp, ok ? &msg_node : NULL, &reply_node,
+                        protocol))
+        write_msgpack_frame(ta_parent, reply, &reply_node);
+
+    talloc_free(tmp);
+    return 4 + (int64_t)size;
+}
+
+int64_t mp_ipc_run_next_message(struct mpv_handle *client, void *ta_parent,
+                                bstr buf, int *protocol, bstr *reply)
+{
+    // A protocol switch applies to the messages after the current one, so
+    // the reply still uses the old protocol.
+    int new_protocol = *protocol;
+    int64_t r;
+    if (*protocol == MP_IPC_PROTOCOL_MSGPACK) {
+        r = run_msgpack_message(client, ta_parent, buf, &new_protocol, reply);
+    } else {
+        r = run_json_message(client, ta_parent, buf, &new_protocol, reply);
+    }
+    *protocol = new_protocol;
+    return r;
+}
@@ -47,6 +47,8 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
 
 #include "common/common.h"
 #include "misc/bstr.h"
@@ -78,7 +80,45 @@ void json_skip_whitespace(char **src)
     eat_ws(src);
 }
 
-static int read_id(void *ta_parent, struct mpv_node *dst, char **src)
+// Parser state for a single json_parse() call.
+struct json_parser {
+    void *ta_parent;
+    // Bump allocator for all node lists, value arrays and key arrays of the
+    // document. Chunks are allocated under ta_parent.
+    char *arena;
+    size_t arena_left;
+    size_t arena_next;      // size of the next chunk
+    // Items of all arrays/objects that are currently being parsed. When a
+    // list is finished, its items are copied to the arena with exact size, so
+    // the result doesn't need to be grown with realloc.
+    struct json_item *items;
+    int num_items;
+};
+
+struct json_item {
+    char *key;              // only for objects
+    struct mpv_node value;
+};
+
+static void *arena_alloc(struct json_parser *p, size_t size)
+{
+    size = MP_ALIGN_UP(size, sizeof(void *) * 2);
+    if (size > p->arena_left) {
+        size_t chunk = MPMAX(p->arena_next, size);
+        p->arena = talloc_size(p->ta_parent, chunk);
+        p->arena_left = chunk;
+        p->arena_next = chunk * 2;
+    }
+    void *res = p->arena;
+    p->arena += size;
+    p->arena_left -= size;
+    return res;
+}
+
+static int parse_value(struct json_parser *p, struct mpv_node *dst, char **src,
+                       int max_depth);
+
+static int read_id(struct json_parser *p, struct mpv_node *dst, char **src)
 {
     char *start = *src;
     if (!mp_isalpha(**src) && **src != '_')
@@ -89,14 +129,18 @@ static int read_id(void *ta_parent, struct mpv_node *dst, char **src)
         **src = '\0'; // we're allowed to mutate it => can avoid the strndup
         *src += 1;
     } else {
-        start = talloc_strndup(ta_parent, start, *src - start);
+        size_t len = *src - start;
+        char *copy = arena_alloc(p, len + 1);
+        memcpy(copy, start, len);
+        copy[len] = '\0';
+        start = copy;
     }
     dst->format = MPV_FORMAT_STRING;
     dst->u.string = start;
     return 0;
 }
 
-static int read_str(void *ta_parent, struct mpv_node *dst, char **src)
+static int read_str(struct json_parser *p, struct mpv_node *dst, char **src)
 {
     if (!eat_c(src, '"'))
         return -1; // not a string
@@ -121,7 +165,7 @@ static int read_str(void *ta_parent, struct mpv_node *dst, char **src)
     if (has_escapes) {
         bstr unescaped = {0};
         bstr r = bstr0(str);
-        if (!mp_append_escaped_string(ta_parent, &unescaped, &r))
+        if (!mp_append_escaped_string(p->ta_parent, &unescaped, &r))
             return -1; // broken escapes
         str = unescaped.start; // the function guarantees null-termination
     }
@@ -130,7 +174,7 @@ static int read_str(void *ta_parent, struct mpv_node *dst, char **src)
     return 0;
 }
 
-static int read_sub(void *ta_parent, struct mpv_node *dst, char **src,
+static int read_sub(struct json_parser *p, struct mpv_node *dst, char **src,
                     int max_depth)
 {
     bool is_arr = eat_c(src, '[');
@@ -138,53 +182,55 @@ static int read_sub(void *ta_parent, struct mpv_node *dst, char **src,
     if (!is_arr && !is_obj)
         return -1; // not an array or object
     char term = is_obj ? '}' : ']';
-    struct mpv_node_list *list = talloc_zero(ta_parent, struct mpv_node_list);
+    int first = p->num_items;
     while (1) {
         eat_ws(src);
         if (eat_c(src, term))
             break;
-        if (list->num > 0 && !eat_c(src, ','))
+        if (p->num_items > first && !eat_c(src, ','))
             return -1; // missing ','
         eat_ws(src);
         // non-standard extension: allow a trailing ","
         if (eat_c(src, term))
             break;
+        struct json_item item = {0};
         if (is_obj) {
             struct mpv_node keynode;
             // non-standard extension: allow unquoted strings as keys
-            if (read_id(list, &keynode, src) < 0 &&
-                read_str(list, &keynode, src) < 0)
+            if (read_id(p, &keynode, src) < 0 && read_str(p, &keynode, src) < 0)
                 return -1; // key is not a string
             eat_ws(src);
             // non-standard extension: allow "=" instead of ":"
             if (!eat_c(src, ':') && !eat_c(src, '='))
                 return -1; // ':' missing
             eat_ws(src);
-            MP_TARRAY_GROW(list, list->keys, list->num);
-            list->keys[list->num] = keynode.u.string;
+            item.key = keynode.u.string;
         }
-        MP_TARRAY_GROW(list, list->values, list->num);
-        if (json_parse(ta_parent, &list->values[list->num], src, max_depth) < 0)
+        // (Don't parse into p->items directly; it's reallocated by sublists.)
+        if (parse_value(p, &item.value, src, max_depth) < 0)
             return -1;
-        list->num++;
+        MP_TARRAY_APPEND(NULL, p->items, p->num_items, item);
+    }
+    struct mpv_node_list *list = arena_alloc(p, sizeof(*list));
+    *list = (struct mpv_node_list){ .num = p->num_items - first };
+    if (list->num) {
+        list->values = arena_alloc(p, list->num * sizeof(list->values[0]));
+        if (is_obj)
+            list->keys = arena_alloc(p, list->num * sizeof(list->keys[0]));
+        for (int n = 0; n < list->num; n++) {
+            list->values[n] = p->items[first + n].value;
+            if (is_obj)
+                list->keys[n] = p->items[first + n].key;
+        }
     }
+    p->num_items = first;
     dst->format = is_obj ? MPV_FORMAT_NODE_MAP : MPV_FORMAT_NODE_ARRAY;
     dst->u.list = list;
     return 0;
 }
 
-/* Parse the string in *src as JSON, and write the result into *dst.
- * max_depth limits the recursion and JSON tree depth.
- * Warning: this overwrites the input string (what *src points to)!
- * Returns:
- *   0: success, *dst is valid, *src points to the end (the caller must check
- *      whether *src really terminates)
- *  -1: failure, *dst is invalid, there may be dead allocs under ta_parent
- *      (ta_free_children(ta_parent) is the only way to free them)
- * The input string can be mutated in both cases. *dst might contain string
- * elements, which point into the (mutated) input string.
- */
-int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
+static int parse_value(struct json_parser *p, struct mpv_node *dst, char **src,
+                       int max_depth)
 {
     max_depth -= 1;
     if (max_depth < 0)
@@ -210,9 +256,9 @@ int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
         dst->u.flag = 0;
         return 0;
     } else if (c == '"') {
-        return read_str(ta_parent, dst, src);
+        return read_str(p, dst, src);
     } else if (c == '[' || c == '{') {
-        return read_sub(ta_parent, dst, src, max_depth);
+        return read_sub(p, dst, src, max_depth);
     } else if (c == '-' || (c >= '0' && c <= '9')) {
         // The number could be either a float or an int. JSON doesn't make a
         // difference, but the client API does.
@@ -242,8 +288,62 @@ int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
     return -1; // character doesn't start a valid token
 }
 
+/* Parse the string in *src as JSON, and write the result into *dst.
+ * max_depth limits the recursion and JSON tree depth.
+ * Warning: this overwrites the input string (what *src points to)!
+ * Returns:
+ *   0: success, *dst is valid, *src points to the end (the caller must check
+ *      whether *src really terminates)
+ *  -1: failure, *dst is invalid, there may be dead allocs under ta_parent
+ *      (ta_free_children(ta_parent) is the only way to free them)
+ * The input string can be mutated in both cases. *dst might contain string
+ * elements, which point into the (mutated) input string.
+ * All lists of the result are allocated from a few large blocks under
+ * ta_parent, so they must not be resized or freed individually.
+ */
+int json_parse(void *ta_parent, struct mpv_node *dst, char **src, int max_depth)
+{
+    // The tree is usually smaller than twice the input text, so most documents
+    // need only a single block.
+    size_t len = strlen(*src);
+    struct json_parser p = {
+        .ta_parent = ta_parent,
+        .arena_next = MPCLAMP(len * 2, 256, 1024 * 1024),
+    };
+    int r = parse_value(&p, dst, src, max_depth);
+    talloc_free(p.items);
+    return r;
+}
+
+
+// Output is collected in a fixed buffer first, so that bstr_xappend() (and
+// the allocation size lookup it does) isn't called for every single token.
+struct json_writer {
+    bstr *dst;
+    size_t len;
+    unsigned char buf[4096];
+};
 
-#define APPEND(b, s) bstr_xappend(NULL, (b), bstr0(s))
+static void flush_output(struct json_writer *w)
+{
+    bstr_xappend(NULL, w->dst, (bstr){w->buf, w->len});
+    w->len = 0;
+}
+
+static void append_data(struct json_writer *w, const void *data, size_t len)
+{
+    if (len > sizeof(w->buf) - w->len) {
+        flush_output(w);
+        if (len > sizeof(w->buf)) {
+            bstr_xappend(NULL, w->dst, (bstr){(unsigned char *)data, len});
+            return;
+        }
+    }
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+#define APPEND(w, s) append_data((w), (s), strlen(s))
 
 static const char special_escape[] = {
     ['\b'] = 'b',
@@ -253,78 +353,120 @@ static const char special_escape[] = {
     ['\t'] = 't',
 };
 
-static void write_json_str(bstr *b, unsigned char *str)
+// Whether c must be escaped in a JSON string. This includes '\0'.
+static inline bool needs_escape(unsigned char c)
 {
-    APPEND(b, "\"");
+    return c < 32 || c == '"' || c == '\\';
+}
+
+// Whether any of the 8 bytes in v needs escaping. This checks all bytes at
+// once with the usual "has zero byte" bit trick; it's exact (no false
+// positives), but doesn't tell which byte matched.
+static inline bool word_needs_escape(uint64_t v)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t quote = v ^ (ones * '"');
+    uint64_t backslash = v ^ (ones * '\\');
+    // The high bit of quote/backslash is always the same as in v.
+    return ((v - ones * 32) | (quote - ones) | (backslash - ones)) & ~v &
+           (ones * 0x80);
+}
+
+static void write_json_str(struct json_writer *w, unsigned char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char *cur = str;
+    unsigned char *end = str + strlen(str);
+    APPEND(w, "\"");
     while (1) {
-        unsigned char *cur = str;
-        while (cur[0] >= 32 && cur[0] != '"' && cur[0] != '\\')
+        while (end - cur >= 8) {
+            uint64_t v;
+            memcpy(&v, cur, 8);
+            if (word_needs_escape(v))
+                break;
+            cur += 8;
+        }
+        while (cur < end && !needs_escape(cur[0]))
             cur++;
-        if (!cur[0])
+        if (cur == end)
             break;
-        bstr_xappend(NULL, b, (bstr){str, cur - str});
-        if (cur[0] == '\"') {
-            bstr_xappend(NULL, b, (bstr){"\\\"", 2});
-        } else if (cur[0] == '\\') {
-            bstr_xappend(NULL, b, (bstr){"\\\\", 2});
-        } else if (cur[0] < sizeof(special_escape) && special_escape[cur[0]]) {
-            bstr_xappend_asprintf(NULL, b, "\\%c", special_escape[cur[0]]);
-        } else {
-            bstr_xappend_asprintf(NULL, b, "\\u%04x", (unsigned char)cur[0]);
+        append_data(w, str, cur - str);
+        unsigned char esc[6] = {'\\', cur[0]};
+        int esc_len = 2;
+        if (cur[0] < sizeof(special_escape) && special_escape[cur[0]]) {
+            esc[1] = special_escape[cur[0]];
+        } else if (cur[0] < 32) {
+            memcpy(esc + 1, "u00", 3);
+            esc[4] = hex[cur[0] >> 4];
+            esc[5] = hex[cur[0] & 15];
+            esc_len = 6;
         }
-        str = cur + 1;
+        append_data(w, esc, esc_len);
+        str = ++cur;
     }
-    APPEND(b, str);
-    APPEND(b, "\"");
+    append_data(w, str, end - str);
+    APPEND(w, "\"");
 }
 
-static void add_indent(bstr *b, int indent)
+static void add_indent(struct json_writer *w, int indent)
 {
     if (indent < 0)
         return;
-    bstr_xappend(NULL, b, bstr0("\n"));
+    APPEND(w, "\n");
     for (int n = 0; n < indent; n++)
-        bstr_xappend(NULL, b, bstr0(" "));
+        APPEND(w, " ");
 }
 
-static int json_append(bstr *b, const struct mpv_node *src, int indent)
+static int json_append(struct json_writer *w, const struct mpv_node *src,
+                       int indent)
 {
     switch (src->format) {
     case MPV_FORMAT_NONE:
-        APPEND(b, "null");
+        APPEND(w, "null");
         return 0;
     case MPV_FORMAT_FLAG:
-        APPEND(b, src->u.flag ? "true" : "false");
+        APPEND(w, src->u.flag ? "true" : "false");
         return 0;
-    case MPV_FORMAT_INT64:
-        bstr_xappend_asprintf(NULL, b, "%"PRId64, src->u.int64);
+    case MPV_FORMAT_INT64: {
+        char buf[32];
+        int len = snprintf(buf, sizeof(buf), "%"PRId64, src->u.int64);
+        append_data(w, buf, len);
         return 0;
+    }
     case MPV_FORMAT_DOUBLE: {
         const char *px = isfinite(src->u.double_) ? "" : "\"";
-        bstr_xappend_asprintf(NULL, b, "%s%f%s", px, src->u.double_, px);
+        char buf[64];
+        int len = snprintf(buf, sizeof(buf), "%s%f%s", px, src->u.double_, px);
+        if (len >= 0 && len < sizeof(buf)) {
+            append_data(w, buf, len);
+        } else {
+            flush_output(w);
+            bstr_xappend_asprintf(NULL, w->dst, "%s%f%s", px, src->u.double_,
+                                  px);
+        }
         return 0;
     }
     case MPV_FORMAT_STRING:
-        write_json_str(b, src->u.string);
+        write_json_str(w, src->u.string);
         return 0;
     case MPV_FORMAT_NODE_ARRAY:
     case MPV_FORMAT_NODE_MAP: {
         struct mpv_node_list *list = src->u.list;
         bool is_obj = src->format == MPV_FORMAT_NODE_MAP;
-        APPEND(b, is_obj ? "{" : "[");
+        APPEND(w, is_obj ? "{" : "[");
         int next_indent = indent >= 0 ? indent + 1 : -1;
         for (int n = 0; n < list->num; n++) {
             if (n)
-                APPEND(b, ",");
-            add_indent(b, next_indent);
+                APPEND(w, ",");
+            add_indent(w, next_indent);
             if (is_obj) {
-                write_json_str(b, list->keys[n]);
-                APPEND(b, ":");
+                write_json_str(w, list->keys[n]);
+                APPEND(w, ":");
             }
-            json_append(b, &list->values[n], next_indent);
+            json_append(w, &list->values[n], next_indent);
         }
-        add_indent(b, indent);
-        APPEND(b, is_obj ? "}" : "]");
+        add_indent(w, indent);
+        APPEND(w, is_obj ? "}" : "]");
         return 0;
     }
     }
@@ -334,7 +476,9 @@ static int json_append(bstr *b, const struct mpv_node *src, int indent)
 static int json_append_str(char **dst, struct mpv_node *src, int indent)
 {
     bstr buffer = bstr0(*dst);
-    int r = json_append(&buffer, src, indent);
+    struct json_writer w = { .dst = &buffer };
+    int r = json_append(&w, src, indent);
+    flush_output(&w);
     *dst = buffer.start;
     return r;
 }
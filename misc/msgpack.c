@@ -0,0 +1,335 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* MessagePack parser and writer for mpv_node.
+ *
+ * Mapping of types:
+ *  - nil, bool, float 64, str, array, map: 1:1
+ *  - all integer types: MPV_FORMAT_INT64 (uint 64 values larger than
+ *    INT64_MAX are rejected)
+ *  - float 32: MPV_FORMAT_DOUBLE
+ *  - bin: MPV_FORMAT_BYTE_ARRAY
+ *  - map keys must be strings
+ *  - extension types are rejected
+ *
+ * The writer always uses the smallest possible encoding.
+ *
+ * Also see: https://github.com/msgpack/msgpack/blob/master/spec.md
+ */
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "common/common.h"
+#include "misc/bstr.h"
+
+#include "msgpack.h"
+
+static bool read_be(bstr *src, int bytes, uint64_t *out)
+{
+    if (src->len < bytes)
+        return false;
+    uint64_t v = 0;
+    for (int n = 0; n < bytes; n++)
+        v = (v << 8) | src->start[n];
+    *src = bstr_cut(*src, bytes);
+    *out = v;
+    return true;
+}
+
+static int read_str(void *ta_parent, struct mpv_node *dst, bstr *src,
+                    uint64_t len)
+{
+    if (len > src->len)
+        return -1;
+    dst->format = MPV_FORMAT_STRING;
+    dst->u.string = bstrto0(ta_parent, bstr_splice(*src, 0, len));
+    *src = bstr_cut(*src, len);
+    return 0;
+}
+
+static int read_bin(void *ta_parent, struct mpv_node *dst, bstr *src,
+                    uint64_t len)
+{
+    if (len > src->len)
+        return -1;
+    struct mpv_byte_array *ba = talloc_zero(ta_parent, struct mpv_byte_array);
+    ba->data = talloc_memdup(ba, src->start, len);
+    ba->size = len;
+    dst->format = MPV_FORMAT_BYTE_ARRAY;
+    dst->u.ba = ba;
+    *src = bstr_cut(*src, len);
+    return 0;
+}
+
+static int read_sub(void *ta_parent, struct mpv_node *dst, bstr *src,
+                    uint64_t num, bool is_obj, int max_depth)
+{
+    // Each item takes at least 1 byte; don't allocate absurd amounts of memory
+    // for truncated or malicious input.
+    if (num > src->len)
+        return -1;
+    struct mpv_node_list *list = talloc_zero(ta_parent, struct mpv_node_list);
+    list->values = talloc_array(list, struct mpv_node, num);
+    if (is_obj)
+        list->keys = talloc_array(list, char *, num);
+    for (int n = 0; n < num; n++) {
+        if (is_obj) {
+            struct mpv_node keynode;
+            if (msgpack_parse(list, &keynode, src, max_depth) < 0 ||
+                keynode.format != MPV_FORMAT_STRING)
+                return -1; // key is not a string
+            list->keys[n] = keynode.u.string;
+        }
+        if (msgpack_parse(ta_parent, &list->values[n], src, max_depth) < 0)
+            return -1;
+        list->num++;
+    }
+    dst->format = is_obj ? MPV_FORMAT_NODE_MAP : MPV_FORMAT_NODE_ARRAY;
+    dst->u.list = list;
+    return 0;
+}
+
+/* Parse a single MessagePack value from the start of *src, and write the
+ * result into *dst. max_depth limits the recursion and tree depth.
+ * Returns:
+ *   0: success, *dst is valid, *src is advanced past the value (the caller
+ *      must check whether there is trailing data)
+ *  -1: failure, *dst is invalid, there may be dead allocs under ta_parent
+ * Unlike json_parse(), the input data is not mutated or referenced by *dst.
+ */
+int msgpack_parse(void *ta_parent, struct mpv_node *dst, bstr *src,
+                  int max_depth)
+{
+    max_depth -= 1;
+    if (max_depth < 0)
+        return -1;
+
+    if (!src->len)
+        return -1; // early EOF
+    unsigned char c = src->start[0];
+    *src = bstr_cut(*src, 1);
+
+    uint64_t v;
+    if (c <= 0x7f || c >= 0xe0) { // positive/negative fixint
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = (int8_t)c;
+        return 0;
+    } else if (c <= 0x8f) { // fixmap
+        return read_sub(ta_parent, dst, src, c & 0xf, true, max_depth);
+    } else if (c <= 0x9f) { // fixarray
+        return read_sub(ta_parent, dst, src, c & 0xf, false, max_depth);
+    } else if (c <= 0xbf) { // fixstr
+        return read_str(ta_parent, dst, src, c & 0x1f);
+    }
+
+    switch (c) {
+    case 0xc0:
+        dst->format = MPV_FORMAT_NONE;
+        return 0;
+    case 0xc2:
+    case 0xc3:
+        dst->format = MPV_FORMAT_FLAG;
+        dst->u.flag = c == 0xc3;
+        return 0;
+    case 0xc4:
+    case 0xc5:
+    case 0xc6:
+        if (!read_be(src, 1 << (c - 0xc4), &v))
+            return -1;
+        return read_bin(ta_parent, dst, src, v);
+    case 0xca: {
+        if (!read_be(src, 4, &v))
+            return -1;
+        uint32_t bits = v;
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        dst->format = MPV_FORMAT_DOUBLE;
+        dst->u.double_ = f;
+        return 0;
+    }
+    case 0xcb:
+        if (!read_be(src, 8, &v))
+            return -1;
+        dst->format = MPV_FORMAT_DOUBLE;
+        memcpy(&dst->u.double_, &v, sizeof(v));
+        return 0;
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf:
+        if (!read_be(src, 1 << (c - 0xcc), &v) || v > INT64_MAX)
+            return -1;
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = v;
+        return 0;
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3: {
+        int bytes = 1 << (c - 0xd0);
+        if (!read_be(src, bytes, &v))
+            return -1;
+        // Sign-extend.
+        int shift = 64 - bytes * 8;
+        dst->format = MPV_FORMAT_INT64;
+        dst->u.int64 = shift ? (int64_t)(v << shift) >> shift : (int64_t)v;
+        return 0;
+    }
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+        if (!read_be(src, 1 << (c - 0xd9), &v))
+            return -1;
+        return read_str(ta_parent, dst, src, v);
+    case 0xdc:
+    case 0xdd:
+        if (!read_be(src, c == 0xdc ? 2 : 4, &v))
+            return -1;
+        return read_sub(ta_parent, dst, src, v, false, max_depth);
+    case 0xde:
+    case 0xdf:
+        if (!read_be(src, c == 0xde ? 2 : 4, &v))
+            return -1;
+        return read_sub(ta_parent, dst, src, v, true, max_depth);
+    }
+    return -1; // unused or extension type
+}
+
+static void write_be(void *ta_parent, bstr *b, int tag, uint64_t v, int bytes)
+{
+    unsigned char buf[9];
+    int len = 0;
+    if (tag >= 0)
+        buf[len++] = tag;
+    for (int n = bytes - 1; n >= 0; n--)
+        buf[len++] = v >> (n * 8);
+    bstr_xappend(ta_parent, b, (bstr){buf, len});
+}
+
+// Write the header for a str/bin/array/map. fix_tag/fix_max describe the
+// "fix" variant (fix_tag < 0 if none), tags[] the 8/16/32 bit length variants
+// (tags[0] < 0 if there's no 8 bit variant).
+static int write_len(void *ta_parent, bstr *b, uint64_t len, int fix_tag,
+                     uint64_t fix_max, const int tags[3])
+{
+    if (fix_tag >= 0 && len <= fix_max) {
+        write_be(ta_parent, b, fix_tag | len, 0, 0);
+    } else if (tags[0] >= 0 && len <= UINT8_MAX) {
+        write_be(ta_parent, b, tags[0], len, 1);
+    } else if (len <= UINT16_MAX) {
+        write_be(ta_parent, b, tags[1], len, 2);
+    } else if (len <= UINT32_MAX) {
+        write_be(ta_parent, b, tags[2], len, 4);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void write_int(void *ta_parent, bstr *b, int64_t v)
+{
+    if (v >= 0) {
+        if (v <= 0x7f) {
+            write_be(ta_parent, b, v, 0, 0);
+        } else if (v <= UINT8_MAX) {
+            write_be(ta_parent, b, 0xcc, v, 1);
+        } else if (v <= UINT16_MAX) {
+            write_be(ta_parent, b, 0xcd, v, 2);
+        } else if (v <= UINT32_MAX) {
+            write_be(ta_parent, b, 0xce, v, 4);
+        } else {
+            write_be(ta_parent, b, 0xcf, v, 8);
+        }
+    } else {
+        if (v >= -32) {
+            write_be(ta_parent, b, (uint8_t)v, 0, 0);
+        } else if (v >= INT8_MIN) {
+            write_be(ta_parent, b, 0xd0, (uint8_t)v, 1);
+        } else if (v >= INT16_MIN) {
+            write_be(ta_parent, b, 0xd1, (uint16_t)v, 2);
+        } else if (v >= INT32_MIN) {
+            write_be(ta_parent, b, 0xd2, (uint32_t)v, 4);
+        } else {
+            write_be(ta_parent, b, 0xd3, v, 8);
+        }
+    }
+}
+
+static int write_str(void *ta_parent, bstr *b, const char *s)
+{
+    size_t len = strlen(s);
+    if (write_len(ta_parent, b, len, 0xa0, 31, (const int[]){0xd9, 0xda, 0xdb}) < 0)
+        return -1;
+    bstr_xappend(ta_parent, b, (bstr){(unsigned char *)s, len});
+    return 0;
+}
+
+/* Append the contents of *src as MessagePack to *dst (the allocation is
+ * extended with ta_parent as parent).
+ * Returns: 0 on success, <0 on failure (*dst may contain partial data).
+ */
+int msgpack_write(void *ta_parent, bstr *dst, struct mpv_node *src)
+{
+    switch (src->format) {
+    case MPV_FORMAT_NONE:
+        write_be(ta_parent, dst, 0xc0, 0, 0);
+        return 0;
+    case MPV_FORMAT_FLAG:
+        write_be(ta_parent, dst, src->u.flag ? 0xc3 : 0xc2, 0, 0);
+        return 0;
+    case MPV_FORMAT_INT64:
+        write_int(ta_parent, dst, src->u.int64);
+        return 0;
+    case MPV_FORMAT_DOUBLE: {
+        uint64_t bits;
+        memcpy(&bits, &src->u.double_, sizeof(bits));
+        write_be(ta_parent, dst, 0xcb, bits, 8);
+        return 0;
+    }
+    case MPV_FORMAT_STRING:
+        return write_str(ta_parent, dst, src->u.string);
+    case MPV_FORMAT_BYTE_ARRAY: {
+        struct mpv_byte_array *ba = src->u.ba;
+        if (write_len(ta_parent, dst, ba->size, -1, 0,
+                      (const int[]){0xc4, 0xc5, 0xc6}) < 0)
+            return -1;
+        bstr_xappend(ta_parent, dst, (bstr){ba->data, ba->size});
+        return 0;
+    }
+    case MPV_FORMAT_NODE_ARRAY:
+    case MPV_FORMAT_NODE_MAP: {
+        struct mpv_node_list *list = src->u.list;
+        bool is_obj = src->format == MPV_FORMAT_NODE_MAP;
+        int r = is_obj
+            ? write_len(ta_parent, dst, list->num, 0x80, 15,
+                        (const int[]){-1, 0xde, 0xdf})
+            : write_len(ta_parent, dst, list->num, 0x90, 15,
+                        (const int[]){-1, 0xdc, 0xdd});
+        if (r < 0)
+            return -1;
+        for (int n = 0; n < list->num; n++) {
+            if (is_obj && write_str(ta_parent, dst, list->keys[n]) < 0)
+                return -1;
+            if (msgpack_write(ta_parent, dst, &list->values[n]) < 0)
+                return -1;
+        }
+        return 0;
+    }
+    }
+    return -1; // unknown format
+}
@@ -0,0 +1,12 @@
+#ifndef MP_MSGPACK_H
+#define MP_MSGPACK_H
+
+// We reuse mpv_node.
+#include "libmpv/client.h"
+#include "misc/bstr.h"
+
+int msgpack_parse(void *ta_parent, struct mpv_node *dst, bstr *src,
+                  int max_depth);
+int msgpack_write(void *ta_parent, bstr *dst, struct mpv_node *src);
+
+#endif
@@ -86,6 +86,13 @@ enum mp_property_action {
     // Pass down an action to a sub-property.
     //  arg: struct m_property_action_arg*
     M_PROPERTY_KEY_ACTION,
+
+    // Get a cheap identifier for the current value. If two calls return the
+    // same ID, the value did not change in between, and the caller can skip
+    // reading it. (Different IDs don't imply that the value changed.)
+    // Most properties don't implement this.
+    //  arg: uint64_t*
+    M_PROPERTY_GET_CHANGE_ID,
 };
 
 // Argument for M_PROPERTY_SWITCH
@@ -138,6 +145,32 @@ struct m_property {
 struct m_property *m_property_list_find(const struct m_property *list,
                                         const char *name);
 
+// Lookup table for faster access by name. The list must not change, and the
+// names must be unique, as long as the index is used.
+struct m_property_index;
+struct m_property_index *m_property_index_create(void *ta_parent,
+                                                 const struct m_property *list);
+struct m_property *m_property_index_find(struct m_property_index *index,
+                                         bstr name);
+
+// A property name resolved with m_property_resolve(). This can be used to
+// access a property repeatedly without looking it up each time.
+struct m_property_ref {
+    struct m_property *prop;    // NULL if unknown
+    const char *name;           // full name as passed to m_property_resolve()
+    const char *key;            // sub-property path ("b/c" for "a/b/c"), or NULL
+};
+
+// Look up the property name (which can contain a sub-property path) in list,
+// or in index if it's not NULL. name must stay valid while ref is used.
+void m_property_resolve(const struct m_property *list,
+                        struct m_property_index *index, const char *name,
+                        struct m_property_ref *ref);
+
+// Like m_property_do(), but with a resolved property.
+int m_property_do_ref(struct mp_log *log, const struct m_property_ref *ref,
+                      int action, void *arg, void *ctx);
+
 // Access a property.
 // action: one of m_property_action
 // ctx: opaque value passed through to property implementation
@@ -60,6 +60,8 @@ extern const struct m_sub_options tv_params_conf;
 extern const struct m_sub_options stream_cdda_conf;
 extern const struct m_sub_options stream_dvb_conf;
 extern const struct m_sub_options stream_lavf_conf;
+extern const struct m_sub_options stream_file_conf;
+extern const struct m_sub_options ipc_conf;
 extern const struct m_sub_options sws_conf;
 extern const struct m_sub_options zimg_conf;
 extern const struct m_sub_options drm_conf;
@@ -519,6 +521,7 @@ static const m_option_t mp_opts[] = {
     {"demuxer-termination-timeout", OPT_DOUBLE(demux_termination_timeout)},
     {"demuxer-cache-wait", OPT_FLAG(demuxer_cache_wait)},
     {"prefetch-playlist", OPT_FLAG(prefetch_open)},
+    {"prefetch-playlist-secs", OPT_DOUBLE(prefetch_secs), M_RANGE(0, DBL_MAX)},
     {"cache-pause", OPT_FLAG(cache_pause)},
     {"cache-pause-initial", OPT_FLAG(cache_pause_initial)},
     {"cache-pause-wait", OPT_FLOAT(cache_pause_wait), M_RANGE(0, DBL_MAX)},
@@ -746,6 +749,7 @@ static const m_option_t mp_opts[] = {
     {"input-ipc-server", OPT_STRING(ipc_path), .flags = M_OPT_FILE},
 #if HAVE_POSIX
     {"input-ipc-client", OPT_STRING(ipc_client)},
+    {"", OPT_SUBSTRUCT(ipc_opts, ipc_conf)},
 #endif
 
     {"screenshot", OPT_SUBSTRUCT(screenshot_image_opts, screenshot_conf)},
@@ -765,6 +769,7 @@ static const m_option_t mp_opts[] = {
     {"", OPT_SUBSTRUCT(demux_opts, demux_conf)},
     {"", OPT_SUBSTRUCT(demux_cache_opts, demux_cache_conf)},
     {"", OPT_SUBSTRUCT(stream_opts, stream_conf)},
+    {"", OPT_SUBSTRUCT(stream_file_opts, stream_file_conf)},
 
     {"", OPT_SUBSTRUCT(gl_video_opts, gl_video_conf)},
     {"", OPT_SUBSTRUCT(spirv_opts, spirv_conf)},
@@ -266,6 +266,7 @@ typedef struct MPOpts {
     double demux_termination_timeout;
     int demuxer_cache_wait;
     int prefetch_open;
+    double prefetch_secs;
     char *audio_demuxer_name;
     char *sub_demuxer_name;
 
@@ -321,6 +322,7 @@ typedef struct MPOpts {
     struct demux_opts *demux_opts;
     struct demux_cache_opts *demux_cache_opts;
     struct stream_opts *stream_opts;
+    struct stream_file_opts *stream_file_opts;
 
     struct vd_lavc_params *vd_lavc_params;
     struct ad_lavc_params *ad_lavc_params;
@@ -332,6 +334,7 @@ typedef struct MPOpts {
 
     char *ipc_path;
     char *ipc_client;
+    struct ipc_opts *ipc_opts;
 
     int wingl_dwm_flush;
 
@@ -26,6 +26,7 @@
 #include "common/global.h"
 #include "common/msg.h"
 #include "common/msg_control.h"
+#include "common/stats.h"
 #include "common/global.h"
 #include "input/input.h"
 #include "input/cmd.h"
@@ -83,6 +84,8 @@ struct mp_client_api {
     int num_custom_protocols;
 
     struct mpv_render_context *render_context;
+
+    struct stats_ctx *stats;
 };
 
 struct observe_property {
@@ -90,6 +93,7 @@ struct observe_property {
     struct mpv_handle *owner;
     char *name;
     int id;                 // ==mp_get_property_id(name)
+    struct m_property_ref ref; // ==mp_property_resolve(name)
     uint64_t event_mask;    // ==mp_get_property_event_mask(name)
     int64_t reply_id;
     mpv_format format;
@@ -102,6 +106,8 @@ struct observe_property {
     union m_option_value value;
     uint64_t value_ret_ts;  // logical timestamp of value returned to user
     union m_option_value value_ret;
+    bool value_change_id_valid;
+    uint64_t value_change_id; // M_PROPERTY_GET_CHANGE_ID for value
     bool waiting_for_hook;  // flag for draining old property changes on a hook
 };
 
@@ -184,6 +190,8 @@ void mp_clients_init(struct MPContext *mpctx)
     *mpctx->clients = (struct mp_client_api) {
         .mpctx = mpctx,
     };
+    mpctx->clients->stats =
+        stats_ctx_create(mpctx->clients, mpctx->global, "client-api");
     mpctx->global->client_api = mpctx->clients;
     pthread_mutex_init(&mpctx->clients->lock, NULL);
 }
@@ -1398,6 +1406,7 @@ int mpv_set_property_async(mpv_handle *ctx, uint64_t ud, const char *name,
 struct getproperty_request {
     struct MPContext *mpctx;
     const char *name;
+    struct m_property_ref *ref; // if set, resolved name (faster)
     mpv_format format;
     void *data;
     int status;
@@ -1412,6 +1421,14 @@ static void free_prop_data(void *ptr)
     m_option_free(type, prop->data);
 }
 
+static int getproperty_do(struct getproperty_request *req, int action,
+                          void *arg)
+{
+    if (req->ref)
+        return mp_property_do_ref(req->ref, action, arg, req->mpctx);
+    return mp_property_do(req->name, action, arg, req->mpctx);
+}
+
 static void getproperty_fn(void *arg)
 {
     struct getproperty_request *req = arg;
@@ -1423,11 +1440,11 @@ static void getproperty_fn(void *arg)
     int err = -1;
     switch (req->format) {
     case MPV_FORMAT_OSD_STRING:
-        err = mp_property_do(req->name, M_PROPERTY_PRINT, data, req->mpctx);
+        err = getproperty_do(req, M_PROPERTY_PRINT, data);
         break;
     case MPV_FORMAT_STRING: {
         char *s = NULL;
-        err = mp_property_do(req->name, M_PROPERTY_GET_STRING, &s, req->mpctx);
+        err = getproperty_do(req, M_PROPERTY_GET_STRING, &s);
         if (err == M_PROPERTY_OK)
             *(char **)data = s;
         break;
@@ -1437,13 +1454,12 @@ static void getproperty_fn(void *arg)
     case MPV_FORMAT_INT64:
     case MPV_FORMAT_DOUBLE: {
         struct mpv_node node = {{0}};
-        err = mp_property_do(req->name, M_PROPERTY_GET_NODE, &node, req->mpctx);
+        err = getproperty_do(req, M_PROPERTY_GET_NODE, &node);
         if (err == M_PROPERTY_NOT_IMPLEMENTED) {
             // Go through explicit string conversion. Same reasoning as on the
             // GET code path.
             char *s = NULL;
-            err = mp_property_do(req->name, M_PROPERTY_GET_STRING, &s,
-                                 req->mpctx);
+            err = getproperty_do(req, M_PROPERTY_GET_STRING, &s);
             if (err != M_PROPERTY_OK)
                 break;
             node.format = MPV_FORMAT_STRING;
@@ -1539,6 +1555,130 @@ int mpv_get_property_async(mpv_handle *ctx, uint64_t ud, const char *name,
     return run_async(ctx, getproperty_fn, req);
 }
 
+int mp_client_run_batch(struct mpv_handle *ctx, struct mp_batch_request *reqs,
+                        int num_reqs, bool atomic)
+{
+    if (!ctx->mpctx->initialized)
+        return MPV_ERROR_UNINITIALIZED;
+
+    struct MPContext *mpctx = ctx->mpctx;
+    struct mp_cmd **cmds = talloc_zero_array(NULL, struct mp_cmd *, num_reqs);
+    int status = MPV_ERROR_SUCCESS;
+
+    // Validate everything before anything is run.
+    for (int n = 0; n < num_reqs; n++) {
+        struct mp_batch_request *req = &reqs[n];
+        req->status = MPV_ERROR_SUCCESS;
+        req->result = (struct mpv_node){.format = MPV_FORMAT_NONE};
+        req->executed = false;
+
+        if (req->type == MP_BATCH_COMMAND) {
+            cmds[n] = mp_input_parse_cmd_node(ctx->log, req->arg);
+            if (!cmds[n]) {
+                req->status = MPV_ERROR_INVALID_PARAMETER;
+            } else if (atomic && (cmds[n]->def->spawn_thread ||
+                                  cmds[n]->def->exec_async) &&
+                       !(cmds[n]->flags & MP_ASYNC_CMD))
+            {
+                // These might have to unlock the core to complete.
+                MP_ERR(ctx, "Command '%s' can't be part of an atomic batch.\n",
+                       cmds[n]->name);
+                req->status = MPV_ERROR_NOT_IMPLEMENTED;
+            } else {
+                cmds[n]->sender = ctx->name;
+            }
+        } else if (!req->name) {
+            req->status = MPV_ERROR_INVALID_PARAMETER;
+        }
+
+        if (req->status < 0 && status >= 0)
+            status = req->status;
+    }
+
+    if (atomic && status < 0)
+        goto done;
+
+    lock_core(ctx);
+    for (int n = 0; n < num_reqs; n++) {
+        struct mp_batch_request *req = &reqs[n];
+        if (req->status < 0)
+            continue;
+
+        switch (req->type) {
+        case MP_BATCH_COMMAND: {
+            struct mp_cmd *cmd = cmds[n];
+            cmds[n] = NULL; // owned by run_command()
+            if (cmd->flags & MP_ASYNC_CMD) {
+                run_command(mpctx, cmd, NULL, NULL, NULL);
+                break;
+            }
+            struct cmd_request creq = {
+                .mpctx = mpctx,
+                .cmd = cmd,
+                .res = &req->result,
+                .completion = MP_WAITER_INITIALIZER,
+            };
+            struct mp_abort_entry *abort = NULL;
+            if (cmd->def->can_abort) {
+                abort = talloc_zero(NULL, struct mp_abort_entry);
+                abort->client = ctx;
+            }
+            run_command(mpctx, cmd, abort, cmd_complete, &creq);
+            // Commands which didn't complete yet may need the core. (Not
+            // possible with atomic batches.)
+            if (!mp_waiter_poll(&creq.completion)) {
+                unlock_core(ctx);
+                mp_waiter_wait(&creq.completion);
+                lock_core(ctx);
+            } else {
+                mp_waiter_wait(&creq.completion);
+            }
+            req->status = creq.status;
+            break;
+        }
+        case MP_BATCH_GET_PROPERTY: {
+            struct getproperty_request preq = {
+                .mpctx = mpctx,
+                .name = req->name,
+                .format = MPV_FORMAT_NODE,
+                .data = &req->result,
+            };
+            getproperty_fn(&preq);
+            req->status = preq.status;
+            break;
+        }
+        case MP_BATCH_SET_PROPERTY: {
+            struct setproperty_request preq = {
+                .mpctx = mpctx,
+                .name = req->name,
+                .format = MPV_FORMAT_NODE,
+                .data = req->arg,
+            };
+            setproperty_fn(&preq);
+            req->status = preq.status;
+            break;
+        }
+        default:
+            abort();
+        }
+
+        req->executed = true;
+        if (req->status < 0) {
+            if (status >= 0)
+                status = req->status;
+            if (atomic)
+                break;
+        }
+    }
+    unlock_core(ctx);
+
+done:
+    for (int n = 0; n < num_reqs; n++)
+        talloc_free(cmds[n]);
+    talloc_free(cmds);
+    return status;
+}
+
 static void property_free(void *p)
 {
     struct observe_property *prop = p;
@@ -1576,6 +1716,7 @@ int mpv_observe_property(mpv_handle *ctx, uint64_t userdata,
         .change_ts = 1, // force initial event
         .refcount = 1,
     };
+    mp_property_resolve(ctx->mpctx, prop->name, &prop->ref);
     ctx->properties_change_ts += 1;
     MP_TARRAY_APPEND(ctx, ctx->properties, ctx->num_properties, prop);
     ctx->property_event_masks |= prop->event_mask;
@@ -1676,9 +1817,15 @@ static void send_client_property_changes(struct mpv_handle *ctx)
             struct getproperty_request req = {
                 .mpctx = ctx->mpctx,
                 .name = prop->name,
+                .ref = &prop->ref,
                 .format = prop->format,
                 .data = &val,
             };
+            // The OSD string can depend on other state (like options).
+            bool use_change_id = !prop->ref.key &&
+                                 prop->format != MPV_FORMAT_OSD_STRING;
+            uint64_t change_id = 0, change_id_after = 0;
+            bool have_change_id = false, skip = false;
 
             // Temporarily unlock and read the property. The very important
             // thing is that property getters can do whatever they want, _and_
@@ -1687,7 +1834,24 @@ static void send_client_property_changes(struct mpv_handle *ctx)
             prop->refcount += 1; // keep prop alive (esp. prop->name)
             ctx->async_counter += 1; // keep ctx alive
             pthread_mutex_unlock(&ctx->lock);
-            getproperty_fn(&req);
+            if (use_change_id) {
+                have_change_id = getproperty_do(&req, M_PROPERTY_GET_CHANGE_ID,
+                                                &change_id) == M_PROPERTY_OK;
+                skip = have_change_id && prop->value_ts &&
+                       prop->value_change_id_valid &&
+                       prop->value_change_id == change_id;
+            }
+            if (!skip) {
+                getproperty_fn(&req);
+                // Only remember the ID if the value could not have changed
+                // while it was read.
+                if (have_change_id) {
+                    have_change_id =
+                        getproperty_do(&req, M_PROPERTY_GET_CHANGE_ID,
+                                       &change_id_after) == M_PROPERTY_OK &&
+                        change_id_after == change_id;
+                }
+            }
             pthread_mutex_lock(&ctx->lock);
             ctx->async_counter -= 1;
             prop_unref(prop);
@@ -1702,6 +1866,14 @@ static void send_client_property_changes(struct mpv_handle *ctx)
             }
             assert(prop->refcount > 0);
 
+            if (skip) {
+                stats_event(ctx->clients->stats, "observe-skipped");
+                goto done;
+            }
+            stats_event(ctx->clients->stats, "observe-fetched");
+            prop->value_change_id = change_id;
+            prop->value_change_id_valid = have_change_id;
+
             bool val_valid = req.status >= 0;
             changed = prop->value_valid != val_valid;
             if (prop->value_valid && val_valid)
@@ -1722,6 +1894,7 @@ static void send_client_property_changes(struct mpv_handle *ctx)
             changed = true;
         }
 
+    done:
         if (prop->waiting_for_hook)
             ctx->new_property_events = true; // make sure to wakeup
 
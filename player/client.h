@@ -40,6 +40,32 @@ struct mpv_global *mp_client_get_global(struct mpv_handle *ctx);
 void mp_client_broadcast_event_external(struct mp_client_api *api, int event,
                                         void *data);
 
+enum mp_batch_request_type {
+    MP_BATCH_COMMAND,       // like mpv_command_node(arg, &result)
+    MP_BATCH_GET_PROPERTY,  // like mpv_get_property(name, NODE, &result)
+    MP_BATCH_SET_PROPERTY,  // like mpv_set_property(name, NODE, arg)
+};
+
+struct mp_batch_request {
+    // -- set by the caller
+    enum mp_batch_request_type type;
+    const char *name;
+    struct mpv_node *arg;
+    // -- set by mp_client_run_batch()
+    bool executed;
+    int status;             // MPV_ERROR_* code (also set if rejected)
+    struct mpv_node result; // free with mpv_free_node_contents()
+};
+
+// Run all requests with a single acquisition of the core lock. The core is
+// only unlocked while waiting for commands that don't complete immediately.
+// If atomic is set, nothing is run if any request is invalid, the core is not
+// unlocked at all (commands that might need this are rejected), and execution
+// stops at the first failing request. Requests that ran before are not rolled
+// back. Returns the first error encountered, or MPV_ERROR_SUCCESS.
+int mp_client_run_batch(struct mpv_handle *ctx, struct mp_batch_request *reqs,
+                        int num_reqs, bool atomic);
+
 // m_option.c
 void *node_get_alloc(struct mpv_node *node);
 
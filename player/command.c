@@ -80,6 +80,8 @@
 struct command_ctx {
     // All properties, terminated with a {0} item.
     struct m_property *properties;
+    // Lookup table for properties.
+    struct m_property_index *prop_index;
 
     double last_seek_time;
     double last_seek_pts;
@@ -1427,6 +1429,43 @@ static int mp_property_demuxer_cache_idle(void *ctx, struct m_property *prop,
     return m_property_flag_ro(action, arg, s.idle);
 }
 
+// Combine v into the M_PROPERTY_GET_CHANGE_ID value h.
+static uint64_t change_id_mix(uint64_t h, uint64_t v)
+{
+    return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+static uint64_t change_id_mix_double(uint64_t h, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return change_id_mix(h, bits);
+}
+
+static uint64_t demux_reader_state_change_id(struct demux_reader_state *s)
+{
+    uint64_t h = 0;
+    h = change_id_mix(h, s->eof | (s->underrun << 1) | (s->idle << 2) |
+                         (s->bof_cached << 3) | (s->eof_cached << 4));
+    h = change_id_mix_double(h, s->ts_duration);
+    h = change_id_mix_double(h, s->ts_reader);
+    h = change_id_mix_double(h, s->ts_end);
+    h = change_id_mix(h, s->total_bytes);
+    h = change_id_mix(h, s->fw_bytes);
+    h = change_id_mix(h, s->file_cache_bytes);
+    h = change_id_mix_double(h, s->seeking);
+    h = change_id_mix(h, s->low_level_seeks);
+    h = change_id_mix(h, s->byte_level_seeks);
+    h = change_id_mix_double(h, s->ts_last);
+    h = change_id_mix(h, s->bytes_per_second);
+    h = change_id_mix(h, s->num_seek_ranges);
+    for (int n = 0; n < s->num_seek_ranges; n++) {
+        h = change_id_mix_double(h, s->seek_ranges[n].start);
+        h = change_id_mix_double(h, s->seek_ranges[n].end);
+    }
+    return h;
+}
+
 static int mp_property_demuxer_cache_state(void *ctx, struct m_property *prop,
                                            int action, void *arg)
 {
@@ -1438,12 +1477,17 @@ static int mp_property_demuxer_cache_state(void *ctx, struct m_property *prop,
         *(struct m_option *)arg = (struct m_option){.type = CONF_TYPE_NODE};
         return M_PROPERTY_OK;
     }
-    if (action != M_PROPERTY_GET)
+    if (action != M_PROPERTY_GET && action != M_PROPERTY_GET_CHANGE_ID)
         return M_PROPERTY_NOT_IMPLEMENTED;
 
     struct demux_reader_state s;
     demux_get_reader_state(mpctx->demuxer, &s);
 
+    if (action == M_PROPERTY_GET_CHANGE_ID) {
+        *(uint64_t *)arg = demux_reader_state_change_id(&s);
+        return M_PROPERTY_OK;
+    }
+
     struct mpv_node *r = (struct mpv_node *)arg;
     node_init(r, MPV_FORMAT_NODE_MAP, NULL);
 
@@ -2995,6 +3039,14 @@ static int mp_property_playlist(void *ctx, struct m_property *prop,
             cut_osd_list(mpctx, res, playlist_entry_to_index(pl, pl->current));
         return M_PROPERTY_OK;
     }
+    if (action == M_PROPERTY_GET_CHANGE_ID) {
+        struct playlist *pl = mpctx->playlist;
+        uint64_t h = change_id_mix(0, pl->change_counter);
+        h = change_id_mix(h, (uintptr_t)pl->current);
+        h = change_id_mix(h, (uintptr_t)mpctx->playing);
+        *(uint64_t *)arg = h;
+        return M_PROPERTY_OK;
+    }
 
     return m_property_read_list(action, arg, playlist_entry_count(mpctx->playlist),
                                 get_playlist_entry, mpctx);
@@ -3811,11 +3863,28 @@ static bool is_property_set(int action, void *val)
     }
 }
 
+// Resolve the property name for mp_property_do_ref(). The name must stay valid
+// while ref is used. (Properties can't be added or removed at runtime.)
+void mp_property_resolve(struct MPContext *ctx, const char *name,
+                         struct m_property_ref *ref)
+{
+    struct command_ctx *cmd = ctx->command_ctx;
+    m_property_resolve(cmd->properties, cmd->prop_index, name, ref);
+}
+
 int mp_property_do(const char *name, int action, void *val,
                    struct MPContext *ctx)
 {
-    struct command_ctx *cmd = ctx->command_ctx;
-    int r = m_property_do(ctx->log, cmd->properties, name, action, val, ctx);
+    struct m_property_ref ref;
+    mp_property_resolve(ctx, name, &ref);
+    return mp_property_do_ref(&ref, action, val, ctx);
+}
+
+int mp_property_do_ref(struct m_property_ref *ref, int action, void *val,
+                       struct MPContext *ctx)
+{
+    const char *name = ref->name;
+    int r = m_property_do_ref(ctx->log, ref, action, val, ctx);
 
     if (mp_msg_test(ctx->log, MSGL_V) && is_property_set(action, val)) {
         struct m_option ot = {0};
@@ -6378,6 +6447,9 @@ void command_init(struct MPContext *mpctx)
         talloc_zero_array(ctx, struct m_property, num_base + num_opts + 1);
     memcpy(ctx->properties, mp_properties_base, sizeof(mp_properties_base));
 
+    struct m_property_index *base_index =
+        m_property_index_create(NULL, ctx->properties);
+
     int count = num_base;
     for (int n = 0; n < num_opts; n++) {
         struct m_config_option *co = m_config_get_co_index(mpctx->mconfig, n);
@@ -6411,11 +6483,14 @@ void command_init(struct MPContext *mpctx)
         }
 
         // The option might be covered by a manual property already.
-        if (m_property_list_find(ctx->properties, prop.name))
+        if (m_property_index_find(base_index, bstr0(prop.name)))
             continue;
 
         ctx->properties[count++] = prop;
     }
+
+    talloc_free(base_index);
+    ctx->prop_index = m_property_index_create(ctx, ctx->properties);
 }
 
 static void command_event(struct MPContext *mpctx, int event, void *arg)
@@ -77,6 +77,11 @@ char *mp_property_expand_escaped_string(struct MPContext *mpctx, const char *str
 void property_print_help(struct MPContext *mpctx);
 int mp_property_do(const char* name, int action, void* val,
                    struct MPContext *mpctx);
+struct m_property_ref;
+void mp_property_resolve(struct MPContext *mpctx, const char *name,
+                         struct m_property_ref *ref);
+int mp_property_do_ref(struct m_property_ref *ref, int action, void *val,
+                       struct MPContext *mpctx);
 
 void mp_option_change_callback(void *ctx, struct m_config_option *co, int flags,
                                bool self_update);
@@ -1042,6 +1042,7 @@ static void *open_demux_thread(void *ctx)
             }
 
             demux_set_wakeup_cb(demux, wakeup_demux, mpctx);
+            demux_set_min_readahead(demux, mpctx->open_prefetch_secs);
             demux_start_thread(demux);
             demux_start_prefetch(demux);
         }
@@ -1096,6 +1097,7 @@ static void start_open(struct MPContext *mpctx, char *url, int url_flags,
     mpctx->open_format = talloc_strdup(NULL, mpctx->opts->demuxer_name);
     mpctx->open_url_flags = url_flags;
     mpctx->open_for_prefetch = for_prefetch && mpctx->opts->demuxer_thread;
+    mpctx->open_prefetch_secs = mpctx->opts->prefetch_secs;
 
     if (pthread_create(&mpctx->open_thread, NULL, open_demux_thread, mpctx)) {
         cancel_open(mpctx);
@@ -1146,6 +1148,8 @@ static void open_demux_reentrant(struct MPContext *mpctx)
         mpctx->demuxer = mpctx->open_res_demuxer;
         mpctx->open_res_demuxer = NULL;
         mp_cancel_set_parent(mpctx->demuxer->cancel, mpctx->playback_abort);
+        // Normal readahead settings from now on.
+        demux_set_min_readahead(mpctx->demuxer, 0);
     } else {
         mpctx->error_playing = mpctx->open_res_error;
     }
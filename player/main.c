@@ -55,6 +55,7 @@
 
 #include "audio/out/ao.h"
 #include "demux/demux.h"
+#include "demux/matroska.h"
 #include "misc/thread_tools.h"
 #include "sub/osd.h"
 #include "test/tests.h"
@@ -190,6 +191,8 @@ void mp_destroy(struct MPContext *mpctx)
 
     uninit_libav(mpctx->global);
 
+    mkv_uid_cache_uninit(mpctx->global);
+
     mp_msg_uninit(mpctx->global);
     assert(!mpctx->num_abort_list);
     talloc_free(mpctx->abort_list);
@@ -277,6 +280,7 @@ struct MPContext *mp_create(void)
     mpctx->global = talloc_zero(mpctx, struct mpv_global);
 
     stats_global_init(mpctx->global);
+    mkv_uid_cache_init(mpctx->global);
 
     // Nothing must call mp_msg*() and related before this
     mp_msg_init(mpctx->global);
@@ -22,6 +22,8 @@
 #include <strings.h>
 #include <assert.h>
 
+#include <libavutil/buffer.h>
+
 #include "osdep/io.h"
 
 #include "mpv_talloc.h"
@@ -628,6 +630,41 @@ int stream_read_peek(stream_t *s, void *buf, int buf_size)
     return ring_copy(s, buf, buf_size, s->buf_cur);
 }
 
+// Like stream_read(), but return a reference to the data instead of copying
+// it, if the stream supports this (only stream_file.c with --file-mmap). The
+// returned buffer is read-only, and its padding is readable, but not zeroed:
+// it contains whatever follows in the file. libavcodec requires zeroed padding
+// for almost all codecs (bitstream readers read into it), so callers must only
+// use this for raw video or audio data, and copy the data otherwise.
+// Returns NULL if this is not possible or not worth it; the caller must then
+// fall back to stream_read(). In this case, the position is not changed.
+struct AVBufferRef *stream_read_ref(stream_t *s, int len)
+{
+    // Small reads are cheaper to copy from the buffer (same heuristic as the
+    // direct read in stream_read_partial()).
+    if (!s->read_ref || len <= (s->buffer_mask + 1) / 2)
+        return NULL;
+
+    int64_t pos = stream_tell(s);
+    int64_t end = pos + len;
+    struct AVBufferRef *ref = s->read_ref(s, pos, len);
+    if (!ref)
+        return NULL;
+
+    if (end <= s->pos) {
+        s->buf_cur += len;
+    } else {
+        // Skip the referenced data in the underlying stream; not a real seek.
+        if (s->seek(s, end) <= 0) {
+            av_buffer_unref(&ref);
+            return NULL;
+        }
+        stream_drop_buffers(s);
+        s->pos = end;
+    }
+    return ref;
+}
+
 int stream_write_buffer(stream_t *s, void *buf, int len)
 {
     if (!s->write_buffer)
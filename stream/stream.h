@@ -104,6 +104,7 @@ struct stream_avseek {
 
 struct stream;
 struct stream_open_args;
+struct AVBufferRef;
 typedef struct stream_info_st {
     const char *name;
     // opts is set from ->opts
@@ -132,6 +133,11 @@ typedef struct stream {
     int (*control)(struct stream *s, int cmd, void *arg);
     // Close
     void (*close)(struct stream *s);
+    // Optional: return a read-only buffer referencing len bytes at pos without
+    // copying them, or NULL if not possible. The data must be followed by at
+    // least AV_INPUT_BUFFER_PADDING_SIZE readable bytes, which need not be
+    // zero (see stream_read_ref()).
+    struct AVBufferRef *(*read_ref)(struct stream *s, int64_t pos, int len);
 
     int64_t pos;
     int eof; // valid only after read calls that returned a short result
@@ -201,6 +207,25 @@ inline static int stream_read_char(stream_t *s)
         : stream_read_char_fallback(s);
 }
 
+// Return the buffered data at the current position without copying it. This
+// is limited to what is contiguous in the ring buffer, so it can be shorter
+// than what stream_peek() returned. The data is valid until the next call that
+// reads from or seeks the stream; use stream_skip_buffered() to consume it.
+inline static struct bstr stream_peek_buffered(stream_t *s)
+{
+    unsigned int pos = s->buf_cur & s->buffer_mask;
+    unsigned int len = s->buf_end - s->buf_cur;
+    if (len > s->buffer_mask + 1 - pos)
+        len = s->buffer_mask + 1 - pos;
+    return (struct bstr){s->buffer ? s->buffer + pos : NULL, len};
+}
+
+// Skip len bytes, which must be <= stream_peek_buffered().len.
+inline static void stream_skip_buffered(stream_t *s, int len)
+{
+    s->buf_cur += len;
+}
+
 int stream_skip_bom(struct stream *s);
 
 inline static int64_t stream_tell(stream_t *s)
@@ -214,6 +239,7 @@ int stream_read(stream_t *s, void *mem, int total);
 int stream_read_partial(stream_t *s, void *buf, int buf_size);
 int stream_peek(stream_t *s, int forward_size);
 int stream_read_peek(stream_t *s, void *buf, int buf_size);
+struct AVBufferRef *stream_read_ref(stream_t *s, int len);
 void stream_drop_buffers(stream_t *s);
 int64_t stream_get_size(stream_t *s);
 
@@ -25,17 +25,28 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifndef __MINGW32__
 #include <poll.h>
 #endif
 
+#if HAVE_POSIX
+#include <sys/mman.h>
+#endif
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+
+#include "osdep/atomic.h"
 #include "osdep/io.h"
+#include "osdep/threads.h"
 
 #include "common/common.h"
 #include "common/msg.h"
 #include "misc/thread_tools.h"
 #include "stream.h"
+#include "options/m_config.h"
 #include "options/m_option.h"
 #include "options/path.h"
 
@@ -58,6 +69,41 @@
 #endif
 #endif
 
+struct stream_file_opts {
+    int readahead;
+    int64_t readahead_size;
+    int mmap;
+};
+
+#define OPT_BASE_STRUCT struct stream_file_opts
+
+const struct m_sub_options stream_file_conf = {
+    .opts = (const struct m_option[]){
+        {"file-readahead", OPT_CHOICE(readahead,
+            {"no", 0}, {"yes", 1}, {"auto", -1})},
+        {"file-readahead-size", OPT_BYTE_SIZE(readahead_size),
+            M_RANGE(1024 * 1024, M_MAX_MEM_BYTES)},
+        {"file-mmap", OPT_FLAG(mmap)},
+        {0}
+    },
+    .size = sizeof(struct stream_file_opts),
+    .defaults = &(const struct stream_file_opts){
+        .readahead = -1,
+        .readahead_size = 32 * 1024 * 1024,
+    },
+};
+
+// Size of a single readahead read() call.
+#define READAHEAD_CHUNK (1024 * 1024)
+
+// Mapping of the entire file for --file-mmap. Referenced by the stream, and by
+// each buffer returned by read_ref(); those may outlive the stream.
+struct file_mapping {
+    uint8_t *ptr;
+    size_t size;
+    atomic_int refs;
+};
+
 struct priv {
     int fd;
     bool close;
@@ -66,6 +112,23 @@ struct priv {
     bool appending;
     int64_t orig_size;
     struct mp_cancel *cancel;
+
+    // --- readahead thread (if readahead_active)
+    bool readahead_active;
+    int64_t readahead_size;
+    pthread_t readahead_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    // Protected by lock:
+    bool readahead_terminate;
+    int64_t read_pos;       // position of the reader (fill_buffer)
+    int64_t ahead_pos;      // data in [read_pos, ahead_pos) was read ahead
+    // Only accessed by the reader:
+    int64_t evicted_pos;    // page cache before this was dropped
+
+    // --- --file-mmap (if map is set)
+    struct file_mapping *map;
+    int64_t map_pos;        // read position (replaces the fd position)
 };
 
 // Total timeout = RETRY_TIMEOUT * MAX_RETRIES
@@ -85,6 +148,236 @@ static int64_t get_size(stream_t *s)
     return -1;
 }
 
+#if HAVE_POSIX
+
+// Read the file ahead of the reader in a separate thread. This does not buffer
+// anything itself; it only makes sure the data is in the OS page cache when
+// the reader gets there. The benefit is that latency of slow network file
+// systems (which also may not do much readahead on their own) is hidden.
+static void *readahead_thread(void *ctx)
+{
+    struct priv *p = ctx;
+    mpthread_set_name("file-readahead");
+
+    void *buf = talloc_size(NULL, READAHEAD_CHUNK);
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->readahead_terminate) {
+        int64_t end = p->read_pos + p->readahead_size;
+        if (p->ahead_pos >= end) {
+            pthread_cond_wait(&p->wakeup, &p->lock);
+            continue;
+        }
+
+        int64_t pos = p->ahead_pos;
+        size_t len = MPMIN(end - pos, READAHEAD_CHUNK);
+        pthread_mutex_unlock(&p->lock);
+
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(p->fd, pos, len, POSIX_FADV_WILLNEED);
+#endif
+        // pread() does not change the file position used by fill_buffer().
+        ssize_t r = pread(p->fd, buf, len, pos);
+
+        pthread_mutex_lock(&p->lock);
+        if (r <= 0) {
+            // EOF or error: wait until the reader moves (e.g. seeks).
+            if (p->ahead_pos == pos && !p->readahead_terminate)
+                pthread_cond_wait(&p->wakeup, &p->lock);
+            continue;
+        }
+        // (The reader may have seeked meanwhile.)
+        if (p->ahead_pos == pos)
+            p->ahead_pos = pos + r;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    talloc_free(buf);
+    return NULL;
+}
+
+// Tell the readahead thread about the new reader position.
+static void readahead_update(struct priv *p, int64_t pos)
+{
+    pthread_mutex_lock(&p->lock);
+    if (pos < p->read_pos || pos > p->ahead_pos)
+        p->ahead_pos = pos; // seek outside of the readahead window
+    p->read_pos = pos;
+    pthread_cond_signal(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+
+#ifdef POSIX_FADV_DONTNEED
+    // Drop consumed data from the page cache, but keep one window behind the
+    // reader, so that short seeks back remain cheap.
+    int64_t keep = pos - p->readahead_size;
+    if (keep < p->evicted_pos) {
+        p->evicted_pos = MPMAX(keep, 0); // seek back
+    } else if (keep - p->evicted_pos >= p->readahead_size) {
+        posix_fadvise(p->fd, p->evicted_pos, keep - p->evicted_pos,
+                      POSIX_FADV_DONTNEED);
+        p->evicted_pos = keep;
+    }
+#endif
+}
+
+static void readahead_init(stream_t *s)
+{
+    struct priv *p = s->priv;
+    struct stream_file_opts *opts =
+        mp_get_config_group(s, s->global, &stream_file_conf);
+
+    bool enable = opts->readahead == 1 ||
+                  (opts->readahead < 0 && s->streaming);
+    if (!enable || !p->regular_file || p->appending || s->mode != STREAM_READ)
+        return;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(p->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    p->readahead_size = opts->readahead_size;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wakeup, NULL);
+    if (pthread_create(&p->readahead_thread, NULL, readahead_thread, p)) {
+        pthread_cond_destroy(&p->wakeup);
+        pthread_mutex_destroy(&p->lock);
+        return;
+    }
+    p->readahead_active = true;
+    MP_VERBOSE(s, "Reading ahead %"PRId64" bytes.\n", p->readahead_size);
+}
+
+static void readahead_uninit(struct priv *p)
+{
+    if (!p->readahead_active)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->readahead_terminate = true;
+    pthread_cond_signal(&p->wakeup);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->readahead_thread, NULL);
+    pthread_cond_destroy(&p->wakeup);
+    pthread_mutex_destroy(&p->lock);
+    p->readahead_active = false;
+}
+
+#else
+
+static void readahead_update(struct priv *p, int64_t pos) {}
+static void readahead_init(stream_t *s) {}
+static void readahead_uninit(struct priv *p) {}
+
+#endif
+
+#if HAVE_POSIX
+
+static void unref_mapping(struct file_mapping *map)
+{
+    if (atomic_fetch_add(&map->refs, -1) == 1) {
+        munmap(map->ptr, map->size);
+        talloc_free(map);
+    }
+}
+
+static void free_mapped_buffer(void *opaque, uint8_t *data)
+{
+    unref_mapping(opaque);
+}
+
+// Note that the padding after the returned data is the following file data,
+// not zeros (see stream_read_ref()).
+static struct AVBufferRef *read_ref(stream_t *s, int64_t pos, int len)
+{
+    struct priv *p = s->priv;
+    struct file_mapping *map = p->map;
+
+    // The padding must be within the file; accessing the mapping past the end
+    // of the file may crash. (Data beyond the mapped size, e.g. if the file
+    // grew, is read with fill_buffer_mapped() instead.)
+    if (pos < 0 || len <= 0 ||
+        pos + len + AV_INPUT_BUFFER_PADDING_SIZE > map->size)
+        return NULL;
+
+    atomic_fetch_add(&map->refs, 1);
+    AVBufferRef *buf = av_buffer_create(map->ptr + pos, len, free_mapped_buffer,
+                                        map, AV_BUFFER_FLAG_READONLY);
+    if (!buf)
+        unref_mapping(map);
+    return buf;
+}
+
+static int fill_buffer(stream_t *s, void *buffer, int max_len);
+static void map_uninit(struct priv *p);
+
+static int fill_buffer_mapped(stream_t *s, void *buffer, int max_len)
+{
+    struct priv *p = s->priv;
+    if (p->map_pos >= p->map->size) {
+        // The file grew since it was mapped. Switch to normal reads, which
+        // also handle files that keep being appended to. Buffers referencing
+        // the old mapping stay valid.
+        if (get_size(s) > p->map->size &&
+            lseek(p->fd, p->map_pos, SEEK_SET) != (off_t)-1)
+        {
+            MP_VERBOSE(s, "File grew, no longer using the memory mapping.\n");
+            map_uninit(p);
+            s->fill_buffer = fill_buffer;
+            s->read_ref = NULL;
+            return fill_buffer(s, buffer, max_len);
+        }
+        return 0;
+    }
+    int len = MPMIN(max_len, p->map->size - p->map_pos);
+    memcpy(buffer, p->map->ptr + p->map_pos, len);
+    p->map_pos += len;
+    if (p->readahead_active)
+        readahead_update(p, p->map_pos);
+    return len;
+}
+
+static void map_init(stream_t *s)
+{
+    struct priv *p = s->priv;
+    struct stream_file_opts *opts =
+        mp_get_config_group(s, s->global, &stream_file_conf);
+
+    // Files that can change size can't be mapped safely.
+    if (!opts->mmap || !p->regular_file || p->appending ||
+        s->mode != STREAM_READ || p->orig_size <= 0 ||
+        p->orig_size > SIZE_MAX)
+        return;
+
+    void *ptr = mmap(NULL, p->orig_size, PROT_READ, MAP_SHARED, p->fd, 0);
+    if (ptr == MAP_FAILED) {
+        MP_VERBOSE(s, "Could not map file: %s\n", mp_strerror(errno));
+        return;
+    }
+
+    p->map = talloc_zero(NULL, struct file_mapping);
+    p->map->ptr = ptr;
+    p->map->size = p->orig_size;
+    atomic_store(&p->map->refs, 1);
+    p->map_pos = 0;
+
+    s->fill_buffer = fill_buffer_mapped;
+    s->read_ref = read_ref;
+    MP_VERBOSE(s, "Using memory mapped file.\n");
+}
+
+static void map_uninit(struct priv *p)
+{
+    if (p->map)
+        unref_mapping(p->map);
+    p->map = NULL;
+}
+
+#else
+
+static void map_init(stream_t *s) {}
+static void map_uninit(struct priv *p) {}
+
+#endif
+
 static int fill_buffer(stream_t *s, void *buffer, int max_len)
 {
     struct priv *p = s->priv;
@@ -104,8 +397,11 @@ static int fill_buffer(stream_t *s, void *buffer, int max_len)
 
     for (int retries = 0; retries < MAX_RETRIES; retries++) {
         int r = read(p->fd, buffer, max_len);
-        if (r > 0)
+        if (r > 0) {
+            if (p->readahead_active)
+                readahead_update(p, s->pos + r);
             return r;
+        }
 
         // Try to detect and handle files being appended during playback.
         int64_t size = get_size(s);
@@ -134,12 +430,21 @@ static int write_buffer(stream_t *s, void *buffer, int len)
 static int seek(stream_t *s, int64_t newpos)
 {
     struct priv *p = s->priv;
-    return lseek(p->fd, newpos, SEEK_SET) != (off_t)-1;
+    if (p->map) {
+        p->map_pos = newpos;
+    } else if (lseek(p->fd, newpos, SEEK_SET) == (off_t)-1) {
+        return 0;
+    }
+    if (p->readahead_active)
+        readahead_update(p, newpos);
+    return 1;
 }
 
 static void s_close(stream_t *s)
 {
     struct priv *p = s->priv;
+    readahead_uninit(p);
+    map_uninit(p);
     if (p->close)
         close(p->fd);
 }
@@ -349,6 +654,9 @@ static int open_f(stream_t *stream, struct stream_open_args *args)
     if (stream->cancel)
         mp_cancel_set_parent(p->cancel, stream->cancel);
 
+    map_init(stream);
+    readahead_init(stream);
+
     return STREAM_OK;
 }
 
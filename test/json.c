@@ -1,6 +1,8 @@
 #include "common/common.h"
+#include "common/msg.h"
 #include "misc/json.h"
 #include "misc/node.h"
+#include "osdep/timer.h"
 #include "tests.h"
 
 struct entry {
@@ -51,6 +53,13 @@ static const struct entry entries[] = {
     { "{ }", "{}", NODE_MAP(L(), L())},
     { TEXT({"a":b}), .expect_fail = true},
     { TEXT({1a:"b"}), .expect_fail = true},
+    { TEXT("0123456789abcdef\t0123456789\u0001x\"0123456789"),
+        TEXT("0123456789abcdef\t0123456789\u0001x\"0123456789"),
+        NODE_STR("0123456789abcdef\t0123456789\001x\"0123456789")},
+    { TEXT({"a":[1,{"b":[]}],"c":{}}), TEXT({"a":[1,{"b":[]}],"c":{}}),
+        NODE_MAP(L("a", "c"), L(
+            NODE_ARRAY(NODE_INT64(1), NODE_MAP(L("b"), L(NODE_ARRAY()))),
+            NODE_MAP(L(), L())))},
 
     // non-standard extensions
     { "[1,2,]", "[1,2]", NODE_ARRAY(NODE_INT64(1), NODE_INT64(2))},
@@ -92,3 +101,99 @@ const struct unittest test_json = {
     .name = "json",
     .run = run,
 };
+
+// Build a document similar to the track-list and playlist properties of a
+// large playlist.
+static void make_bench_doc(struct mpv_node *root)
+{
+    node_init(root, MPV_FORMAT_NODE_MAP, NULL);
+
+    struct mpv_node *tracks = node_map_add(root, "track-list",
+                                           MPV_FORMAT_NODE_ARRAY);
+    for (int n = 0; n < 2000; n++) {
+        struct mpv_node *t = node_array_add(tracks, MPV_FORMAT_NODE_MAP);
+        char title[80];
+        snprintf(title, sizeof(title), "Track %d \"commentary\"\tv2", n);
+        node_map_add_int64(t, "id", n + 1);
+        node_map_add_string(t, "type", n % 3 ? "audio" : "video");
+        node_map_add_int64(t, "src-id", n);
+        node_map_add_string(t, "title", title);
+        node_map_add_string(t, "lang", "eng");
+        node_map_add_flag(t, "default", n == 0);
+        node_map_add_flag(t, "external", false);
+        node_map_add_string(t, "codec", n % 3 ? "opus" : "h264");
+        node_map_add_double(t, "demux-fps", 23.976);
+        node_map_add_int64(t, "demux-samplerate", 48000);
+    }
+
+    struct mpv_node *pl = node_map_add(root, "playlist", MPV_FORMAT_NODE_ARRAY);
+    for (int n = 0; n < 20000; n++) {
+        struct mpv_node *e = node_array_add(pl, MPV_FORMAT_NODE_MAP);
+        char name[120];
+        snprintf(name, sizeof(name),
+                 "/home/user/Videos/Some Series (2020)/Season 1/"
+                 "Some Series - S01E%05d - Episode Title.mkv", n);
+        node_map_add_string(e, "filename", name);
+        node_map_add_flag(e, "current", n == 0);
+        node_map_add_flag(e, "playing", n == 0);
+        node_map_add_int64(e, "id", n + 1);
+    }
+}
+
+static double mb_per_sec(size_t bytes, int64_t us)
+{
+    return us > 0 ? bytes / (double)us : 0; // bytes/us == MB/s
+}
+
+static void run_benchmark(struct test_ctx *ctx)
+{
+    const int iterations = 20;
+
+    struct mpv_node doc;
+    make_bench_doc(&doc);
+
+    char *text = talloc_strdup(NULL, "");
+    assert_true(json_write(&text, &doc) >= 0);
+    size_t len = strlen(text);
+
+    int64_t write_time = 0;
+    for (int n = 0; n < iterations; n++) {
+        char *out = talloc_strdup(NULL, "");
+        int64_t start = mp_time_us();
+        assert_true(json_write(&out, &doc) >= 0);
+        write_time += mp_time_us() - start;
+        assert_string_equal(text, out);
+        talloc_free(out);
+    }
+
+    int64_t parse_time = 0;
+    char *copy = talloc_size(NULL, len + 1);
+    for (int n = 0; n < iterations; n++) {
+        void *tmp = talloc_new(NULL);
+        memcpy(copy, text, len + 1);
+        char *src = copy;
+        struct mpv_node res;
+        int64_t start = mp_time_us();
+        assert_true(json_parse(tmp, &res, &src, MAX_DEPTH) >= 0);
+        parse_time += mp_time_us() - start;
+        assert_true(equal_mpv_node(&doc, &res));
+        talloc_free(tmp);
+    }
+
+    MP_INFO(ctx, "document size: %zu bytes\n", len);
+    MP_INFO(ctx, "json_write: %.1f MB/s\n",
+            mb_per_sec(len * iterations, write_time));
+    MP_INFO(ctx, "json_parse: %.1f MB/s\n",
+            mb_per_sec(len * iterations, parse_time));
+
+    talloc_free(copy);
+    talloc_free(text);
+    talloc_free(doc.u.list);
+}
+
+// Not part of all-simple, as it takes a while and only reports numbers.
+const struct unittest test_json_benchmark = {
+    .name = "json-benchmark",
+    .is_benchmark = true,
+    .run = run_benchmark,
+};
@@ -0,0 +1,122 @@
+#include "common/common.h"
+#include "misc/msgpack.h"
+#include "misc/node.h"
+#include "tests.h"
+
+struct entry {
+    const char *src;
+    int src_len;
+    struct mpv_node out_data;
+    bool expect_fail;
+    bool non_canonical; // writing out_data produces a different encoding
+};
+
+#define BIN(s) .src = (s), .src_len = sizeof(s) - 1
+
+#define VAL_LIST(...) (struct mpv_node[]){__VA_ARGS__}
+
+#define L(...) __VA_ARGS__
+
+#define NODE_INT64(v) {.format = MPV_FORMAT_INT64,  .u = { .int64 = (v) }}
+#define NODE_STR(v)   {.format = MPV_FORMAT_STRING, .u = { .string = (v) }}
+#define NODE_BOOL(v)  {.format = MPV_FORMAT_FLAG,   .u = { .flag = (bool)(v) }}
+#define NODE_FLOAT(v) {.format = MPV_FORMAT_DOUBLE, .u = { .double_ = (v) }}
+#define NODE_NONE()   {.format = MPV_FORMAT_NONE }
+#define NODE_ARRAY(...) {.format = MPV_FORMAT_NODE_ARRAY, .u = { .list =    \
+    &(struct mpv_node_list) {                                               \
+        .num = sizeof(VAL_LIST(__VA_ARGS__)) / sizeof(struct mpv_node),     \
+        .values = VAL_LIST(__VA_ARGS__)}}}
+#define NODE_MAP(k, v) {.format = MPV_FORMAT_NODE_MAP, .u = { .list =       \
+    &(struct mpv_node_list) {                                               \
+        .num = sizeof(VAL_LIST(v)) / sizeof(struct mpv_node),               \
+        .values = VAL_LIST(v),                                              \
+        .keys = (char**)(const char *[]){k}}}}
+
+static const struct entry entries[] = {
+    { BIN("\xc0"), NODE_NONE()},
+    { BIN("\xc3"), NODE_BOOL(true)},
+    { BIN("\xc2"), NODE_BOOL(false)},
+    { BIN(""), .expect_fail = true},
+    { BIN("\xc1"), .expect_fail = true},
+    { BIN("\x7b"), NODE_INT64(123)},
+    { BIN("\xff"), NODE_INT64(-1)},
+    { BIN("\xcc\xc8"), NODE_INT64(200)},
+    { BIN("\xd0\x80"), NODE_INT64(-128)},
+    { BIN("\xd1\xfe\x0c"), NODE_INT64(-500)},
+    { BIN("\xce\x00\x01\x00\x00"), NODE_INT64(65536)},
+    { BIN("\xd3\x80\x00\x00\x00\x00\x00\x00\x00"), NODE_INT64(INT64_MIN)},
+    { BIN("\xcf\xff\xff\xff\xff\xff\xff\xff\xff"), .expect_fail = true},
+    { BIN("\xd0\x05"), NODE_INT64(5), .non_canonical = true},
+    { BIN("\xcb\x40\x5e\xd0\x00\x00\x00\x00\x00"), NODE_FLOAT(123.25)},
+    { BIN("\xca\x42\xf6\x80\x00"), NODE_FLOAT(123.25), .non_canonical = true},
+    { BIN("\xa3""abc"), NODE_STR("abc")},
+    { BIN("\xa3""ab"), .expect_fail = true},
+    { BIN("\x93\x01\x02\x03"),
+        NODE_ARRAY(NODE_INT64(1), NODE_INT64(2), NODE_INT64(3))},
+    { BIN("\x90"), NODE_ARRAY()},
+    { BIN("\xdd\xff\xff\xff\xff\x01"), .expect_fail = true},
+    { BIN("\x82\xa1""a\x01\xa1""b\x02"),
+        NODE_MAP(L("a", "b"), L(NODE_INT64(1), NODE_INT64(2)))},
+    { BIN("\x80"), NODE_MAP(L(), L())},
+    { BIN("\x81\x01\x02"), .expect_fail = true},
+    { BIN("\xd4\x01\x00"), .expect_fail = true},
+};
+
+#define MAX_DEPTH 10
+
+static void run(struct test_ctx *ctx)
+{
+    for (int n = 0; n < MP_ARRAY_SIZE(entries); n++) {
+        const struct entry *e = &entries[n];
+        void *tmp = talloc_new(NULL);
+        bstr src = {(unsigned char *)e->src, e->src_len};
+        struct mpv_node res;
+        bool ok = msgpack_parse(tmp, &res, &src, MAX_DEPTH) >= 0;
+        assert_true(ok != e->expect_fail);
+        if (!ok) {
+            talloc_free(tmp);
+            continue;
+        }
+        assert_int_equal(src.len, 0);
+        assert_true(equal_mpv_node(&e->out_data, &res));
+        bstr d = {0};
+        assert_true(msgpack_write(tmp, &d, &res) >= 0);
+        if (!e->non_canonical) {
+            assert_int_equal(d.len, e->src_len);
+            assert_memcmp(d.start, e->src, d.len);
+        }
+        talloc_free(tmp);
+    }
+
+    // Roundtrip of all length classes.
+    static const int sizes[] = {0, 15, 16, 31, 32, 255, 256, 65535, 65536};
+    for (int n = 0; n < MP_ARRAY_SIZE(sizes); n++) {
+        void *tmp = talloc_new(NULL);
+        struct mpv_node arr;
+        node_init(&arr, MPV_FORMAT_NODE_ARRAY, NULL);
+        talloc_steal(tmp, arr.u.list);
+        char *s = talloc_zero_size(tmp, sizes[n] + 1);
+        memset(s, 'x', sizes[n]);
+        for (int i = 0; i < sizes[n]; i++)
+            node_array_add(&arr, MPV_FORMAT_INT64)->u.int64 = -i * 1000;
+        struct mpv_node map = {.format = MPV_FORMAT_NODE_MAP,
+            .u.list = &(struct mpv_node_list){
+                .num = 2,
+                .keys = (char *[]){s, "k"},
+                .values = (struct mpv_node[]){
+                    arr, {.format = MPV_FORMAT_STRING, .u.string = s}},
+            }};
+        bstr d = {0};
+        assert_true(msgpack_write(tmp, &d, &map) >= 0);
+        struct mpv_node res;
+        assert_true(msgpack_parse(tmp, &res, &d, MAX_DEPTH) >= 0);
+        assert_int_equal(d.len, 0);
+        assert_true(equal_mpv_node(&map, &res));
+        talloc_free(tmp);
+    }
+}
+
+const struct unittest test_msgpack = {
+    .name = "msgpack",
+    .run = run,
+};
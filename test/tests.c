@@ -8,7 +8,9 @@ static const struct unittest *unittests[] = {
     &test_gl_video,
     &test_img_format,
     &test_json,
+    &test_json_benchmark,
     &test_linked_list,
+    &test_msgpack,
     &test_paths,
     &test_repack_sws,
 #if HAVE_ZIMG
@@ -55,7 +57,8 @@ bool run_tests(struct MPContext *mpctx)
             (t->run        ? (1 << 1) : 0)));
 
         bool run = false;
-        run |= strcmp(sel, "all-simple") == 0 && !t->is_complex;
+        run |= strcmp(sel, "all-simple") == 0 && !t->is_complex &&
+               !t->is_benchmark;
         run |= strcmp(sel, t->name) == 0;
 
         if (run) {
@@ -28,6 +28,9 @@ struct unittest {
     // Cannot run without additional arguments supplied.
     bool is_complex;
 
+    // Only measures performance, and is run only if selected by name.
+    bool is_benchmark;
+
     // Entrypoints. There are various for various purposes. Only 1 of them must
     // be set.
 
@@ -40,7 +43,9 @@ extern const struct unittest test_chmap;
 extern const struct unittest test_gl_video;
 extern const struct unittest test_img_format;
 extern const struct unittest test_json;
+extern const struct unittest test_json_benchmark;
 extern const struct unittest test_linked_list;
+extern const struct unittest test_msgpack;
 extern const struct unittest test_repack_sws;
 extern const struct unittest test_repack_zimg;
 extern const struct unittest test_repack;
@@ -199,6 +199,9 @@ struct vo_frame {
     int64_t pts;
     // Approximate frame duration, in us.
     int duration;
+    // mp_time_us() time at which the frame was queued to the VO, i.e. when
+    // decoding and filtering of the current frame was done.
+    int64_t queue_time;
     // Realtime of estimated distance between 2 vsync events.
     double vsync_interval;
     // "ideal" display time within the vsync
@@ -25,13 +25,57 @@
 #include "vo.h"
 #include "video/mp_image.h"
 #include "sub/osd.h"
+#include "sub/draw_bmp.h"
+#include "osdep/timer.h"
+#include "common/stats.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_VERSION 6
+#define MAX_COPY_SLOTS 16
+#define MAX_DR_SLOTS 32
+#define MAX_SLOTS (MAX_COPY_SLOTS + MAX_DR_SLOTS)
+#define SLOT_ALIGN 4096
+#define SLOT_NONE 0xFFFFFFFF
+#define FRAME_NONE 0xFFFFFFFF
+#define MAX_OSD_ACTIVE_RECTS 4
+#define MAX_OSD_DIRTY_RECTS 16
+
+struct rect_t {
+    int32_t x0, y0, x1, y1;
+};
+
+// One frame buffer of the ring. The producer increments seq before and after
+// writing the slot, so it is odd while the slot is being written. A reader
+// loads seq, copies the data, and retries if seq was odd or has changed.
+struct slot_t {
+    uint32_t seq;
+    uint32_t frame_count;
+    uint32_t offset; // offset of the image data from the start of the buffer
+    // Plane layout of the image in this slot (version >= 3). The offsets are
+    // relative to offset. Unused planes have stride 0.
+    uint32_t plane_offset[4];
+    uint32_t plane_stride[4];
+    // Timing (version >= 6). Times are in microseconds on mpv's clock, see
+    // header->clock_offset.
+    int64_t duration;     // approximate frame duration, or -1 if unknown
+    double pts;           // video timestamp in seconds
+    int64_t target_time;  // when the frame should be displayed, 0 if ASAP
+    int64_t queue_time;   // when the decoded frame was queued to the VO
+    int64_t publish_time; // when the slot was published
+    uint32_t reserved[4];
+};
+
 struct header_t {
     uint32_t header_size;
     uint32_t video_buffer_size;
@@ -53,80 +97,293 @@ struct header_t {
     int32_t colorspace_light;
     float colorspace_sig_peak;
     int32_t chroma_location;
-    uint32_t reserved[20];
-} * header;
+    // Ring buffer (version >= 2)
+    uint32_t version;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint32_t latest_slot; // last completely written slot, or SLOT_NONE
+    // Incremented each time a new slot is published. On Linux, this is a
+    // futex word: readers increment waiters while they FUTEX_WAIT on it, and
+    // mpv issues a FUTEX_WAKE after publishing if waiters is non-zero.
+    uint32_t wakeup;
+    uint32_t waiters;
+    // Written by the reader: frame_count of the last frame it finished
+    // reading, or FRAME_NONE. Used for --shm-ack-timeout. A reader should
+    // FUTEX_WAKE this word after updating it.
+    uint32_t reader_ack;
+    // Direct rendering slots (version >= 3). They follow the copy slots in
+    // slots[], i.e. they are slots[num_slots] to slots[num_slots+num_dr_slots-1].
+    uint32_t num_dr_slots;
+    uint32_t dr_slot_size;
+    // Set to 1 when mpv stops using this buffer (e.g. on reconfig). Readers
+    // should reopen the buffer by name.
+    uint32_t invalid;
+    // Image format details (version >= 4). The plane offsets and strides are
+    // in the slots, as they differ between copy and DR slots.
+    uint32_t num_planes;
+    uint32_t plane_width[4];  // in pixels
+    uint32_t plane_height[4];
+    uint32_t plane_bpp[4];    // bits per pixel, including padding
+    uint32_t component_bytes; // bytes per sample (1 or 2)
+    uint32_t component_bits;  // significant bits per sample
+    int32_t component_pad;    // >0: LSB padding (e.g. P010), <0: MSB padding
+    char format_name[16];     // mpv image format name, e.g. "p010"
+    // OSD and subtitle overlay (version >= 5), only with --shm-osd-overlay.
+    // BGRA with premultiplied alpha, at video resolution. osd_seq works like
+    // the slot sequence counters. The overlay is only written when the OSD
+    // changes, and osd_change_id is incremented each time.
+    uint32_t osd_seq;
+    uint32_t osd_change_id;
+    uint32_t osd_offset; // 0 if there is no overlay
+    uint32_t osd_width;
+    uint32_t osd_height;
+    uint32_t osd_stride;
+    // Regions containing visible OSD pixels. Everything else is transparent.
+    uint32_t osd_num_active;
+    struct rect_t osd_active[MAX_OSD_ACTIVE_RECTS];
+    // Regions modified by the last change.
+    uint32_t osd_num_dirty;
+    struct rect_t osd_dirty[MAX_OSD_DIRTY_RECTS];
+    uint32_t reserved0;
+    // Timing (version >= 6). Adding clock_offset to the times used in the
+    // header converts them to CLOCK_MONOTONIC microseconds.
+    int64_t clock_offset;
+    // Optional, written by the reader together with reader_ack: the
+    // CLOCK_MONOTONIC time in microseconds it finished reading the frame.
+    int64_t reader_ack_time;
+    uint32_t reserved[10];
+    struct slot_t slots[MAX_SLOTS];
+};
 
+// Plane layout used for the copy slots.
+struct shm_layout {
+    int num_planes;
+    uint32_t offset[4];
+    uint32_t stride[4];
+    uint32_t width[4];
+    uint32_t line_bytes[4];
+    uint32_t lines[4];
+    uint32_t size;
+};
+
+// A mapping of the shared memory object. Images handed to the decoder for
+// direct rendering point into it, so it is refcounted and can outlive the VO's
+// use of it (for example across reconfigs).
+struct shm_buffer {
+    struct header_t * header;
+    size_t size;
+    int refs;
+    int imgfmt;
+    int w, h;
+    bool dr_used[MAX_SLOTS];
+};
 
 struct priv {
-    unsigned char * image_data;
+    struct shm_buffer * buf;
     char * buffer_name;
+    int num_slots;
+    int num_dr_slots;
+    int ack_timeout;
+    int osd_overlay;
+    struct mp_draw_sub_cache * osd_cache;
+    int64_t osd_change_id;
+    uint32_t write_slot;
+    uint32_t pending_slot;
+    uint64_t overwritten_frames;
+    struct stats_ctx * stats;
+    // Publish times of the last frames, indexed by frame_count, for
+    // measuring the reader's pickup latency.
+    int64_t publish_times[64];
+    uint32_t last_ack;
+    // DR images currently published (or about to be), indexed by slot.
+    struct mp_image * dr_images[MAX_SLOTS];
+    struct shm_layout layout;
     uint32_t image_width;
     uint32_t image_height;
     uint32_t image_bytes;
-    uint32_t image_stride;
     uint32_t image_format;
     uint32_t frame_count;
-    uint32_t buffer_size;
-    uint32_t video_buffer_size;
 };
 
-static void free_buffers(struct vo *vo)
+static void shm_wake(uint32_t * word)
 {
-    struct priv * p = vo->priv;
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+// Wait until *word is different from val, or until timeout_us has passed.
+// May return early (spurious wakeups); callers must recheck their condition.
+static void shm_wait(uint32_t * word, uint32_t val, int64_t timeout_us)
+{
+#ifdef __linux__
+    struct timespec ts = {
+        .tv_sec = timeout_us / 1000000,
+        .tv_nsec = (timeout_us % 1000000) * 1000,
+    };
+    syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    mp_sleep_us(MPMIN(timeout_us, 1000));
+#endif
+}
+
+static int image_bytes(int imgfmt)
+{
+    return (mp_imgfmt_get_desc(imgfmt).bpp[0] + 7) / 8;
+}
+
+static int query_format(struct vo *vo, int format)
+{
+    //MP_INFO(vo, "query_format: %d \n", format);
+    switch(format)
+    {
+        case IMGFMT_420P:
+        case IMGFMT_UYVY:
+        case IMGFMT_RGB24:
+        case IMGFMT_RGB565:
+            return 1;
+    }
+
+    // Planar and semi-planar YUV with 8 to 16 bits per sample (NV12, P010,
+    // yuv420p10, ...). Readers get the plane table and sample format from the
+    // header, so these don't need to be converted.
+    struct mp_imgfmt_desc desc = mp_imgfmt_get_desc(format);
+    struct mp_regular_imgfmt reg;
+    if ((desc.flags & (MP_IMGFLAG_YUV_P | MP_IMGFLAG_YUV_NV)) &&
+        (desc.flags & MP_IMGFLAG_NE) &&
+        mp_get_regular_imgfmt(&reg, format) &&
+        reg.component_type == MP_COMPONENT_TYPE_UINT &&
+        reg.component_size <= 2)
+        return 1;
+
+    return 0;
+}
+
+// Layout of the copy slots. Planes are stored back to back without padding.
+// The exception is 420P, which is stored the way readers of the old single
+// buffer layout expect: the U plane at w*h and the V plane at w*h*3/2.
+static void get_layout(struct shm_layout * l, int imgfmt, int w, int h)
+{
+    struct mp_imgfmt_desc desc = mp_imgfmt_get_desc(imgfmt);
+
+    *l = (struct shm_layout){0};
+
+    if (imgfmt == IMGFMT_420P) {
+        l->width[0] = l->stride[0] = l->line_bytes[0] = w;
+        l->lines[0] = h;
+        for (int n = 1; n < 3; n++) {
+            l->width[n] = l->stride[n] = l->line_bytes[n] = w / 2;
+            l->lines[n] = h / 2;
+        }
+        l->offset[1] = w * h;
+        l->offset[2] = w * h + (w * h) / 2;
+        l->num_planes = 3;
+        l->size = w * h * 2;
+        return;
+    }
+
+    w = MP_ALIGN_UP(w, desc.align_x);
+    h = MP_ALIGN_UP(h, desc.align_y);
+
+    l->num_planes = desc.num_planes;
+    for (int n = 0; n < desc.num_planes; n++) {
+        l->width[n] = mp_chroma_div_up(w, desc.xs[n]);
+        l->lines[n] = mp_chroma_div_up(h, desc.ys[n]);
+        l->line_bytes[n] = (l->width[n] * desc.bpp[n] + 7) / 8;
+        l->stride[n] = l->line_bytes[n];
+        l->offset[n] = l->size;
+        l->size += l->stride[n] * l->lines[n];
+    }
+}
+
+// Estimated DR slot size for a video of the given size. The decoder usually
+// asks for images padded to its internal alignment.
+static int get_dr_slot_size(int imgfmt, int w, int h, int stride_align)
+{
+    int size = mp_image_get_alloc_size(imgfmt, w, h, stride_align);
+    if (size < 0)
+        return -1;
+    return MP_ALIGN_UP(size + stride_align, SLOT_ALIGN);
+}
+
+static struct slot_t * get_dr_slot(struct header_t * header, int n)
+{
+    return &header->slots[header->num_slots + n];
+}
+
+static void unref_buffer(struct shm_buffer * buf)
+{
+    if (!buf || --buf->refs > 0)
+        return;
 
-    if (munmap(header, p->buffer_size) == -1) {
+    if (munmap(buf->header, buf->size) == -1) {
         //MP_INFO(vo, "uninit: munmap failed. Error: %s\n", strerror(errno));
     }
+    talloc_free(buf);
+}
+
+// Drop the reference to a DR image held for a published slot. The slot's
+// sequence counter is made odd first, because the decoder may write to the
+// image as soon as the reference is gone.
+static void release_dr_image(struct vo *vo, uint32_t idx)
+{
+    struct priv * p = vo->priv;
+
+    if (!p->dr_images[idx])
+        return;
+
+    struct slot_t * slot = &p->buf->header->slots[idx];
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_SEQ_CST);
+    talloc_free(p->dr_images[idx]);
+    p->dr_images[idx] = NULL;
+}
+
+static void free_buffers(struct vo *vo)
+{
+    struct priv * p = vo->priv;
+
+    if (!p->buf)
+        return;
+
+    for (int n = 0; n < MAX_SLOTS; n++)
+        release_dr_image(vo, n);
+
+    __atomic_store_n(&p->buf->header->invalid, 1, __ATOMIC_RELEASE);
+    unref_buffer(p->buf);
+    p->buf = NULL;
 
     if (shm_unlink(p->buffer_name) == -1) {
         //MP_INFO(vo, "uninit: shm_unlink failed. Error: %s\n", strerror(errno));
     }
 }
 
-static int reconfig(struct vo *vo, struct mp_image_params *params)
+// (Re)create the shared buffer, with copy slots large enough for a w*h image
+// and DR slots of dr_slot_size bytes each.
+static int create_buffers(struct vo *vo, int imgfmt, int w, int h,
+                          int dr_slot_size)
 {
-    MP_INFO(vo, "reconfig: w: %d h: %d format: %d \n", params->w, params->h, params->imgfmt);
-    /*
-    MP_INFO(vo, "reconfig: color space: %d levels: %d primaries: %d gamma: %d light: %d\n",
-                 params->color.space, params->color.levels, params->color.primaries, params->color.gamma, params->color.light);
-    MP_INFO(vo, "reconfig: chroma_location: %d rotate: %d stereo3d: %d\n", params->chroma_location, params->rotate, params->stereo3d);
-    */
+    struct priv * p = vo->priv;
 
     free_buffers(vo);
 
-    struct priv * p = vo->priv;
+    struct shm_layout layout;
+    get_layout(&layout, imgfmt, w, h);
 
-    p->image_width = params->w;
-    p->image_height = params->h;
-    p->image_format = params->imgfmt;
+    size_t header_size = MP_ALIGN_UP(sizeof(struct header_t), SLOT_ALIGN);
+    size_t slot_size = MP_ALIGN_UP(layout.size, SLOT_ALIGN);
+    int num_dr_slots = dr_slot_size > 0 ? p->num_dr_slots : 0;
+    size_t osd_offset = header_size + slot_size * p->num_slots +
+                        (size_t)dr_slot_size * num_dr_slots;
+    size_t osd_size = p->osd_overlay ? MP_ALIGN_UP(w * 4 * h, SLOT_ALIGN) : 0;
+    size_t buffer_size = osd_offset + osd_size;
 
-    switch (p->image_format)
-    {
-        case IMGFMT_RGB24:
-            p->image_bytes = 3;
-            break;
-        case IMGFMT_RGB565:
-            p->image_bytes = 2;
-            break;
-        case IMGFMT_420P:
-            p->image_bytes = 1;
-            break;
-        case IMGFMT_NV12:
-        case IMGFMT_UYVY:
-            p->image_bytes = 2;
-            break;
-        default:
-            p->image_bytes = 3;
-    }
-    p->image_stride = p->image_width * p->image_bytes;
-    p->video_buffer_size = p->image_stride * p->image_height;
-    if (p->image_format == IMGFMT_420P) {
-        p->video_buffer_size = p->image_width * p->image_height * 2;
-    }
+    MP_INFO(vo, "video buffer size: %d slots: %d dr slots: %d\n", layout.size,
+            p->num_slots, num_dr_slots);
 
-    MP_INFO(vo, "w: %d h: %d format: %d\n", p->image_width, p->image_height, p->image_format);
-    MP_INFO(vo, "stride: %d bytes: %d\n", p->image_stride, p->image_bytes);
-    MP_INFO(vo, "video buffer size: %d\n", p->video_buffer_size);
+    if (buffer_size > UINT32_MAX) {
+        MP_FATAL(vo, "shared buffer too large (%zu bytes)\n", buffer_size);
+        return -1;
+    }
 
     MP_INFO(vo, "writing output to a shared buffer named \"%s\"\n", p->buffer_name);
 
@@ -138,9 +395,7 @@ static int reconfig(struct vo *vo, struct mp_image_params *params)
         return -1;
     }
 
-    p->buffer_size = sizeof(header) + p->video_buffer_size;
-
-    if (ftruncate(shm_fd, p->buffer_size) == -1)
+    if (ftruncate(shm_fd, buffer_size) == -1)
     {
         MP_FATAL(vo, "failed to size shared memory, possibly already in use. Error: %s\n", strerror(errno));
         close(shm_fd);
@@ -148,21 +403,126 @@ static int reconfig(struct vo *vo, struct mp_image_params *params)
         return -1;
     }
 
-    header = mmap(NULL, p->buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    struct header_t * header = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     close(shm_fd);
 
     if (header == MAP_FAILED)
     {
         MP_FATAL(vo, "failed to map shared memory. Error: %s\n", strerror(errno));
         shm_unlink(p->buffer_name);
-        return 1;
+        return -1;
     }
 
-    header->header_size = sizeof(struct header_t);
-    header->video_buffer_size = p->video_buffer_size;
+    p->buf = talloc_ptrtype(NULL, p->buf);
+    *p->buf = (struct shm_buffer){
+        .header = header,
+        .size = buffer_size,
+        .refs = 1,
+        .imgfmt = imgfmt,
+        .w = w,
+        .h = h,
+    };
+
+    header->header_size = header_size;
+    header->video_buffer_size = layout.size;
+    header->format = imgfmt;
+
+    // Slot 0 starts right after the header, so consumers which only know
+    // about a single buffer still find an image at header_size.
+    header->version = SHM_VERSION;
+    header->num_slots = p->num_slots;
+    header->slot_size = slot_size;
+    header->num_dr_slots = num_dr_slots;
+    header->dr_slot_size = num_dr_slots ? dr_slot_size : 0;
+    for (int n = 0; n < p->num_slots; n++)
+        header->slots[n].offset = header_size + n * slot_size;
+    for (int n = 0; n < num_dr_slots; n++) {
+        struct slot_t * slot = get_dr_slot(header, n);
+        slot->offset = header_size + p->num_slots * slot_size + n * dr_slot_size;
+        slot->seq = 1; // not readable until published
+    }
+    if (osd_size) {
+        header->osd_offset = osd_offset;
+        header->osd_stride = w * 4;
+    }
+    header->reader_ack = p->last_ack = FRAME_NONE;
+    header->clock_offset = mp_raw_time_us() - mp_time_us();
+    __atomic_store_n(&header->latest_slot, SLOT_NONE, __ATOMIC_RELEASE);
+    p->write_slot = 0;
+    p->pending_slot = SLOT_NONE;
 
-    p->image_data = (unsigned char*) header + header->header_size;
-    //MP_INFO(vo, "header: %p image_data: %p\n", header, p->image_data);
+    return 0;
+}
+
+static int reconfig(struct vo *vo, struct mp_image_params *params)
+{
+    MP_INFO(vo, "reconfig: w: %d h: %d format: %d \n", params->w, params->h, params->imgfmt);
+    /*
+    MP_INFO(vo, "reconfig: color space: %d levels: %d primaries: %d gamma: %d light: %d\n",
+                 params->color.space, params->color.levels, params->color.primaries, params->color.gamma, params->color.light);
+    MP_INFO(vo, "reconfig: chroma_location: %d rotate: %d stereo3d: %d\n", params->chroma_location, params->rotate, params->stereo3d);
+    */
+
+    struct priv * p = vo->priv;
+
+    p->image_width = params->w;
+    p->image_height = params->h;
+    p->image_format = params->imgfmt;
+    p->image_bytes = image_bytes(p->image_format);
+    get_layout(&p->layout, p->image_format, p->image_width, p->image_height);
+
+    MP_INFO(vo, "w: %d h: %d format: %d\n", p->image_width, p->image_height, p->image_format);
+    MP_INFO(vo, "stride: %d bytes: %d\n", p->layout.stride[0], p->image_bytes);
+
+    // The decoder might have created the buffer already when requesting DR
+    // images. Keep it if it's large enough and nothing was published yet, so
+    // these images stay usable.
+    struct header_t * header = p->buf ? p->buf->header : NULL;
+    bool reuse = header && p->buf->imgfmt == p->image_format &&
+                 p->image_width <= p->buf->w && p->image_height <= p->buf->h &&
+                 p->layout.size <= header->slot_size &&
+                 header->latest_slot == SLOT_NONE &&
+                 p->pending_slot == SLOT_NONE;
+    if (!reuse) {
+        int dr_slot_size = 0;
+        if (p->num_dr_slots) {
+            dr_slot_size = get_dr_slot_size(p->image_format,
+                                            p->image_width + 64,
+                                            p->image_height + 64, 64);
+        }
+        if (create_buffers(vo, p->image_format, p->image_width,
+                           p->image_height, dr_slot_size) < 0)
+            return -1;
+        header = p->buf->header;
+    }
+
+    header->video_buffer_size = p->layout.size;
+    header->width = p->image_width;
+    header->height = p->image_height;
+    header->bytes = p->image_bytes;
+    for (int n = 0; n < 3; n++)
+        header->stride[n] = n < p->layout.num_planes ? p->layout.stride[n] : 0;
+    header->planes = mp_imgfmt_get_desc(p->image_format).num_planes;
+    header->format = p->image_format;
+
+    struct mp_imgfmt_desc desc = mp_imgfmt_get_desc(p->image_format);
+    header->num_planes = p->layout.num_planes;
+    for (int n = 0; n < 4; n++) {
+        header->plane_width[n] = p->layout.width[n];
+        header->plane_height[n] = p->layout.lines[n];
+        header->plane_bpp[n] = n < desc.num_planes ? desc.bpp[n] : 0;
+    }
+    struct mp_regular_imgfmt reg;
+    if (mp_get_regular_imgfmt(&reg, p->image_format)) {
+        header->component_bytes = reg.component_size;
+        header->component_bits = reg.component_size * 8 - abs(reg.component_pad);
+        header->component_pad = reg.component_pad;
+    } else {
+        header->component_bytes = header->component_bits = 0;
+        header->component_pad = 0;
+    }
+    snprintf(header->format_name, sizeof(header->format_name), "%s",
+             mp_imgfmt_to_name(p->image_format));
 
     header->rotate = params->rotate;
     header->colorspace = params->color.space;
@@ -173,66 +533,399 @@ static int reconfig(struct vo *vo, struct mp_image_params *params)
     header->colorspace_sig_peak = params->color.sig_peak;
     header->chroma_location = params->chroma_location;
 
+    if (header->osd_offset) {
+        header->osd_seq++;
+        memset((uint8_t *) header + header->osd_offset, 0,
+               header->osd_stride * p->buf->h);
+        header->osd_width = p->image_width;
+        header->osd_height = p->image_height;
+        header->osd_num_active = header->osd_num_dirty = 0;
+        header->osd_change_id++;
+        __atomic_store_n(&header->osd_seq, header->osd_seq + 1, __ATOMIC_RELEASE);
+    }
+    // The overlay was cleared, so make sure everything is drawn again.
+    TA_FREEP(&p->osd_cache);
+    p->osd_change_id = -1;
+
+    for (int n = 0; n < p->num_slots; n++) {
+        struct slot_t * slot = &header->slots[n];
+        for (int i = 0; i < 4; i++) {
+            slot->plane_offset[i] = p->layout.offset[i];
+            slot->plane_stride[i] = p->layout.stride[i];
+        }
+    }
+
     return 0;
 }
 
-static void draw_image(struct vo *vo, mp_image_t *mpi)
+static void free_dr_buffer(void *opaque, uint8_t *data)
 {
-    //MP_INFO(vo, "draw_image \n");
+    struct shm_buffer * buf = opaque;
+    struct header_t * header = buf->header;
 
-    if (!mpi) {
-        //MP_WARN(vo, "no mpi \n");
-        return;
+    for (int n = 0; n < header->num_dr_slots; n++) {
+        if ((uint8_t *) header + get_dr_slot(header, n)->offset == data)
+            buf->dr_used[n] = false;
     }
+    unref_buffer(buf);
+}
 
+static struct mp_image *get_image(struct vo *vo, int imgfmt, int w, int h,
+                                  int stride_align)
+{
     struct priv * p = vo->priv;
 
-    header->width = p->image_width;
-    header->height = p->image_height;
-    header->bytes = p->image_bytes;
-    header->stride[0] = p->image_stride;
-    if (p->image_format == IMGFMT_420P) {
-        header->stride[1] = header->stride[2] = p->image_width / 2;
-    } else {
-        header->stride[1] = header->stride[2] = 0;
+    if (!p->num_dr_slots || !query_format(vo, imgfmt) ||
+        stride_align > SLOT_ALIGN)
+        return NULL;
+
+    int size = get_dr_slot_size(imgfmt, w, h, stride_align);
+    if (size < 0)
+        return NULL;
+
+    // The decoder requests images before the VO is configured, and failing
+    // here disables DR for the rest of the decoding session. So create the
+    // buffer here if it's missing; reconfig() keeps it if it fits. Once the
+    // buffer exists, only reconfig() may replace it, because queued frames
+    // and the header's layout refer to it. Mismatching requests fall back to
+    // copying.
+    if (!p->buf) {
+        if (create_buffers(vo, imgfmt, w, h, size) < 0)
+            return NULL;
+    }
+    struct header_t * header = p->buf->header;
+    if (p->buf->imgfmt != imgfmt || size > header->dr_slot_size) {
+        MP_DBG(vo, "DR request does not match the buffer\n");
+        return NULL;
     }
 
-    header->planes = mpi->num_planes;
-    header->format = p->image_format;
-    header->frame_count = p->frame_count++;
-    header->fps = mpi->nominal_fps;
+    for (int n = 0; n < header->num_dr_slots; n++) {
+        if (p->buf->dr_used[n])
+            continue;
+        struct slot_t * slot = get_dr_slot(header, n);
+        struct mp_image * res =
+            mp_image_from_buffer(imgfmt, w, h, stride_align,
+                                 (uint8_t *) header + slot->offset,
+                                 header->dr_slot_size, p->buf, free_dr_buffer);
+        if (!res)
+            return NULL;
+        p->buf->dr_used[n] = true;
+        p->buf->refs++;
+        return res;
+    }
+
+    MP_DBG(vo, "all DR slots in use\n");
+    return NULL;
+}
+
+// Return the index of the DR slot mpi was decoded into, or -1 if mpi does not
+// (completely) point into one.
+static int find_dr_slot(struct priv * p, struct mp_image * mpi)
+{
+    struct header_t * header = p->buf->header;
+    uint8_t * base = (uint8_t *) header;
+
+    if (!header->num_dr_slots || mpi->planes[0] < base ||
+        mpi->planes[0] >= base + p->buf->size)
+        return -1;
+
+    for (int n = 0; n < header->num_dr_slots; n++) {
+        struct slot_t * slot = get_dr_slot(header, n);
+        uint8_t * start = base + slot->offset;
+        uint8_t * end = start + header->dr_slot_size;
+        bool ok = true;
+        for (int i = 0; i < mpi->num_planes; i++) {
+            int plane_h = mp_image_plane_h(mpi, i);
+            ok &= mpi->stride[i] > 0 && mpi->planes[i] >= start &&
+                  mpi->planes[i] + (size_t)mpi->stride[i] * plane_h <= end;
+        }
+        if (ok)
+            return header->num_slots + n;
+    }
+    return -1;
+}
+
+static void copy_image(struct priv * p, unsigned char * dst, struct mp_image * mpi)
+{
+    struct shm_layout * l = &p->layout;
+    for (int n = 0; n < l->num_planes; n++) {
+        memcpy_pic(dst + l->offset[n], mpi->planes[n], l->line_bytes[n],
+                   l->lines[n], l->stride[n], mpi->stride[n]);
+    }
+}
+
+static void copy_rects(struct rect_t * dst, const struct mp_rect * src, int num)
+{
+    for (int n = 0; n < num; n++)
+        dst[n] = (struct rect_t){src[n].x0, src[n].y0, src[n].x1, src[n].y1};
+}
+
+// Render the OSD into the overlay region instead of the video, if it changed.
+static void update_osd(struct vo *vo, double pts)
+{
+    struct priv * p = vo->priv;
+    struct header_t * header = p->buf->header;
+
+    struct mp_osd_res res = osd_res_from_image_params(vo->params);
+    struct sub_bitmap_list * sbs = osd_render(vo->osd, res, pts, 0,
+                                              mp_draw_sub_formats);
+
+    if (sbs->change_id == p->osd_change_id)
+        goto done;
+    p->osd_change_id = sbs->change_id;
+
+    if (!p->osd_cache)
+        p->osd_cache = mp_draw_sub_alloc(p, vo->global);
+
+    struct mp_rect act_rc[MAX_OSD_ACTIVE_RECTS], mod_rc[MAX_OSD_DIRTY_RECTS];
+    int num_act_rc = 0, num_mod_rc = 0;
+
+    struct mp_image * osd = mp_draw_sub_overlay(p->osd_cache, sbs,
+                    act_rc, MP_ARRAY_SIZE(act_rc), &num_act_rc,
+                    mod_rc, MP_ARRAY_SIZE(mod_rc), &num_mod_rc);
+
+    if (!osd || !num_mod_rc || osd->w > header->osd_width ||
+        osd->h > header->osd_height)
+        goto done;
+
+    uint8_t * dst = (uint8_t *) header + header->osd_offset;
+
+    __atomic_store_n(&header->osd_seq, header->osd_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (int n = 0; n < num_mod_rc; n++) {
+        struct mp_rect * rc = &mod_rc[n];
+        memcpy_pic(dst + rc->y0 * header->osd_stride + rc->x0 * 4,
+                   mp_image_pixel_ptr(osd, 0, rc->x0, rc->y0),
+                   mp_rect_w(*rc) * 4, mp_rect_h(*rc),
+                   header->osd_stride, osd->stride[0]);
+    }
+    copy_rects(header->osd_active, act_rc, num_act_rc);
+    header->osd_num_active = num_act_rc;
+    copy_rects(header->osd_dirty, mod_rc, num_mod_rc);
+    header->osd_num_dirty = num_mod_rc;
+    header->osd_change_id++;
+
+    __atomic_store_n(&header->osd_seq, header->osd_seq + 1, __ATOMIC_RELEASE);
+
+done:
+    talloc_free(sbs);
+}
+
+// With --shm-ack-timeout, wait until the reader has acknowledged the frame
+// stored in the given slot, so it isn't overwritten before being read.
+static void wait_reader(struct vo *vo, struct slot_t * slot)
+{
+    struct priv * p = vo->priv;
+    struct header_t * header = p->buf->header;
+
+    if (!p->ack_timeout || !slot->seq)
+        return;
+
+    int64_t deadline = mp_time_us() + p->ack_timeout * 1000LL;
+    while (1) {
+        uint32_t ack = __atomic_load_n(&header->reader_ack, __ATOMIC_ACQUIRE);
+        if (ack == FRAME_NONE || (int32_t)(slot->frame_count - ack) <= 0)
+            return;
+        int64_t left = deadline - mp_time_us();
+        if (left <= 0) {
+            MP_TRACE(vo, "reader did not ack frame %u, overwriting\n",
+                     (unsigned)slot->frame_count);
+            p->overwritten_frames++;
+            stats_event(p->stats, "overwritten");
+            return;
+        }
+        shm_wait(&header->reader_ack, ack, left);
+    }
+}
+
+static void set_slot_timing(struct slot_t * slot, struct vo_frame * frame,
+                            struct mp_image * mpi)
+{
+    slot->duration = frame->duration;
+    slot->pts = mpi->pts;
+    slot->target_time = frame->pts;
+    slot->queue_time = frame->queue_time;
+    slot->publish_time = 0;
+}
 
-    struct mp_osd_res dim = osd_res_from_image_params(vo->params);
-    osd_draw_on_image(vo->osd, dim, mpi->pts, 0, mpi);
+static void draw_frame(struct vo *vo, struct vo_frame *frame)
+{
+    //MP_INFO(vo, "draw_frame \n");
+
+    struct priv * p = vo->priv;
+
+    // Nothing to do for repeated frames, the slot is still published.
+    if (!p->buf || !frame->current || (frame->repeat && !frame->redraw))
+        return;
+
+    struct header_t * header = p->buf->header;
+
+    // With the overlay, redraws only need to update the OSD.
+    if (header->osd_offset) {
+        update_osd(vo, frame->current->pts);
+        if (frame->redraw)
+            return;
+    }
+
+    struct mp_image * mpi = mp_image_new_ref(frame->current);
+    if (!header->osd_offset) {
+        struct mp_osd_res dim = osd_res_from_image_params(vo->params);
+        osd_draw_on_image(vo->osd, dim, mpi->pts, 0, mpi);
+    }
 
     //MP_INFO(vo, "w: %d h: %d stride: %d fps: %f \n", mpi->w, mpi->h, mpi->stride[0], mpi->nominal_fps);
 
-    header->busy = 1;
-    if (p->image_format == IMGFMT_420P) {
-        unsigned char * ptr = p->image_data;
-        int size = p->image_stride * p->image_height;
-        memcpy_pic(ptr, mpi->planes[0], p->image_width, p->image_height, p->image_stride, mpi->stride[0]);
-        ptr += size;
-        size = (p->image_width * p->image_height) / 2;
-        memcpy_pic(ptr, mpi->planes[1], p->image_width / 2, p->image_height / 2, p->image_width / 2, mpi->stride[1]);
-        ptr += size;
-        memcpy_pic(ptr, mpi->planes[2], p->image_width / 2, p->image_height / 2, p->image_width / 2, mpi->stride[2]);
-    } else {
-        memcpy_pic(p->image_data, mpi->planes[0], p->image_width * p->image_bytes, p->image_height, p->image_stride, mpi->stride[0]);
+    header->fps = mpi->nominal_fps;
+
+    // If the decoder rendered directly into one of our slots (and nothing,
+    // like OSD rendering, made a copy), publish that slot without copying.
+    // The image is referenced until another slot is published.
+    int dr_idx = find_dr_slot(p, mpi);
+    if (dr_idx >= 0) {
+        struct slot_t * slot = &header->slots[dr_idx];
+        uint8_t * start = (uint8_t *) header + slot->offset;
+
+        // Unpublished DR slots are always odd. A repeated frame is still
+        // published, so the counter needs to be made odd for the update.
+        if (p->dr_images[dr_idx])
+            __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        for (int n = 0; n < 4; n++) {
+            bool used = n < mpi->num_planes;
+            slot->plane_offset[n] = used ? mpi->planes[n] - start : 0;
+            slot->plane_stride[n] = used ? mpi->stride[n] : 0;
+        }
+        slot->frame_count = p->frame_count;
+        set_slot_timing(slot, frame, mpi);
+
+        __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+        if (p->dr_images[dr_idx]) {
+            talloc_free(mpi);
+        } else {
+            p->dr_images[dr_idx] = mpi;
+        }
+        p->pending_slot = dr_idx;
+        return;
+    }
+
+    // Frames queued before a reconfig might not match the copy slots anymore.
+    if (mpi->imgfmt != p->image_format || mpi->w != p->image_width ||
+        mpi->h != p->image_height || p->layout.size > header->slot_size)
+    {
+        MP_WARN(vo, "dropping frame not matching the buffer layout\n");
+        talloc_free(mpi);
+        return;
     }
-    header->busy = 0;
+
+    // Never write into the slot a reader is most likely copying from. With a
+    // single slot this degrades to the old behaviour (readers have to check
+    // the sequence counter to detect torn frames).
+    uint32_t latest = __atomic_load_n(&header->latest_slot, __ATOMIC_RELAXED);
+    uint32_t idx = p->write_slot;
+    if (idx == latest && p->num_slots > 1)
+        idx = (idx + 1) % p->num_slots;
+    struct slot_t * slot = &header->slots[idx];
+
+    wait_reader(vo, slot);
+
+    // Seqlock write side: odd while writing, even again when done.
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    // Slot 0 is the image location of the old single buffer layout, whose
+    // readers use busy instead of the sequence counter.
+    if (idx == 0)
+        __atomic_store_n(&header->busy, 1, __ATOMIC_RELEASE);
+
+    stats_time_start(p->stats, "copy");
+    copy_image(p, (unsigned char *) header + slot->offset, mpi);
+    stats_time_end(p->stats, "copy");
+    slot->frame_count = p->frame_count;
+    set_slot_timing(slot, frame, mpi);
+
+    if (idx == 0)
+        __atomic_store_n(&header->busy, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+    p->pending_slot = idx;
+    p->write_slot = (idx + 1) % p->num_slots;
 
     talloc_free(mpi);
 }
 
+// Report how long the reader took to pick up a frame after it was published,
+// based on the reader's acknowledgement.
+static void update_pickup_latency(struct vo *vo, int64_t now)
+{
+    struct priv * p = vo->priv;
+    struct header_t * header = p->buf->header;
+
+    uint32_t ack = __atomic_load_n(&header->reader_ack, __ATOMIC_ACQUIRE);
+    if (ack == FRAME_NONE || ack == p->last_ack)
+        return;
+    p->last_ack = ack;
+
+    uint32_t age = p->frame_count - ack;
+    if (age == 0 || age > MP_ARRAY_SIZE(p->publish_times))
+        return;
+
+    int64_t ack_time = __atomic_load_n(&header->reader_ack_time, __ATOMIC_RELAXED);
+    ack_time = ack_time ? ack_time - header->clock_offset : now;
+    int64_t publish_time = p->publish_times[ack % MP_ARRAY_SIZE(p->publish_times)];
+    stats_value(p->stats, "pickup-latency", (ack_time - publish_time) / 1e6);
+}
+
+// The slot written by draw_frame() is made visible to readers only here, which
+// the VO core calls at the frame's display time.
 static void flip_page(struct vo *vo)
 {
     //MP_INFO(vo, "flip_page \n");
+
+    struct priv * p = vo->priv;
+
+    if (!p->buf || p->pending_slot == SLOT_NONE)
+        return;
+
+    struct header_t * header = p->buf->header;
+    uint32_t prev = __atomic_load_n(&header->latest_slot, __ATOMIC_RELAXED);
+    struct slot_t * slot = &header->slots[p->pending_slot];
+    int64_t now = mp_time_us();
+
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->publish_time = now;
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+    p->publish_times[p->frame_count % MP_ARRAY_SIZE(p->publish_times)] = now;
+    if (slot->queue_time)
+        stats_value(p->stats, "queue-to-publish", (now - slot->queue_time) / 1e6);
+
+    __atomic_store_n(&header->latest_slot, p->pending_slot, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->frame_count, p->frame_count++, __ATOMIC_RELEASE);
+
+    __atomic_add_fetch(&header->wakeup, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST))
+        shm_wake(&header->wakeup);
+
+    update_pickup_latency(vo, now);
+
+    // A DR image which is not the latest frame anymore is given back to the
+    // decoder.
+    if (prev != SLOT_NONE && prev != p->pending_slot && p->dr_images[prev]) {
+        wait_reader(vo, &header->slots[prev]);
+        release_dr_image(vo, prev);
+    }
+    p->pending_slot = SLOT_NONE;
 }
 
 static void uninit(struct vo *vo)
 {
     MP_INFO(vo, "uninit \n");
+    struct priv * p = vo->priv;
+    if (p->overwritten_frames)
+        MP_VERBOSE(vo, "%"PRIu64" frames overwritten before the reader "
+                   "acknowledged them\n", p->overwritten_frames);
     free_buffers(vo);
 }
 
@@ -241,22 +934,7 @@ static int preinit(struct vo *vo)
     MP_INFO(vo, "preinit \n");
     struct priv * p = vo->priv;
     MP_INFO(vo, "preinit: buffer_name: %s \n", p->buffer_name);
-    return 0;
-}
-
-static int query_format(struct vo *vo, int format)
-{
-    //MP_INFO(vo, "query_format: %d \n", format);
-    switch(format)
-    {
-        case IMGFMT_420P:
-        //case IMGFMT_NV12:
-        case IMGFMT_UYVY:
-        case IMGFMT_RGB24:
-        //case IMGFMT_RGB565:
-            return 1;
-    }
-
+    p->stats = stats_ctx_create(p, vo->global, "vo-shm");
     return 0;
 }
 
@@ -275,16 +953,22 @@ const struct vo_driver video_out_shm = {
     .query_format = query_format,
     .reconfig = reconfig,
     .control = control,
-    .draw_image = draw_image,
+    .get_image = get_image,
+    .draw_frame = draw_frame,
     .flip_page = flip_page,
     .uninit = uninit,
     .priv_size = sizeof(struct priv),
     .options = (const struct m_option[]) {
        {"buffer-name", OPT_STRING(buffer_name)},
+       {"buffers", OPT_INT(num_slots), M_RANGE(1, MAX_COPY_SLOTS)},
+       {"dr-buffers", OPT_INT(num_dr_slots), M_RANGE(0, MAX_DR_SLOTS)},
+       {"ack-timeout", OPT_INT(ack_timeout), M_RANGE(0, 10000)},
+       {"osd-overlay", OPT_FLAG(osd_overlay)},
        {0}
     },
     .priv_defaults = &(const struct priv) {
         .buffer_name = "mpv",
+        .num_slots = 1,
     },
     .options_prefix = "shm",
 };